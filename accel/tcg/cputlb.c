@@ -217,6 +217,8 @@ static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
     desc->n_used_entries = 0;
     desc->large_page_addr = -1;
     desc->large_page_mask = -1;
+    memset(desc->large_pages, -1, sizeof(desc->large_pages));
+    desc->lp_index = 0;
     desc->vindex = 0;
     memset(fast->table, -1, sizeof_tlb(fast));
     memset(desc->vtable, -1, sizeof(desc->vtable));
@@ -289,10 +291,11 @@ static void flush_all_helper(CPUState *src, run_on_cpu_func fn,
     }
 }
 
-void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
+void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide,
+                      size_t *plp_full, size_t *plp_part)
 {
     CPUState *cpu;
-    size_t full = 0, part = 0, elide = 0;
+    size_t full = 0, part = 0, elide = 0, lp_full = 0, lp_part = 0;
 
     CPU_FOREACH(cpu) {
         CPUArchState *env = cpu->env_ptr;
@@ -300,10 +303,14 @@ void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
         full += atomic_read(&env_tlb(env)->c.full_flush_count);
         part += atomic_read(&env_tlb(env)->c.part_flush_count);
         elide += atomic_read(&env_tlb(env)->c.elide_flush_count);
+        lp_full += atomic_read(&env_tlb(env)->c.lp_full_flush_count);
+        lp_part += atomic_read(&env_tlb(env)->c.lp_part_flush_count);
     }
     *pfull = full;
     *ppart = part;
     *pelide = elide;
+    *plp_full = lp_full;
+    *plp_part = lp_part;
 }
 
 static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
@@ -402,6 +409,20 @@ static inline bool tlb_hit_page_anyprot(CPUTLBEntry *tlb_entry,
            tlb_hit_page(tlb_entry->addr_code, page);
 }
 
+/*
+ * Like tlb_hit_page_anyprot, but match any page within the region
+ * described by @addr and @mask, e.g. a large page.
+ */
+static inline bool tlb_hit_page_mask_anyprot(CPUTLBEntry *tlb_entry,
+                                             target_ulong addr,
+                                             target_ulong mask)
+{
+    mask |= TLB_INVALID_MASK;
+    return addr == (tlb_entry->addr_read & mask) ||
+           addr == (tlb_addr_write(tlb_entry) & mask) ||
+           addr == (tlb_entry->addr_code & mask);
+}
+
 /**
  * tlb_entry_is_empty - return true if the entry is not in use
  * @te: pointer to CPUTLBEntry
@@ -422,6 +443,18 @@ static inline bool tlb_flush_entry_locked(CPUTLBEntry *tlb_entry,
     return false;
 }
 
+/* Called with tlb_c.lock held */
+static inline bool tlb_flush_entry_mask_locked(CPUTLBEntry *tlb_entry,
+                                               target_ulong addr,
+                                               target_ulong mask)
+{
+    if (tlb_hit_page_mask_anyprot(tlb_entry, addr, mask)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
 /* Called with tlb_c.lock held */
 static inline void tlb_flush_vtlb_page_locked(CPUArchState *env, int mmu_idx,
                                               target_ulong page)
@@ -437,18 +470,85 @@ static inline void tlb_flush_vtlb_page_locked(CPUArchState *env, int mmu_idx,
     }
 }
 
+/*
+ * Called with tlb_c.lock held.
+ * Evict all entries of @midx mapping a page within the large page
+ * @lp_addr/@lp_mask.  Depending on the size of the large page relative
+ * to the tlb, either probe the entry of each covered page or scan the
+ * whole table.
+ */
+static void tlb_flush_large_page_locked(CPUArchState *env, int midx,
+                                        target_ulong lp_addr,
+                                        target_ulong lp_mask)
+{
+    CPUTLBDesc *d = &env_tlb(env)->d[midx];
+    CPUTLBDescFast *f = &env_tlb(env)->f[midx];
+    size_t n_pages = ((~lp_mask) >> TARGET_PAGE_BITS) + 1;
+    size_t n_entries = tlb_n_entries(f);
+    size_t i;
+    int k;
+
+    tlb_debug("flushing large page midx %d ("
+              TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
+              midx, lp_addr, lp_mask);
+
+    if (n_pages < n_entries) {
+        for (i = 0; i < n_pages; i++) {
+            target_ulong page = lp_addr + ((target_ulong)i << TARGET_PAGE_BITS);
+
+            if (tlb_flush_entry_locked(tlb_entry(env, midx, page), page)) {
+                tlb_n_used_entries_dec(env, midx);
+            }
+        }
+    } else {
+        for (i = 0; i < n_entries; i++) {
+            if (tlb_flush_entry_mask_locked(&f->table[i], lp_addr, lp_mask)) {
+                tlb_n_used_entries_dec(env, midx);
+            }
+        }
+    }
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        if (tlb_flush_entry_mask_locked(&d->vtable[k], lp_addr, lp_mask)) {
+            tlb_n_used_entries_dec(env, midx);
+        }
+    }
+}
+
 static void tlb_flush_page_locked(CPUArchState *env, int midx,
                                   target_ulong page)
 {
-    target_ulong lp_addr = env_tlb(env)->d[midx].large_page_addr;
-    target_ulong lp_mask = env_tlb(env)->d[midx].large_page_mask;
+    CPUTLBDesc *d = &env_tlb(env)->d[midx];
+    target_ulong lp_addr = d->large_page_addr;
+    target_ulong lp_mask = d->large_page_mask;
+    bool lp_hit = false;
+    int i;
 
-    /* Check if we need to flush due to large pages.  */
+    /* Check if we need to flush due to untracked large pages.  */
     if ((page & lp_mask) == lp_addr) {
         tlb_debug("forcing full flush midx %d ("
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   midx, lp_addr, lp_mask);
         tlb_flush_one_mmuidx_locked(env, midx, get_clock_realtime());
+        atomic_set(&env_tlb(env)->c.lp_full_flush_count,
+                   env_tlb(env)->c.lp_full_flush_count + 1);
+        return;
+    }
+
+    /* Evict only the tracked large pages containing the page.  */
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        CPUTLBLargePage *lp = &d->large_pages[i];
+
+        if ((page & lp->mask) == lp->addr) {
+            tlb_flush_large_page_locked(env, midx, lp->addr, lp->mask);
+            lp->addr = -1;
+            lp->mask = -1;
+            lp_hit = true;
+        }
+    }
+
+    if (lp_hit) {
+        atomic_set(&env_tlb(env)->c.lp_part_flush_count,
+                   env_tlb(env)->c.lp_part_flush_count + 1);
     } else {
         if (tlb_flush_entry_locked(tlb_entry(env, midx, page), page)) {
             tlb_n_used_entries_dec(env, midx);
@@ -775,13 +875,19 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
     qemu_spin_unlock(&env_tlb(env)->c.lock);
 }
 
-/* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
-static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
-                               target_ulong vaddr, target_ulong size)
+/* Return true if the large page @addr/@mask lies within @lp.  */
+static inline bool tlb_large_page_covers(CPUTLBLargePage *lp,
+                                         target_ulong addr,
+                                         target_ulong mask)
 {
-    target_ulong lp_addr = env_tlb(env)->d[mmu_idx].large_page_addr;
-    target_ulong lp_mask = ~(size - 1);
+    return (addr & lp->mask) == lp->addr && (lp->mask & ~mask) == 0;
+}
+
+/* Fold a large page into the region that triggers a full TLB flush.  */
+static void tlb_merge_large_page(CPUTLBDesc *desc,
+                                 target_ulong vaddr, target_ulong lp_mask)
+{
+    target_ulong lp_addr = desc->large_page_addr;
 
     if (lp_addr == (target_ulong)-1) {
         /* No previous large page.  */
@@ -790,13 +896,59 @@ static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
         /* Extend the existing region to include the new page.
            This is a compromise between unnecessary flushes and
            the cost of maintaining a full variable size TLB.  */
-        lp_mask &= env_tlb(env)->d[mmu_idx].large_page_mask;
+        lp_mask &= desc->large_page_mask;
         while (((lp_addr ^ vaddr) & lp_mask) != 0) {
             lp_mask <<= 1;
         }
     }
-    env_tlb(env)->d[mmu_idx].large_page_addr = lp_addr & lp_mask;
-    env_tlb(env)->d[mmu_idx].large_page_mask = lp_mask;
+    desc->large_page_addr = lp_addr & lp_mask;
+    desc->large_page_mask = lp_mask;
+}
+
+/* Our TLB does not support large pages, so remember the area covered by
+   large pages.  The most recent ones are tracked individually and evicted
+   precisely by tlb_flush_page; older ones are folded into a single region
+   which triggers a full TLB flush if invalidated.  */
+static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
+                               target_ulong vaddr, target_ulong size)
+{
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    target_ulong lp_mask = ~(size - 1);
+    target_ulong lp_addr = vaddr & lp_mask;
+    CPUTLBLargePage coarse = {
+        .addr = desc->large_page_addr,
+        .mask = desc->large_page_mask,
+    };
+    CPUTLBLargePage *lp;
+    int i;
+
+    /* Nothing to do if the page is already being tracked.  */
+    if (tlb_large_page_covers(&coarse, lp_addr, lp_mask)) {
+        return;
+    }
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        if (tlb_large_page_covers(&desc->large_pages[i], lp_addr, lp_mask)) {
+            return;
+        }
+    }
+
+    /* Prefer a free slot, otherwise evict round-robin.  */
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        if (desc->large_pages[i].addr == (target_ulong)-1) {
+            break;
+        }
+    }
+    if (i == CPU_TLB_LARGE_PAGES) {
+        i = desc->lp_index;
+        desc->lp_index = (i + 1) % CPU_TLB_LARGE_PAGES;
+    }
+
+    lp = &desc->large_pages[i];
+    if (lp->addr != (target_ulong)-1) {
+        tlb_merge_large_page(desc, lp->addr, lp->mask);
+    }
+    lp->addr = lp_addr;
+    lp->mask = lp_mask;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
@@ -373,6 +373,7 @@ BlockDriverState *bdrv_new(void)
 
     bs = g_new0(BlockDriverState, 1);
     QLIST_INIT(&bs->dirty_bitmaps);
+    QTAILQ_INIT(&bs->bsc.entries);
     for (i = 0; i < BLOCK_OP_TYPE_MAX; i++) {
         QLIST_INIT(&bs->op_blockers[i]);
     }
@@ -1063,12 +1064,14 @@ static void bdrv_child_cb_drained_end(BdrvChild *child,
 static void bdrv_child_cb_attach(BdrvChild *child)
 {
     BlockDriverState *bs = child->opaque;
+    bdrv_bsc_invalidate(bs);
     bdrv_apply_subtree_drain(child, bs);
 }
 
 static void bdrv_child_cb_detach(BdrvChild *child)
 {
     BlockDriverState *bs = child->opaque;
+    bdrv_bsc_invalidate(bs);
     bdrv_unapply_subtree_drain(child, bs);
 }
 
@@ -4122,6 +4125,7 @@ void bdrv_reopen_commit(BDRVReopenState *reopen_state)
     if (drv->bdrv_reopen_commit) {
         drv->bdrv_reopen_commit(reopen_state);
     }
+    bdrv_bsc_invalidate(bs);
 
     /* set BDS specific flags now */
     qobject_unref(bs->explicit_options);
@@ -4202,6 +4206,7 @@ static void bdrv_close(BlockDriverState *bs)
     QLIST_FOREACH_SAFE(child, &bs->children, next, next) {
         bdrv_unref_child(bs, child);
     }
+    bdrv_bsc_invalidate(bs);
 
     bs->backing = NULL;
     bs->file = NULL;
@@ -5530,6 +5535,8 @@ static void coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs,
         }
         bdrv_set_perm(bs, perm, shared_perm);
 
+        /* Another process may have changed the image while we were inactive */
+        bdrv_bsc_invalidate(bs);
         if (bs->drv->bdrv_co_invalidate_cache) {
             bs->drv->bdrv_co_invalidate_cache(bs, &local_err);
             if (local_err) {
@@ -6322,6 +6329,8 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                        BlockDriverAmendStatusCB *status_cb, void *cb_opaque,
                        Error **errp)
 {
+    int ret;
+
     if (!bs->drv) {
         error_setg(errp, "Node is ejected");
         return -ENOMEDIUM;
@@ -6331,7 +6340,9 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                    bs->drv->format_name);
         return -ENOTSUP;
     }
-    return bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque, errp);
+    ret = bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque, errp);
+    bdrv_bsc_invalidate(bs);
+    return ret;
 }
 
 /*
@@ -27,10 +27,12 @@
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
+#include "qemu/units.h"
 
 #include "block/backup-top.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_CHUNK (64 * MiB)
 
 typedef struct BackupBlockJob {
     BlockJob common;
@@ -195,23 +197,43 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
 static int coroutine_fn backup_loop(BackupBlockJob *job)
 {
     bool error_is_read;
-    int64_t offset;
+    int64_t offset, bytes, next_zero;
     BdrvDirtyBitmapIter *bdbi;
     int ret = 0;
 
     bdbi = bdrv_dirty_iter_new(job->bcs->copy_bitmap);
     while ((offset = bdrv_dirty_iter_next(bdbi)) != -1) {
+        /*
+         * Hand whole contiguous dirty areas to block-copy, which copies
+         * them in several parallel chunks.  A rate limited job stays at
+         * cluster granularity, so that the limit is applied evenly.
+         */
+        bytes = job->cluster_size;
+        if (!job->common.speed) {
+            bytes = MIN(job->len - offset, BACKUP_MAX_CHUNK);
+            next_zero = bdrv_dirty_bitmap_next_zero(job->bcs->copy_bitmap,
+                                                    offset, bytes);
+            if (next_zero >= 0) {
+                bytes = next_zero - offset;
+            }
+        }
+
         do {
             if (yield_and_check(job)) {
                 goto out;
             }
-            ret = backup_do_cow(job, offset, job->cluster_size, &error_is_read);
+            ret = backup_do_cow(job, offset, bytes, &error_is_read);
             if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
                            BLOCK_ERROR_ACTION_REPORT)
             {
                 goto out;
             }
         } while (ret < 0);
+
+        if (offset + bytes >= job->len) {
+            break;
+        }
+        bdrv_set_dirty_iter(bdbi, offset + bytes);
     }
 
  out:
@@ -17,31 +17,14 @@
 #include "trace.h"
 #include "qapi/error.h"
 #include "block/block-copy.h"
+#include "block/aio_task.h"
 #include "sysemu/block-backend.h"
 #include "qemu/units.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
-
-static void coroutine_fn block_copy_wait_inflight_reqs(BlockCopyState *s,
-                                                       int64_t start,
-                                                       int64_t end)
-{
-    BlockCopyInFlightReq *req;
-    bool waited;
-
-    do {
-        waited = false;
-        QLIST_FOREACH(req, &s->inflight_reqs, list) {
-            if (end > req->start_byte && start < req->end_byte) {
-                qemu_co_queue_wait(&req->wait_queue, NULL);
-                waited = true;
-                break;
-            }
-        }
-    } while (waited);
-}
+#define BLOCK_COPY_MAX_WORKERS 64
 
 static void block_copy_inflight_req_begin(BlockCopyState *s,
                                           BlockCopyInFlightReq *req,
@@ -276,30 +259,88 @@ int64_t block_copy_reset_unallocated(BlockCopyState *s,
     return ret;
 }
 
-int coroutine_fn block_copy(BlockCopyState *s,
-                            int64_t start, uint64_t bytes,
-                            bool *error_is_read)
-{
-    int ret = 0;
-    int64_t end = bytes + start; /* bytes */
-    int64_t status_bytes;
+typedef struct BlockCopyCallState {
+    bool failed;
+    bool error_is_read;
+} BlockCopyCallState;
+
+typedef struct BlockCopyTask {
+    AioTask task;
+
+    BlockCopyState *s;
+    BlockCopyCallState *call_state;
+    int64_t offset;
+    int64_t bytes;
     BlockCopyInFlightReq req;
+} BlockCopyTask;
 
-    /*
-     * block_copy() user is responsible for keeping source and target in same
-     * aio context
-     */
-    assert(bdrv_get_aio_context(s->source->bs) ==
-           bdrv_get_aio_context(s->target->bs));
+static coroutine_fn int block_copy_task_entry(AioTask *task)
+{
+    BlockCopyTask *t = container_of(task, BlockCopyTask, task);
+    BlockCopyState *s = t->s;
+    bool error_is_read = false;
+    int ret;
 
-    assert(QEMU_IS_ALIGNED(start, s->cluster_size));
-    assert(QEMU_IS_ALIGNED(end, s->cluster_size));
+    ret = block_copy_do_copy(s, t->offset, t->offset + t->bytes,
+                             &error_is_read);
+    if (ret < 0) {
+        bdrv_set_dirty_bitmap(s->copy_bitmap, t->offset, t->bytes);
+        if (!t->call_state->failed) {
+            t->call_state->failed = true;
+            t->call_state->error_is_read = error_is_read;
+        }
+    } else {
+        s->progress_bytes_callback(t->bytes, s->progress_opaque);
+    }
+
+    co_put_to_shres(s->mem, t->bytes);
+    block_copy_inflight_req_end(&t->req);
+
+    return ret;
+}
+
+/*
+ * Run @task, either in @pool or, if @pool is NULL, directly in the current
+ * coroutine.  @task is freed in both cases.
+ */
+static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
+                                            BlockCopyTask *task)
+{
+    if (!pool) {
+        int ret = task->task.func(&task->task);
 
-    block_copy_wait_inflight_reqs(s, start, bytes);
-    block_copy_inflight_req_begin(s, &req, start, end);
+        g_free(task);
+        return ret;
+    }
+
+    aio_task_pool_start_task(pool, &task->task);
+
+    return 0;
+}
+
+/*
+ * block_copy_dirty_clusters
+ *
+ * Copy the dirty clusters in [@start, @end).  Every contiguous dirty area is
+ * split into chunks of at most s->copy_size, and up to
+ * BLOCK_COPY_MAX_WORKERS chunks are copied in parallel.
+ *
+ * Returns 1 if dirty clusters were found and successfully copied, 0 if no
+ * dirty clusters were found and -errno on failure.
+ */
+static int coroutine_fn block_copy_dirty_clusters(BlockCopyState *s,
+                                                  int64_t start, int64_t end,
+                                                  bool *error_is_read)
+{
+    int ret = 0;
+    bool found_dirty = false;
+    int64_t status_bytes;
+    AioTaskPool *aio = NULL;
+    BlockCopyCallState call_state = { 0 };
 
-    while (start < end) {
+    while (start < end && ret == 0 && aio_task_pool_status(aio) == 0) {
         int64_t next_zero, chunk_end;
+        BlockCopyTask *task;
 
         if (!bdrv_dirty_bitmap_get(s->copy_bitmap, start)) {
             trace_block_copy_skip(s, start);
@@ -307,6 +348,8 @@ int coroutine_fn block_copy(BlockCopyState *s,
             continue; /* already copied */
         }
 
+        found_dirty = true;
+
         chunk_end = MIN(end, start + s->copy_size);
 
         next_zero = bdrv_dirty_bitmap_next_zero(s->copy_bitmap, start,
@@ -318,8 +361,14 @@ int coroutine_fn block_copy(BlockCopyState *s,
         }
 
         if (s->skip_unallocated) {
-            ret = block_copy_reset_unallocated(s, start, &status_bytes);
-            if (ret == 0) {
+            int alloc = block_copy_reset_unallocated(s, start, &status_bytes);
+
+            if (alloc < 0) {
+                call_state.error_is_read = true;
+                ret = alloc;
+                break;
+            }
+            if (alloc == 0) {
                 trace_block_copy_skip_range(s, start, status_bytes);
                 start += status_bytes;
                 continue;
@@ -330,22 +379,100 @@ int coroutine_fn block_copy(BlockCopyState *s,
 
         trace_block_copy_process(s, start);
 
+        /*
+         * Clear the dirty bits and register the in-flight request before the
+         * first yield point, so that nobody else starts copying the chunk or
+         * wrongly assumes it is already copied.
+         */
+        task = g_new(BlockCopyTask, 1);
+        *task = (BlockCopyTask) {
+            .task.func = block_copy_task_entry,
+            .s = s,
+            .call_state = &call_state,
+            .offset = start,
+            .bytes = chunk_end - start,
+        };
         bdrv_reset_dirty_bitmap(s->copy_bitmap, start, chunk_end - start);
+        block_copy_inflight_req_begin(s, &task->req, start, chunk_end);
 
         co_get_from_shres(s->mem, chunk_end - start);
-        ret = block_copy_do_copy(s, start, chunk_end, error_is_read);
-        co_put_to_shres(s->mem, chunk_end - start);
-        if (ret < 0) {
-            bdrv_set_dirty_bitmap(s->copy_bitmap, start, chunk_end - start);
-            break;
-        }
 
-        s->progress_bytes_callback(chunk_end - start, s->progress_opaque);
+        if (!aio && chunk_end != end) {
+            aio = aio_task_pool_new(BLOCK_COPY_MAX_WORKERS);
+        }
+        ret = block_copy_task_run(aio, task);
         start = chunk_end;
-        ret = 0;
     }
 
-    block_copy_inflight_req_end(&req);
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        if (ret == 0) {
+            ret = aio_task_pool_status(aio);
+        }
+        aio_task_pool_free(aio);
+    }
+
+    if (ret < 0) {
+        if (error_is_read) {
+            *error_is_read = call_state.error_is_read;
+        }
+        return ret;
+    }
+
+    return found_dirty;
+}
+
+/*
+ * Wait for one in-flight request that intersects [@start, @end).
+ * Returns 1 if there was one, 0 otherwise.
+ */
+static int coroutine_fn block_copy_wait_one(BlockCopyState *s, int64_t start,
+                                            int64_t end)
+{
+    BlockCopyInFlightReq *req;
+
+    QLIST_FOREACH(req, &s->inflight_reqs, list) {
+        if (end > req->start_byte && start < req->end_byte) {
+            qemu_co_queue_wait(&req->wait_queue, NULL);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int coroutine_fn block_copy(BlockCopyState *s,
+                            int64_t start, uint64_t bytes,
+                            bool *error_is_read)
+{
+    int ret;
+    int64_t end = bytes + start; /* bytes */
+
+    /*
+     * block_copy() user is responsible for keeping source and target in same
+     * aio context
+     */
+    assert(bdrv_get_aio_context(s->source->bs) ==
+           bdrv_get_aio_context(s->target->bs));
+
+    assert(QEMU_IS_ALIGNED(start, s->cluster_size));
+    assert(QEMU_IS_ALIGNED(end, s->cluster_size));
+
+    do {
+        ret = block_copy_dirty_clusters(s, start, end, error_is_read);
+
+        if (ret == 0) {
+            ret = block_copy_wait_one(s, start, end);
+        }
+
+        /*
+         * Go round again if we copied something or waited for somebody
+         * else's request: both involve yielding, and a request that failed
+         * in the meantime may have set dirty bits in our range again.
+         * The range is only done when it has no dirty bits and no
+         * intersecting in-flight requests left.
+         */
+    } while (ret > 0);
 
     return ret;
 }
@@ -157,7 +157,10 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool use_io_uring_sqpoll:1;
     bool page_cache_inconsistent:1;
+    /* struct iovec of the buffers registered with the io_uring ring */
+    GArray *registered_bufs;
     bool has_fallocate;
     bool needs_alignment;
     bool drop_cache;
@@ -447,6 +450,14 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native, io_uring)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll the io_uring submission queue with a kernel thread "
+                    "(default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -475,6 +486,32 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+static LuringState *raw_get_luring(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                  s->use_io_uring_sqpoll);
+}
+#endif
+
+/*
+ * Close a file descriptor that @bs used for I/O.  io_uring keeps a reference
+ * to the file while it is registered with the ring, so drop it first.
+ */
+static void raw_close_fd(BlockDriverState *bs, int fd)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring) {
+        luring_unregister_fd(raw_get_luring(bs), fd);
+    }
+#endif
+    qemu_close(fd);
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -526,6 +563,12 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->use_io_uring_sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
+    if (s->use_io_uring_sqpoll && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-sqpoll requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 #endif
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
@@ -614,7 +657,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs),
+                                      s->use_io_uring_sqpoll, errp)) {
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
         }
@@ -1053,7 +1097,7 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
-    qemu_close(s->fd);
+    raw_close_fd(state->bs, s->fd);
     s->fd = rs->fd;
 
     g_free(state->opaque);
@@ -1914,7 +1958,7 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         assert(qiov->size == bytes);
         return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
@@ -1968,7 +2012,7 @@ static void raw_aio_plug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_plug(bs, aio);
     }
 #endif
@@ -1985,7 +2029,7 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_unplug(bs, aio);
     }
 #endif
@@ -2010,13 +2054,63 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
     }
 #endif
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * The ring belongs to the AioContext and outlives the node, so buffers
+ * must be moved to the new ring when the node changes its AioContext and
+ * be dropped when it is closed.
+ */
+static void raw_unregister_all_bufs(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    guint i;
+
+    if (!s->use_linux_io_uring || !s->registered_bufs) {
+        return;
+    }
+    for (i = 0; i < s->registered_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->registered_bufs,
+                                           struct iovec, i);
+        luring_unregister_buf(raw_get_luring(bs), iov->iov_base);
+    }
+}
+
+static void raw_register_all_bufs(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    guint i;
+
+    if (!s->use_linux_io_uring || !s->registered_bufs) {
+        return;
+    }
+    for (i = 0; i < s->registered_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->registered_bufs,
+                                           struct iovec, i);
+        luring_register_buf(raw_get_luring(bs), iov->iov_base, iov->iov_len);
+    }
+}
+#endif
+
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    /* Do not leave the file registered with the old AioContext's ring */
+    if (s->use_linux_io_uring) {
+        luring_unregister_fd(raw_get_luring(bs), s->fd);
+    }
+    raw_unregister_all_bufs(bs);
+#endif
+}
+
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
@@ -2034,12 +2128,60 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
         Error *local_err;
-        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+        if (!aio_setup_linux_io_uring(new_context, s->use_io_uring_sqpoll,
+                                      &local_err)) {
             error_reportf_err(local_err, "Unable to use linux io_uring, "
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
         }
     }
+    raw_register_all_bufs(bs);
+#endif
+}
+
+/*
+ * With io_uring, register buffers that are used for many requests, such as
+ * those of qemu-img bench, so that the kernel does not map them each time.
+ */
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring) {
+        struct iovec iov = {
+            .iov_base = host,
+            .iov_len = size,
+        };
+
+        if (!s->registered_bufs) {
+            s->registered_bufs = g_array_new(false, false,
+                                             sizeof(struct iovec));
+        }
+        g_array_append_val(s->registered_bufs, iov);
+        luring_register_buf(raw_get_luring(bs), host, size);
+    }
+#endif
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    guint i;
+
+    for (i = 0; s->registered_bufs && i < s->registered_bufs->len; i++) {
+        if (g_array_index(s->registered_bufs, struct iovec, i).iov_base ==
+            host)
+        {
+            g_array_remove_index(s->registered_bufs, i);
+            break;
+        }
+    }
+
+    if (s->use_linux_io_uring) {
+        luring_unregister_buf(raw_get_luring(bs), host);
+    }
 #endif
 }
 
@@ -2047,8 +2189,16 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_unregister_all_bufs(bs);
+    if (s->registered_bufs) {
+        g_array_free(s->registered_bufs, true);
+        s->registered_bufs = NULL;
+    }
+#endif
+
     if (s->fd >= 0) {
-        qemu_close(s->fd);
+        raw_close_fd(bs, s->fd);
         s->fd = -1;
     }
 }
@@ -2985,7 +3135,7 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
-        qemu_close(s->fd);
+        raw_close_fd(bs, s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
     }
@@ -3086,6 +3236,9 @@ BlockDriver bdrv_file = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
@@ -3502,6 +3655,9 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
@@ -3625,6 +3781,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -3755,6 +3914,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
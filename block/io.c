@@ -40,6 +40,9 @@
 /* Maximum bounce buffer for copy-on-read and write zeroes, in bytes */
 #define MAX_BOUNCE_BUFFER (32768 << BDRV_SECTOR_BITS)
 
+/* Maximum number of extents in the block-status cache of a node */
+#define BDRV_BSC_MAX_ENTRIES 1024
+
 static void bdrv_parent_cb_resize(BlockDriverState *bs);
 static int coroutine_fn bdrv_co_do_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int bytes, BdrvRequestFlags flags);
@@ -682,6 +685,11 @@ static void tracked_request_end(BdrvTrackedRequest *req)
 
     qemu_co_mutex_lock(&req->bs->reqs_lock);
     QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->bs->tracked_tree, &req->node);
+    if (req->serialising) {
+        interval_tree_remove(&req->bs->serialising_tree,
+                             &req->serialising_node);
+    }
     qemu_co_queue_restart_all(&req->wait_queue);
     qemu_co_mutex_unlock(&req->bs->reqs_lock);
 }
@@ -712,60 +720,71 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    interval_tree_insert(&bs->tracked_tree, &req->node,
+                         offset, offset + bytes);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t offset, uint64_t bytes)
+/*
+ * Called for each tracked request overlapping @opaque; returns true for the
+ * first one that @opaque has to wait for.
+ */
+static bool tracked_request_conflicts(IntervalTreeNode *node, void *opaque)
 {
-    /*        aaaa   bbbb */
-    if (offset >= req->overlap_offset + req->overlap_bytes) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->overlap_offset >= offset + bytes) {
+    BdrvTrackedRequest *self = opaque;
+    BdrvTrackedRequest *req;
+
+    if (node == &self->node || node == &self->serialising_node) {
         return false;
     }
-    return true;
+
+    /* Requests that are not serialising are only in tracked_tree */
+    req = self->serialising ? container_of(node, BdrvTrackedRequest, node)
+                            : container_of(node, BdrvTrackedRequest,
+                                           serialising_node);
+
+    /* Hitting this means there was a reentrant request, for
+     * example, a block driver issuing nested requests.  This must
+     * never happen since it means deadlock.
+     */
+    assert(qemu_coroutine_self() != req->co);
+
+    /* If the request is already (indirectly) waiting for us, or
+     * will wait for us as soon as it wakes up, then just go on
+     * (instead of producing a deadlock in the former case). */
+    return !req->waiting_for;
 }
 
 static bool coroutine_fn
 bdrv_wait_serialising_requests_locked(BlockDriverState *bs,
                                       BdrvTrackedRequest *self)
 {
+    /*
+     * A serialising request waits for every overlapping request, other
+     * requests only wait for overlapping serialising requests.
+     */
+    IntervalTreeRoot *tree = self->serialising ? &bs->tracked_tree
+                                               : &bs->serialising_tree;
+    IntervalTreeNode *node;
     BdrvTrackedRequest *req;
-    bool retry;
     bool waited = false;
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (req == self || (!req->serialising && !self->serialising)) {
-                continue;
-            }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue, &bs->reqs_lock);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
-            }
+    for (;;) {
+        node = interval_tree_find(tree, self->overlap_offset,
+                                  self->overlap_offset + self->overlap_bytes,
+                                  tracked_request_conflicts, self);
+        if (!node) {
+            break;
         }
-    } while (retry);
+
+        req = self->serialising
+            ? container_of(node, BdrvTrackedRequest, node)
+            : container_of(node, BdrvTrackedRequest, serialising_node);
+        self->waiting_for = req;
+        qemu_co_queue_wait(&req->wait_queue, &bs->reqs_lock);
+        self->waiting_for = NULL;
+        waited = true;
+    }
     return waited;
 }
 
@@ -781,10 +800,21 @@ bool bdrv_mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
     if (!req->serialising) {
         atomic_inc(&req->bs->serialising_in_flight);
         req->serialising = true;
+    } else {
+        interval_tree_remove(&bs->serialising_tree, &req->serialising_node);
     }
 
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+
+    /* The overlap range may have grown, move the request in the trees */
+    interval_tree_remove(&bs->tracked_tree, &req->node);
+    interval_tree_insert(&bs->tracked_tree, &req->node, req->overlap_offset,
+                         req->overlap_offset + req->overlap_bytes);
+    interval_tree_insert(&bs->serialising_tree, &req->serialising_node,
+                         req->overlap_offset,
+                         req->overlap_offset + req->overlap_bytes);
+
     waited = bdrv_wait_serialising_requests_locked(bs, req);
     qemu_co_mutex_unlock(&bs->reqs_lock);
     return waited;
@@ -1386,6 +1416,8 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
                                           &local_qiov, 0,
                                           BDRV_REQ_WRITE_UNCHANGED);
             }
+            /* The range is now allocated in this layer */
+            bdrv_bsc_invalidate_range(bs, cluster_offset, pnum);
 
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
@@ -1912,6 +1944,7 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, uint64_t bytes,
     BlockDriverState *bs = child->bs;
 
     atomic_inc(&bs->write_gen);
+    bdrv_bsc_invalidate_range(bs, offset, bytes);
 
     /*
      * Discard cannot extend the image, but in error handling cases, such as
@@ -2262,6 +2295,161 @@ int coroutine_fn bdrv_co_block_status_from_backing(BlockDriverState *bs,
     return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
 }
 
+struct BdrvBlockStatusCacheEntry {
+    IntervalTreeNode node;
+    QTAILQ_ENTRY(BdrvBlockStatusCacheEntry) next;
+
+    int ret;
+    bool want_zero;
+    int64_t map;    /* host offset of node.start, if BDRV_BLOCK_OFFSET_VALID */
+    BlockDriverState *file;
+};
+
+static bool bdrv_bsc_find_first(IntervalTreeNode *node, void *opaque)
+{
+    return true;
+}
+
+static void bdrv_bsc_remove(BlockDriverState *bs,
+                            BdrvBlockStatusCacheEntry *entry)
+{
+    interval_tree_remove(&bs->bsc.extents, &entry->node);
+    QTAILQ_REMOVE(&bs->bsc.entries, entry, next);
+    bs->bsc.nb_entries--;
+    g_free(entry);
+}
+
+static void bdrv_bsc_remove_range(BlockDriverState *bs,
+                                  int64_t offset, int64_t bytes)
+{
+    IntervalTreeNode *node;
+
+    while ((node = interval_tree_find(&bs->bsc.extents, offset,
+                                      offset + bytes, bdrv_bsc_find_first,
+                                      NULL))) {
+        bdrv_bsc_remove(bs, container_of(node, BdrvBlockStatusCacheEntry,
+                                         node));
+    }
+}
+
+/*
+ * Drop the cached block status of [offset, offset + bytes).  Must be
+ * called whenever the driver could return a different result for this
+ * range, i.e. on writes, discards and any change to the driver's metadata.
+ */
+void bdrv_bsc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes)
+{
+    /* Results that are being computed right now may be stale as well */
+    bs->bsc.gen++;
+    bdrv_bsc_remove_range(bs, offset, bytes);
+}
+
+/*
+ * Drop the whole block-status cache of @bs, e.g. because the driver
+ * state or the node's children changed.
+ */
+void bdrv_bsc_invalidate(BlockDriverState *bs)
+{
+    BdrvBlockStatusCacheEntry *entry, *next;
+
+    bs->bsc.gen++;
+
+    QTAILQ_FOREACH_SAFE(entry, &bs->bsc.entries, next, next) {
+        bdrv_bsc_remove(bs, entry);
+    }
+    assert(interval_tree_is_empty(&bs->bsc.extents));
+}
+
+/*
+ * Filters forward block status to their children without doing any real
+ * work, so there is nothing to gain from caching their results.
+ */
+static bool bdrv_bsc_enabled(BlockDriverState *bs)
+{
+    return !bs->drv->is_filter;
+}
+
+/*
+ * Look up the driver block status of @offset in the cache of @bs.  On a
+ * hit, store the driver's result in @ret, @pnum, @map and @file (with
+ * @pnum limited to @bytes) and return true.
+ */
+static bool bdrv_bsc_lookup(BlockDriverState *bs, bool want_zero,
+                            int64_t offset, int64_t bytes, int *ret,
+                            int64_t *pnum, int64_t *map,
+                            BlockDriverState **file)
+{
+    BdrvBlockStatusCacheEntry *entry;
+    IntervalTreeNode *node;
+
+    node = interval_tree_find(&bs->bsc.extents, offset, offset + 1,
+                              bdrv_bsc_find_first, NULL);
+    entry = node ? container_of(node, BdrvBlockStatusCacheEntry, node) : NULL;
+
+    /* A want_zero result is also accurate enough for !want_zero callers */
+    if (!entry || (want_zero && !entry->want_zero)) {
+        stat64_add(&bs->bsc.misses, 1);
+        return false;
+    }
+
+    stat64_add(&bs->bsc.hits, 1);
+    *ret = entry->ret;
+    *pnum = MIN(entry->node.end - offset, bytes);
+    *map = entry->map + (offset - entry->node.start);
+    *file = entry->file;
+    return true;
+}
+
+/*
+ * Remember the result of a driver block-status call for [offset, offset +
+ * pnum), unless the result would not be worth caching or could change
+ * without the block layer noticing.
+ */
+static void bdrv_bsc_fill(BlockDriverState *bs, bool want_zero,
+                          int64_t offset, int64_t pnum, int ret,
+                          int64_t map, BlockDriverState *file)
+{
+    BdrvBlockStatusCacheEntry *entry;
+
+    ret &= ~BDRV_BLOCK_EOF;
+
+    if (ret & BDRV_BLOCK_RAW) {
+        /* The work is done by the node that the query is forwarded to */
+        return;
+    }
+
+    if (bs->drv->protocol_name) {
+        /*
+         * Other processes may write to the same file or volume, so a
+         * hole can turn into data at any time.  Reporting data for an
+         * area that reads as zeroes is always safe, though.
+         */
+        if (ret != (BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID) ||
+            file != bs || map != offset) {
+            return;
+        }
+    }
+
+    bdrv_bsc_remove_range(bs, offset, pnum);
+
+    if (bs->bsc.nb_entries >= BDRV_BSC_MAX_ENTRIES) {
+        bdrv_bsc_remove(bs, QTAILQ_FIRST(&bs->bsc.entries));
+    }
+
+    entry = g_new(BdrvBlockStatusCacheEntry, 1);
+    *entry = (BdrvBlockStatusCacheEntry) {
+        .ret = ret,
+        .want_zero = want_zero,
+        .map = (ret & BDRV_BLOCK_OFFSET_VALID) ? map : 0,
+        .file = file,
+    };
+    interval_tree_insert(&bs->bsc.extents, &entry->node, offset,
+                         offset + pnum);
+    QTAILQ_INSERT_TAIL(&bs->bsc.entries, entry, next);
+    bs->bsc.nb_entries++;
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -2302,6 +2490,7 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     BlockDriverState *local_file = NULL;
     int64_t aligned_offset, aligned_bytes;
     uint32_t align;
+    bool use_bsc;
 
     assert(pnum);
     *pnum = 0;
@@ -2348,12 +2537,29 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     aligned_offset = QEMU_ALIGN_DOWN(offset, align);
     aligned_bytes = ROUND_UP(offset + bytes, align) - aligned_offset;
 
-    ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
-                                        aligned_bytes, pnum, &local_map,
-                                        &local_file);
-    if (ret < 0) {
-        *pnum = 0;
-        goto out;
+    use_bsc = bdrv_bsc_enabled(bs);
+    if (!use_bsc ||
+        !bdrv_bsc_lookup(bs, want_zero, aligned_offset, aligned_bytes, &ret,
+                         pnum, &local_map, &local_file)) {
+        unsigned int bsc_gen = bs->bsc.gen;
+
+        ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
+                                            aligned_bytes, pnum, &local_map,
+                                            &local_file);
+        if (ret < 0) {
+            *pnum = 0;
+            goto out;
+        }
+
+        /*
+         * Don't cache the result if the node changed in the meantime.
+         * The driver may also have yielded and gone away because it
+         * detected corruption (see qcow2_signal_corruption()).
+         */
+        if (use_bsc && bs->drv && bs->bsc.gen == bsc_gen) {
+            bdrv_bsc_fill(bs, want_zero, aligned_offset, *pnum, ret,
+                          local_map, local_file);
+        }
     }
 
     /*
@@ -3402,6 +3608,7 @@ int coroutine_fn bdrv_co_truncate(BdrvChild *child, int64_t offset, bool exact,
         ret = -ENOTSUP;
         goto out;
     }
+    bdrv_bsc_invalidate(bs);
     if (ret < 0) {
         goto out;
     }
@@ -17,11 +17,21 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the registered file table of each ring */
+#define MAX_FIXED_FILES 256
+
+/* Maximum number of buffers registered with each ring */
+#define MAX_FIXED_BUFS 16
+
+/* Idle time before an SQPOLL kernel thread goes to sleep, in milliseconds */
+#define SQPOLL_IDLE_MS 1000
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -56,8 +66,31 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /* Submission queue polled by a kernel thread */
+    bool sqpoll;
+    /* Requests must use registered files (SQPOLL before Linux 5.11) */
+    bool needs_fixed_files;
+    QTAILQ_ENTRY(LuringState) sqpoll_next;
+
+    /* Registered files, -1 for free slots.  Protected by AioContext lock. */
+    bool has_fixed_files;
+    int fixed_fds[MAX_FIXED_FILES];
+    int nr_fixed_slots;         /* slots after this one are all free */
+
+    /* Registered buffers.  Protected by AioContext lock. */
+    bool has_fixed_bufs;
+    struct iovec fixed_bufs[MAX_FIXED_BUFS];
+    unsigned int nr_fixed_bufs;
 } LuringState;
 
+/*
+ * SQPOLL rings, in creation order.  New SQPOLL rings share the kernel
+ * thread of the first one when the kernel allows it.  Protected by the BQL.
+ */
+static QTAILQ_HEAD(, LuringState) sqpoll_rings =
+    QTAILQ_HEAD_INITIALIZER(sqpoll_rings);
+
 /**
  * luring_resubmit:
  *
@@ -102,7 +135,9 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
                       remaining);
 
-    /* Update sqe */
+    /* Update sqe, READ_FIXED requests continue as vectored reads */
+    luringcb->sqeq.opcode = IORING_OP_READV;
+    luringcb->sqeq.buf_index = 0;
     luringcb->sqeq.off = nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
@@ -315,6 +350,178 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/**
+ * luring_fixed_file:
+ * @s: AIO state
+ * @fd: file descriptor for I/O
+ *
+ * Returns the slot of @fd in the registered file table, registering it if
+ * needed, or -1 if @fd cannot be used as a registered file.  File
+ * descriptors stay registered until luring_unregister_fd() is called.
+ */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i, free_slot = -1;
+    int ret;
+
+    if (!s->has_fixed_files) {
+        return -1;
+    }
+
+    for (i = 0; i < s->nr_fixed_slots; i++) {
+        if (s->fixed_fds[i] == fd) {
+            return i;
+        }
+        if (s->fixed_fds[i] == -1 && free_slot == -1) {
+            free_slot = i;
+        }
+    }
+    if (free_slot == -1) {
+        if (s->nr_fixed_slots == MAX_FIXED_FILES) {
+            return -1;
+        }
+        free_slot = s->nr_fixed_slots;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, free_slot, &fd, 1);
+    trace_luring_register_file(s, fd, free_slot, ret);
+    if (ret != 1) {
+        return -1;
+    }
+
+    s->fixed_fds[free_slot] = fd;
+    s->nr_fixed_slots = MAX(s->nr_fixed_slots, free_slot + 1);
+    return free_slot;
+}
+
+/**
+ * luring_unregister_fd:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Drop @fd from the registered file table.  The ring holds a reference to
+ * registered files, so this must be called before @fd is closed or stops
+ * being used with @s.  There must be no requests in flight for @fd.
+ */
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int unused = -1;
+    int i;
+
+    for (i = 0; i < s->nr_fixed_slots; i++) {
+        if (s->fixed_fds[i] == fd) {
+            io_uring_register_files_update(&s->ring, i, &unused, 1);
+            trace_luring_unregister_file(s, fd, i);
+            s->fixed_fds[i] = -1;
+        }
+    }
+    while (s->nr_fixed_slots > 0 && s->fixed_fds[s->nr_fixed_slots - 1] == -1) {
+        s->nr_fixed_slots--;
+    }
+}
+
+/* Returns the index of the registered buffer that contains @qiov, or -1 */
+static int luring_fixed_buf(LuringState *s, QEMUIOVector *qiov)
+{
+    uintptr_t start, end;
+    unsigned int i;
+
+    if (!s->has_fixed_bufs || qiov->niov != 1) {
+        return -1;
+    }
+
+    start = (uintptr_t)qiov->iov[0].iov_base;
+    end = start + qiov->iov[0].iov_len;
+    for (i = 0; i < s->nr_fixed_bufs; i++) {
+        uintptr_t buf = (uintptr_t)s->fixed_bufs[i].iov_base;
+
+        if (start >= buf && end <= buf + s->fixed_bufs[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * The kernel can only replace the whole set of registered buffers, so
+ * register them again whenever a buffer is added or removed.  If this
+ * fails (e.g. because of RLIMIT_MEMLOCK), requests use the buffers
+ * without registration.
+ */
+static void luring_update_fixed_bufs(LuringState *s)
+{
+    int ret = 0;
+
+    if (s->has_fixed_bufs) {
+        io_uring_unregister_buffers(&s->ring);
+        s->has_fixed_bufs = false;
+    }
+    if (s->nr_fixed_bufs) {
+        ret = io_uring_register_buffers(&s->ring, s->fixed_bufs,
+                                        s->nr_fixed_bufs);
+        s->has_fixed_bufs = (ret == 0);
+    }
+    trace_luring_register_buffers(s, s->nr_fixed_bufs, ret);
+}
+
+/**
+ * luring_register_buf:
+ * @s: AIO state
+ * @host: start of the buffer
+ * @size: size of the buffer
+ *
+ * Register a buffer that will be used for many requests, so that the
+ * kernel does not have to map it for each of them.  Requests whose
+ * single iovec lies within a registered buffer use READ_FIXED/WRITE_FIXED.
+ */
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    if (s->nr_fixed_bufs == MAX_FIXED_BUFS) {
+        return;
+    }
+
+    s->fixed_bufs[s->nr_fixed_bufs++] = (struct iovec) {
+        .iov_base = host,
+        .iov_len = size,
+    };
+    luring_update_fixed_bufs(s);
+}
+
+void luring_unregister_buf(LuringState *s, void *host)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nr_fixed_bufs; i++) {
+        if (s->fixed_bufs[i].iov_base == host) {
+            memmove(&s->fixed_bufs[i], &s->fixed_bufs[i + 1],
+                    (s->nr_fixed_bufs - i - 1) * sizeof(s->fixed_bufs[0]));
+            s->nr_fixed_bufs--;
+            luring_update_fixed_bufs(s);
+            return;
+        }
+    }
+}
+
+/**
+ * luring_buf_registered:
+ * @s: AIO state
+ * @host: start of the buffer
+ *
+ * Returns whether @host was passed to luring_register_buf() and has not been
+ * unregistered since, even if the kernel refused to register it.
+ */
+bool luring_buf_registered(LuringState *s, void *host)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nr_fixed_bufs; i++) {
+        if (s->fixed_bufs[i].iov_base == host) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -331,15 +538,39 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int fixed_file = luring_fixed_file(s, fd);
+    int fixed_buf = -1;
+
+    if (fixed_file < 0 && s->needs_fixed_files) {
+        return -EMFILE;
+    }
+
+    if (type == QEMU_AIO_WRITE || type == QEMU_AIO_READ) {
+        fixed_buf = luring_fixed_buf(s, luringcb->qiov);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (fixed_buf >= 0) {
+            io_uring_prep_write_fixed(sqes, fd,
+                                      luringcb->qiov->iov[0].iov_base,
+                                      luringcb->qiov->iov[0].iov_len, offset,
+                                      fixed_buf);
+        } else {
+            io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                                 luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (fixed_buf >= 0) {
+            io_uring_prep_read_fixed(sqes, fd,
+                                     luringcb->qiov->iov[0].iov_base,
+                                     luringcb->qiov->iov[0].iov_len, offset,
+                                     fixed_buf);
+        } else {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -349,6 +580,10 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (fixed_file >= 0) {
+        sqes->fd = fixed_file;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -405,21 +640,98 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+static int luring_queue_init(LuringState *s, bool sqpoll)
 {
+#ifdef IORING_SETUP_ATTACH_WQ
+    struct io_uring_params p = { 0 };
     int rc;
+
+    s->needs_fixed_files = false;
+    if (!sqpoll) {
+        return io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    }
+
+    p.flags = IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = SQPOLL_IDLE_MS;
+    if (!QTAILQ_EMPTY(&sqpoll_rings)) {
+        p.flags |= IORING_SETUP_ATTACH_WQ;
+        p.wq_fd = QTAILQ_FIRST(&sqpoll_rings)->ring.ring_fd;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &p);
+    if (rc < 0 && (p.flags & IORING_SETUP_ATTACH_WQ)) {
+        /* Sharing the kernel thread needs Linux 5.6 */
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = SQPOLL_IDLE_MS;
+        rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &p);
+    }
+#ifdef IORING_FEAT_SQPOLL_NONFIXED
+    s->needs_fixed_files = !(p.features & IORING_FEAT_SQPOLL_NONFIXED);
+#else
+    s->needs_fixed_files = true;
+#endif
+    return rc;
+#else
+    s->needs_fixed_files = sqpoll;
+    return io_uring_queue_init(MAX_ENTRIES, &s->ring,
+                               sqpoll ? IORING_SETUP_SQPOLL : 0);
+#endif
+}
+
+LuringState *luring_init(bool sqpoll, Error **errp)
+{
+    int rc;
+    int i;
     LuringState *s = g_new0(LuringState, 1);
-    struct io_uring *ring = &s->ring;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    rc = luring_queue_init(s, sqpoll);
+    if (rc < 0 && sqpoll) {
+        /* SQPOLL needs CAP_SYS_ADMIN before Linux 5.11 */
+        warn_report("io_uring: submission queue polling not available, "
+                    "falling back to system calls");
+        sqpoll = false;
+        rc = luring_queue_init(s, false);
+    }
     if (rc < 0) {
         error_setg_errno(errp, errno, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
 
+    /* Start with an empty file table; this needs Linux 5.5 */
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_fds[i] = -1;
+    }
+    rc = io_uring_register_files(&s->ring, s->fixed_fds, MAX_FIXED_FILES);
+    s->has_fixed_files = (rc == 0);
+
+    if (sqpoll && s->needs_fixed_files && !s->has_fixed_files) {
+        /* The SQPOLL thread could not access any file */
+        io_uring_queue_exit(&s->ring);
+        warn_report("io_uring: submission queue polling needs registered "
+                    "files, falling back to system calls");
+        sqpoll = false;
+        rc = luring_queue_init(s, false);
+        if (rc < 0) {
+            error_setg_errno(errp, errno,
+                             "failed to init linux io_uring ring");
+            g_free(s);
+            return NULL;
+        }
+        rc = io_uring_register_files(&s->ring, s->fixed_fds,
+                                     MAX_FIXED_FILES);
+        s->has_fixed_files = (rc == 0);
+    }
+
+    s->sqpoll = sqpoll;
+    if (sqpoll) {
+        QTAILQ_INSERT_TAIL(&sqpoll_rings, s, sqpoll_next);
+    }
+    trace_luring_init_ring(s, sqpoll, s->has_fixed_files);
+
     ioq_init(&s->io_q);
     return s;
 
@@ -427,6 +739,9 @@ LuringState *luring_init(Error **errp)
 
 void luring_cleanup(LuringState *s)
 {
+    if (s->sqpoll) {
+        QTAILQ_REMOVE(&sqpoll_rings, s, sqpoll_next);
+    }
     io_uring_queue_exit(&s->ring);
     g_free(s);
     trace_luring_cleanup_state(s);
@@ -99,6 +99,8 @@ typedef struct {
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    /* Used to spread requests over the io queues */
+    unsigned int next_queue;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -127,6 +129,7 @@ typedef struct {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_NUM_QUEUES "num-queues"
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -142,6 +145,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_NUM_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -283,6 +291,25 @@ static NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
     return req;
 }
 
+/* Pick the io queue for a new request, preferring one with free slots */
+static NVMeQueuePair *nvme_select_queue(BDRVNVMeState *s)
+{
+    int nr_io_queues = s->nr_queues - 1;
+    NVMeQueuePair *q;
+    int i;
+
+    assert(nr_io_queues > 0);
+    for (i = 0; i < nr_io_queues; i++) {
+        q = s->queues[1 + s->next_queue++ % nr_io_queues];
+        if (atomic_read(&q->inflight) + atomic_read(&q->need_kick) <=
+            NVME_QUEUE_SIZE - 2) {
+            return q;
+        }
+    }
+    /* All queues are full, nvme_get_free_req() will wait */
+    return s->queues[1 + s->next_queue++ % nr_io_queues];
+}
+
 static inline int nvme_translate_error(const NvmeCqe *c)
 {
     uint16_t status = (le16_to_cpu(c->status) >> 1) & 0xFF;
@@ -583,10 +610,11 @@ static bool nvme_poll_cb(void *opaque)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int num_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     int ret;
+    int i, max_queues;
     uint64_t cap;
     uint64_t timeout_ms;
     uint64_t deadline, now;
@@ -630,6 +658,16 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     bs->bl.opt_mem_alignment = s->page_size;
     timeout_ms = MIN(500 * ((cap >> 24) & 0xFF), 30000);
 
+    /* The doorbells of all queue pairs, including admin, must fit the BAR */
+    max_queues = (NVME_BAR_SIZE - offsetof(NVMeRegs, doorbells)) /
+                 (2 * s->doorbell_scale * sizeof(uint32_t)) - 1;
+    if (num_queues > max_queues) {
+        error_setg(errp, "At most %d I/O queues are supported by this device",
+                   max_queues);
+        ret = -EINVAL;
+        goto out;
+    }
+
     /* Reset device to get a clean state. */
     s->regs->cc = cpu_to_le32(le32_to_cpu(s->regs->cc) & 0xFE);
     /* Wait for CSTS.RDY = 0. */
@@ -689,9 +727,30 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
+    if (num_queues > 1) {
+        NvmeCmd cmd = {
+            .opcode = NVME_ADM_CMD_SET_FEATURES,
+            .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+            .cdw11 = cpu_to_le32(((num_queues - 1) << 16) |
+                                 (num_queues - 1)),
+        };
+
+        /* The controller may allocate fewer queues, checked below */
+        nvme_cmd_sync(bs, s->queues[0], &cmd);
+    }
+
     /* Set up command queues. */
     if (!nvme_add_io_queue(bs, errp)) {
         ret = -EIO;
+        goto out;
+    }
+    for (i = 1; i < num_queues; i++) {
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            warn_reportf_err(local_err, "Using %d of %d I/O queues: ",
+                             i, num_queues);
+            local_err = NULL;
+            break;
+        }
     }
 out:
     /* Cleaning up is done in nvme_file_open() upon error. */
@@ -777,6 +836,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int num_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -792,7 +852,14 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    num_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NUM_QUEUES, 1);
+    if (num_queues < 1 || num_queues > UINT16_MAX) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_NUM_QUEUES "' must be between 1 "
+                   "and %d", UINT16_MAX);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, num_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -963,7 +1030,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_select_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1078,7 +1145,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_select_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1109,7 +1176,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_select_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1162,7 +1229,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_select_queue(s);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
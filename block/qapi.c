@@ -550,6 +550,14 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    if (stat64_get(&bs->bsc.hits) || stat64_get(&bs->bsc.misses)) {
+        s->has_block_status_cache = true;
+        s->block_status_cache = g_new0(BlockStatusCacheStats, 1);
+        s->block_status_cache->hits = stat64_get(&bs->bsc.hits);
+        s->block_status_cache->misses = stat64_get(&bs->bsc.misses);
+        s->block_status_cache->extents = bs->bsc.nb_entries;
+    }
+
     s->driver_specific = bdrv_get_specific_stats(bs);
     if (s->driver_specific) {
         s->has_driver_specific = true;
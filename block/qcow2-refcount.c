@@ -26,8 +26,11 @@
 #include "qapi/error.h"
 #include "qcow2.h"
 #include "qemu/range.h"
+#include "qemu/bitmap.h"
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
+#include "block/aio_task.h"
 #include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
@@ -132,9 +135,216 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    qcow2_free_index_reset(s);
+    qcow2_overlap_index_reset(s);
     g_free(s->refcount_table);
 }
 
+/*
+ * Drops the free space index.  Must be called whenever refcounts change
+ * without going through update_refcount(), e.g. when the refcount table is
+ * replaced; the index is rebuilt on the next allocation.
+ */
+void qcow2_free_index_reset(BDRVQcow2State *s)
+{
+    if (s->free_clusters) {
+        hbitmap_free(s->free_clusters);
+        s->free_clusters = NULL;
+    }
+    g_free(s->free_clusters_loaded);
+    s->free_clusters_loaded = NULL;
+    s->free_clusters_nb_blocks = 0;
+}
+
+/*
+ * Makes the free space index cover all refcount blocks up to
+ * s->max_refcount_table_index.  Clusters beyond that are always free.
+ */
+static void free_index_resize(BDRVQcow2State *s)
+{
+    uint64_t nb_blocks = (uint64_t)s->max_refcount_table_index + 1;
+
+    if (!s->free_clusters) {
+        s->free_clusters = hbitmap_alloc(nb_blocks << s->refcount_block_bits,
+                                         0);
+        s->free_clusters_loaded = bitmap_new(nb_blocks);
+        s->free_clusters_nb_blocks = nb_blocks;
+    } else if (nb_blocks > s->free_clusters_nb_blocks) {
+        hbitmap_truncate(s->free_clusters, nb_blocks << s->refcount_block_bits);
+        s->free_clusters_loaded =
+            bitmap_zero_extend(s->free_clusters_loaded,
+                               s->free_clusters_nb_blocks, nb_blocks);
+        s->free_clusters_nb_blocks = nb_blocks;
+    }
+}
+
+/* Scans the refcount block @table_index into the free space index */
+static int free_index_load_block(BlockDriverState *bs, uint64_t table_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t first = table_index << s->refcount_block_bits;
+    uint64_t refcount_block_offset = 0;
+    uint64_t i, run;
+    void *refcount_block;
+    int ret;
+
+    if (table_index < s->refcount_table_size) {
+        refcount_block_offset =
+            s->refcount_table[table_index] & REFT_OFFSET_MASK;
+    }
+
+    hbitmap_reset(s->free_clusters, first, s->refcount_block_size);
+
+    if (!refcount_block_offset) {
+        hbitmap_set(s->free_clusters, first, s->refcount_block_size);
+        set_bit(table_index, s->free_clusters_loaded);
+        return 0;
+    }
+
+    if (offset_into_cluster(s, refcount_block_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#" PRIx64
+                                " unaligned (reftable index: %#" PRIx64 ")",
+                                refcount_block_offset, table_index);
+        return -EIO;
+    }
+
+    ret = qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+                          &refcount_block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0, run = 0; i < s->refcount_block_size; i++) {
+        if (s->get_refcount(refcount_block, i) == 0) {
+            run++;
+        } else if (run) {
+            hbitmap_set(s->free_clusters, first + i - run, run);
+            run = 0;
+        }
+    }
+    if (run) {
+        hbitmap_set(s->free_clusters, first + i - run, run);
+    }
+
+    qcow2_cache_put(s->refcount_block_cache, &refcount_block);
+
+    set_bit(table_index, s->free_clusters_loaded);
+    return 0;
+}
+
+/* Keeps the free space index in sync with a refcount update */
+static void free_index_update(BDRVQcow2State *s, uint64_t cluster_index,
+                              bool is_free)
+{
+    uint64_t table_index = cluster_index >> s->refcount_block_bits;
+
+    if (!s->free_clusters || table_index >= s->free_clusters_nb_blocks ||
+        !test_bit(table_index, s->free_clusters_loaded))
+    {
+        return;
+    }
+
+    if (is_free) {
+        hbitmap_set(s->free_clusters, cluster_index, 1);
+    } else {
+        hbitmap_reset(s->free_clusters, cluster_index, 1);
+    }
+}
+
+/*
+ * Returns the index of the first cluster at or after @start that the free
+ * space index considers free, scanning refcount blocks as needed.
+ */
+static int64_t free_index_next_free(BlockDriverState *bs, uint64_t start)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t end = s->free_clusters_nb_blocks << s->refcount_block_bits;
+    int ret;
+
+    while (start < end) {
+        uint64_t table_index = start >> s->refcount_block_bits;
+        uint64_t block_end = (table_index + 1) << s->refcount_block_bits;
+        uint64_t count = block_end - start;
+
+        if (!test_bit(table_index, s->free_clusters_loaded)) {
+            ret = free_index_load_block(bs, table_index);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (hbitmap_next_dirty_area(s->free_clusters, &start, &count)) {
+            return start;
+        }
+        start = block_end;
+    }
+
+    return start;
+}
+
+/*
+ * Returns the index of the first cluster in [@start, @start + @count) that
+ * the free space index considers used, or @start + @count if there is none.
+ */
+static int64_t free_index_next_used(BlockDriverState *bs, uint64_t start,
+                                    uint64_t count)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t index_end = s->free_clusters_nb_blocks << s->refcount_block_bits;
+    uint64_t end = start + count;
+    int64_t used;
+    int ret;
+
+    while (start < end && start < index_end) {
+        uint64_t table_index = start >> s->refcount_block_bits;
+        uint64_t block_end = MIN((table_index + 1) << s->refcount_block_bits,
+                                 end);
+
+        if (!test_bit(table_index, s->free_clusters_loaded)) {
+            ret = free_index_load_block(bs, table_index);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        used = hbitmap_next_zero(s->free_clusters, start, block_end - start);
+        if (used >= 0) {
+            return used;
+        }
+        start = block_end;
+    }
+
+    return end;
+}
+
+/*
+ * Finds the first run of @nb_clusters clusters at or after @start that are
+ * free according to the free space index.
+ */
+static int64_t free_index_find(BlockDriverState *bs, uint64_t start,
+                               uint64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t run_start, run_end;
+
+    free_index_resize(s);
+
+    for (;;) {
+        run_start = free_index_next_free(bs, start);
+        if (run_start < 0) {
+            return run_start;
+        }
+        run_end = free_index_next_used(bs, run_start, nb_clusters);
+        if (run_end < 0) {
+            return run_end;
+        }
+        if (run_end - run_start >= nb_clusters) {
+            return run_start;
+        }
+        start = run_end;
+    }
+}
+
 
 static uint64_t get_refcount_ro0(const void *refcount_array, uint64_t index)
 {
@@ -397,6 +607,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             (s->refcount_block_size - 1);
         s->set_refcount(*refcount_block, block_index, 1);
+        free_index_update(s, new_block >> s->cluster_bits, false);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -442,6 +653,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
         }
 
         s->refcount_table[refcount_table_index] = new_block;
+        qcow2_overlap_index_add(s, QCOW2_OL_REFCOUNT_BLOCK, new_block,
+                                refcount_table_index);
         /* If there's a hole in s->refcount_table then it can happen
          * that refcount_table_index < s->max_refcount_table_index */
         s->max_refcount_table_index =
@@ -715,6 +928,8 @@ int64_t qcow2_refcount_area(BlockDriverState *bs, uint64_t start_offset,
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
     update_max_refcount_table_index(s);
+    qcow2_free_index_reset(s);
+    qcow2_overlap_index_reset(s);
 
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
@@ -881,6 +1096,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         s->set_refcount(refcount_block, block_index, refcount);
+        free_index_update(s, cluster_index, refcount == 0);
 
         if (refcount == 0) {
             void *table;
@@ -967,6 +1183,7 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t i, nb_clusters, refcount;
+    int64_t free_index;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -976,6 +1193,13 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
 
     nb_clusters = size_to_clusters(s, size);
 retry:
+    free_index = free_index_find(bs, s->free_cluster_index, nb_clusters);
+    if (free_index < 0) {
+        return free_index;
+    }
+    s->free_cluster_index = free_index;
+
+    /* The index is only a hint, so check the refcounts */
     for(i = 0; i < nb_clusters; i++) {
         uint64_t next_cluster_index = s->free_cluster_index++;
         ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
@@ -983,6 +1207,7 @@ retry:
         if (ret < 0) {
             return ret;
         } else if (refcount != 0) {
+            free_index_update(s, next_cluster_index, false);
             goto retry;
         }
     }
@@ -1254,7 +1479,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
@@ -1310,7 +1535,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     uint64_t cluster_index;
                     uint64_t offset;
 
-                    entry = be64_to_cpu(l2_slice[j]);
+                    entry = get_l2_entry(s, l2_slice, j);
                     old_entry = entry;
                     entry &= ~QCOW_OFLAG_COPIED;
                     offset = entry & L2E_OFFSET_MASK;
@@ -1384,7 +1609,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                                        s->refcount_block_cache);
                         }
-                        l2_slice[j] = cpu_to_be64(entry);
+                        set_l2_entry(s, l2_slice, j, entry);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache,
                                                      l2_slice);
                     }
@@ -1586,10 +1811,78 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/*
+ * Maximum number of L2 tables, and of bytes in them, that check_refcounts_l1()
+ * reads concurrently before checking them one after another
+ */
+#define CHECK_L2_BATCH          64
+#define CHECK_L2_BATCH_BYTES    (16 * MiB)
+
+typedef struct CheckL2ReadTask {
+    AioTask task;
+    BlockDriverState *bs;
+    uint64_t l2_offset;
+    void *l2_table;
+    int *ret;
+} CheckL2ReadTask;
+
+static coroutine_fn int check_l2_read_task_entry(AioTask *task)
+{
+    CheckL2ReadTask *t = container_of(task, CheckL2ReadTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+
+    *t->ret = bdrv_co_pread(t->bs->file, t->l2_offset,
+                            s->l2_size * l2_entry_size(s), t->l2_table, 0);
+    return *t->ret;
+}
+
+/*
+ * Reads the L2 tables at @l2_offsets into consecutive parts of @buf and
+ * stores the result of each read in @rets.  In coroutine context, all tables
+ * are read concurrently.
+ */
+static void check_read_l2_tables(BlockDriverState *bs,
+                                 const uint64_t *l2_offsets, int nb_tables,
+                                 void *buf, int *rets)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int l2_size = s->l2_size * l2_entry_size(s);
+    AioTaskPool *pool;
+    int i;
+
+    if (nb_tables == 0) {
+        return;
+    }
+
+    if (!qemu_in_coroutine()) {
+        for (i = 0; i < nb_tables; i++) {
+            rets[i] = bdrv_pread(bs->file, l2_offsets[i],
+                                 (char *)buf + (size_t)i * l2_size, l2_size);
+        }
+        return;
+    }
+
+    pool = aio_task_pool_new(nb_tables);
+    for (i = 0; i < nb_tables; i++) {
+        CheckL2ReadTask *t = g_new(CheckL2ReadTask, 1);
+
+        *t = (CheckL2ReadTask) {
+            .task.func  = check_l2_read_task_entry,
+            .bs         = bs,
+            .l2_offset  = l2_offsets[i],
+            .l2_table   = (char *)buf + (size_t)i * l2_size,
+            .ret        = &rets[i],
+        };
+        aio_task_pool_start_task(pool, &t->task);
+    }
+    aio_task_pool_wait_all(pool);
+    aio_task_pool_free(pool);
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table @l2_table, which has been read from @l2_offset.
+ * While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1597,27 +1890,27 @@ enum {
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
+                              uint64_t *l2_table,
                               int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+        if (has_subclusters(s) &&
+            qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, 0) ==
+            QCOW2_SUBCLUSTER_INVALID) {
+            fprintf(stderr, "ERROR invalid subcluster allocation bitmap in "
+                    "cluster %d, entry=0x%" PRIx64 " bitmap=0x%" PRIx64 "\n",
+                    i, l2_entry, l2_bitmap);
+            res->corruptions++;
+        }
 
         switch (qcow2_get_cluster_type(bs, l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1637,6 +1930,14 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 break;
             }
 
+            if (l2_bitmap) {
+                fprintf(stderr, "ERROR compressed cluster %d with non-zero "
+                        "subcluster allocation bitmap, entry=0x%" PRIx64 "\n",
+                        i, l2_entry);
+                res->corruptions++;
+                break;
+            }
+
             /* Mark cluster as used */
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
@@ -1646,7 +1947,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 l2_entry & QCOW2_COMPRESSED_SECTOR_MASK,
                 nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1685,6 +1986,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                         int ign = active ? QCOW2_OL_ACTIVE_L2 :
                                            QCOW2_OL_INACTIVE_L2;
 
+                        /* Only images without subclusters get here */
                         l2_entry = QCOW_OFLAG_ZERO;
                         l2_table[i] = cpu_to_be64(l2_entry);
                         ret = qcow2_pre_write_overlap_check(bs, ign,
@@ -1694,7 +1996,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             res->check_errors++;
                             /* Something is seriously wrong, so abort checking
                              * this L2 table */
-                            goto fail;
+                            return ret;
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
@@ -1734,7 +2036,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                                                refcount_table_size,
                                                offset, s->cluster_size);
                 if (ret < 0) {
-                    goto fail;
+                    return ret;
                 }
             }
             break;
@@ -1749,12 +2051,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
-
-fail:
-    g_free(l2_table);
-    return ret;
 }
 
 /*
@@ -1774,7 +2071,12 @@ static int check_refcounts_l1(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    uint64_t l2_offsets[CHECK_L2_BATCH];
+    int l2_rets[CHECK_L2_BATCH];
+    int l2_size = s->l2_size * l2_entry_size(s);
+    int max_batch = MAX(MIN(CHECK_L2_BATCH, CHECK_L2_BATCH_BYTES / l2_size), 1);
+    void *l2_tables = NULL;
+    int i, j, batch_end, nb_tables, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1803,10 +2105,54 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
-    /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
+    if (l1_size > 0) {
+        l2_tables = g_try_malloc((size_t)max_batch * l2_size);
+        if (l2_tables == NULL) {
+            ret = -ENOMEM;
+            res->check_errors++;
+            goto fail;
+        }
+    }
+
+    /*
+     * Read the L2 tables in batches, but check them in L1 order so that the
+     * result and the messages are the same as if they were read one by one.
+     * A batch ends before an L2 table that appears twice in it, because
+     * checking the first copy may repair the table.
+     */
+    for (i = 0; i < l1_size; i = batch_end) {
+        nb_tables = 0;
+        for (batch_end = i; batch_end < l1_size; batch_end++) {
+            if (!l1_table[batch_end]) {
+                continue;
+            }
+            if (nb_tables == max_batch) {
+                break;
+            }
+
+            l2_offset = l1_table[batch_end] & L1E_OFFSET_MASK;
+            for (j = 0; j < nb_tables; j++) {
+                if (l2_offsets[j] == l2_offset) {
+                    break;
+                }
+            }
+            if (j < nb_tables) {
+                break;
+            }
+            l2_offsets[nb_tables++] = l2_offset;
+        }
+
+        check_read_l2_tables(bs, l2_offsets, nb_tables, l2_tables, l2_rets);
+
+        /* Do the actual checks */
+        for (j = 0; i < batch_end; i++) {
+            uint64_t *l2_table;
+
+            l2_offset = l1_table[i];
+            if (!l2_offset) {
+                continue;
+            }
+
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
             ret = qcow2_inc_refcounts_imrt(bs, res,
@@ -1823,19 +2169,29 @@ static int check_refcounts_l1(BlockDriverState *bs,
                 res->corruptions++;
             }
 
+            l2_table = (uint64_t *)((char *)l2_tables + (size_t)j * l2_size);
+            ret = l2_rets[j++];
+            if (ret < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+                res->check_errors++;
+                goto fail;
+            }
+
             /* Process and check L2 entries */
             ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags,
-                                     fix, active);
+                                     refcount_table_size, l2_offset, l2_table,
+                                     flags, fix, active);
             if (ret < 0) {
                 goto fail;
             }
         }
     }
+    g_free(l2_tables);
     g_free(l1_table);
     return 0;
 
 fail:
+    g_free(l2_tables);
     g_free(l1_table);
     return ret;
 }
@@ -1905,7 +2261,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1914,7 +2270,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
 
@@ -1937,9 +2293,10 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
                             repair ? "Repairing" : "ERROR", l2_entry, refcount);
                     if (repair) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j,
+                                     refcount == 1 ?
+                                     l2_entry |  QCOW_OFLAG_COPIED :
+                                     l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty++;
                     }
                 }
@@ -2511,6 +2868,8 @@ write_refblocks:
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
     update_max_refcount_table_index(s);
+    qcow2_free_index_reset(s);
+    qcow2_overlap_index_reset(s);
 
     return 0;
 
@@ -2645,6 +3004,266 @@ fail:
     return ret;
 }
 
+static void overlap_index_insert(BDRVQcow2State *s, int type, uint64_t offset,
+                                 uint64_t size, uint64_t slot)
+{
+    Qcow2OverlapEntry *entry = g_new(Qcow2OverlapEntry, 1);
+
+    entry->type = type;
+    entry->slot = slot;
+    interval_tree_insert(&s->overlap_index, &entry->node, offset,
+                         offset + size);
+    QLIST_INSERT_HEAD(&s->overlap_entries, entry, next);
+}
+
+static void overlap_index_remove(BDRVQcow2State *s, Qcow2OverlapEntry *entry)
+{
+    interval_tree_remove(&s->overlap_index, &entry->node);
+    QLIST_REMOVE(entry, next);
+    g_free(entry);
+}
+
+/*
+ * Drops the metadata overlap index.  Must be called whenever the active L1
+ * table, the refcount table or the snapshot list is replaced; the index is
+ * rebuilt by the next overlap check.  Entries that merely went away need not
+ * be dropped, see overlap_index_entry_valid().
+ */
+void qcow2_overlap_index_reset(BDRVQcow2State *s)
+{
+    Qcow2OverlapEntry *entry, *next;
+
+    QLIST_FOREACH_SAFE(entry, &s->overlap_entries, next, next) {
+        overlap_index_remove(s, entry);
+    }
+    assert(interval_tree_is_empty(&s->overlap_index));
+    s->overlap_index_types = 0;
+}
+
+/*
+ * Adds the cluster at @offset to the metadata overlap index after it has been
+ * hooked up as entry @slot of the active L1 table (QCOW2_OL_ACTIVE_L2) or of
+ * the refcount table (QCOW2_OL_REFCOUNT_BLOCK).
+ */
+void qcow2_overlap_index_add(BDRVQcow2State *s, int type, uint64_t offset,
+                             uint64_t slot)
+{
+    assert(type == QCOW2_OL_ACTIVE_L2 || type == QCOW2_OL_REFCOUNT_BLOCK);
+
+    if (offset && (s->overlap_index_types & type)) {
+        overlap_index_insert(s, type, offset, s->cluster_size, slot);
+    }
+}
+
+/*
+ * Returns whether @entry still describes metadata of the image.  Active L2
+ * tables and refcount blocks can be freed or moved in many places, so rather
+ * than tracking all of them, entries are checked against the table entry
+ * that pointed to them when they were added.  Snapshot L1 tables never
+ * change their L2 offsets, so inactive L2 entries stay valid until the
+ * snapshot list changes.
+ */
+static bool overlap_index_entry_valid(BDRVQcow2State *s,
+                                      Qcow2OverlapEntry *entry)
+{
+    uint64_t offset = entry->node.start;
+
+    switch (entry->type) {
+    case QCOW2_OL_ACTIVE_L2:
+        return s->l1_table && entry->slot < s->l1_size &&
+               (s->l1_table[entry->slot] & L1E_OFFSET_MASK) == offset;
+    case QCOW2_OL_REFCOUNT_BLOCK:
+        return s->refcount_table && entry->slot < s->refcount_table_size &&
+               (s->refcount_table[entry->slot] & REFT_OFFSET_MASK) == offset;
+    case QCOW2_OL_INACTIVE_L1:
+        return s->snapshots && entry->slot < s->nb_snapshots &&
+               s->snapshots[entry->slot].l1_table_offset == offset;
+    default:
+        return true;
+    }
+}
+
+static bool overlap_index_find_inactive_l2(IntervalTreeNode *node,
+                                           void *opaque)
+{
+    Qcow2OverlapEntry *entry = container_of(node, Qcow2OverlapEntry, node);
+    uint64_t *offset = opaque;
+
+    return entry->type == QCOW2_OL_INACTIVE_L2 && node->start == *offset;
+}
+
+/*
+ * Builds the metadata overlap index for the QCOW2_OL_INDEXED classes in
+ * @types.  The snapshot L1 tables are read before the old index is dropped,
+ * so that concurrent overlap checks never see a partially built index.
+ */
+static int overlap_index_rebuild(BlockDriverState *bs, int types)
+{
+    BDRVQcow2State *s = bs->opaque;
+    GArray *inactive_l2 = g_array_new(false, false, sizeof(uint64_t));
+    uint64_t i, j;
+    int ret;
+
+    if ((types & QCOW2_OL_INACTIVE_L2) && s->snapshots) {
+        for (i = 0; i < s->nb_snapshots; i++) {
+            uint64_t l1_ofs = s->snapshots[i].l1_table_offset;
+            uint32_t l1_sz  = s->snapshots[i].l1_size;
+            uint64_t l1_sz2 = l1_sz * sizeof(uint64_t);
+            uint64_t *l1;
+
+            ret = qcow2_validate_table(bs, l1_ofs, l1_sz, sizeof(uint64_t),
+                                       QCOW_MAX_L1_SIZE, "", NULL);
+            if (ret < 0) {
+                goto out;
+            }
+
+            l1 = g_try_malloc(l1_sz2);
+
+            if (l1_sz2 && l1 == NULL) {
+                ret = -ENOMEM;
+                goto out;
+            }
+
+            ret = bdrv_pread(bs->file, l1_ofs, l1, l1_sz2);
+            if (ret < 0) {
+                g_free(l1);
+                goto out;
+            }
+
+            for (j = 0; j < l1_sz; j++) {
+                uint64_t l2_ofs = be64_to_cpu(l1[j]) & L1E_OFFSET_MASK;
+                if (l2_ofs) {
+                    g_array_append_val(inactive_l2, l2_ofs);
+                }
+            }
+
+            g_free(l1);
+        }
+    }
+
+    qcow2_overlap_index_reset(s);
+
+    if ((types & QCOW2_OL_ACTIVE_L2) && s->l1_table) {
+        for (i = 0; i < s->l1_size; i++) {
+            uint64_t l2_ofs = s->l1_table[i] & L1E_OFFSET_MASK;
+            if (l2_ofs) {
+                overlap_index_insert(s, QCOW2_OL_ACTIVE_L2, l2_ofs,
+                                     s->cluster_size, i);
+            }
+        }
+    }
+
+    if ((types & QCOW2_OL_REFCOUNT_BLOCK) && s->refcount_table) {
+        for (i = 0; i < s->refcount_table_size; i++) {
+            uint64_t refblock_ofs = s->refcount_table[i] & REFT_OFFSET_MASK;
+            if (refblock_ofs) {
+                overlap_index_insert(s, QCOW2_OL_REFCOUNT_BLOCK, refblock_ofs,
+                                     s->cluster_size, i);
+            }
+        }
+    }
+
+    if ((types & QCOW2_OL_INACTIVE_L1) && s->snapshots) {
+        for (i = 0; i < s->nb_snapshots; i++) {
+            if (s->snapshots[i].l1_size) {
+                overlap_index_insert(s, QCOW2_OL_INACTIVE_L1,
+                                     s->snapshots[i].l1_table_offset,
+                                     s->snapshots[i].l1_size *
+                                     sizeof(uint64_t), i);
+            }
+        }
+    }
+
+    /* Snapshots usually share most of their L2 tables */
+    for (i = 0; i < inactive_l2->len; i++) {
+        uint64_t l2_ofs = g_array_index(inactive_l2, uint64_t, i);
+        if (!interval_tree_find(&s->overlap_index, l2_ofs, l2_ofs + 1,
+                                overlap_index_find_inactive_l2, &l2_ofs)) {
+            overlap_index_insert(s, QCOW2_OL_INACTIVE_L2, l2_ofs,
+                                 s->cluster_size, 0);
+        }
+    }
+
+    s->overlap_index_types = types;
+    ret = 0;
+
+out:
+    g_array_free(inactive_l2, true);
+    return ret;
+}
+
+typedef struct OverlapIndexQuery {
+    BDRVQcow2State *s;
+    int chk;
+    int found;
+    Qcow2OverlapEntry *stale;
+} OverlapIndexQuery;
+
+static bool overlap_index_match(IntervalTreeNode *node, void *opaque)
+{
+    OverlapIndexQuery *q = opaque;
+    Qcow2OverlapEntry *entry = container_of(node, Qcow2OverlapEntry, node);
+
+    if (!(q->chk & entry->type)) {
+        return false;
+    }
+    if (!overlap_index_entry_valid(q->s, entry)) {
+        q->stale = entry;
+        return true;
+    }
+    q->found |= entry->type;
+    return false;
+}
+
+/*
+ * Checks [offset, offset + size) against the QCOW2_OL_INDEXED classes in
+ * @chk, rebuilding the index first if it does not cover them.  If several
+ * classes overlap, the one returned is the same as with the linear checks
+ * this replaces.
+ */
+static int overlap_index_check(BlockDriverState *bs, int chk, int64_t offset,
+                               int64_t size)
+{
+    static const int order[] = {
+        QCOW2_OL_INACTIVE_L1,
+        QCOW2_OL_ACTIVE_L2,
+        QCOW2_OL_REFCOUNT_BLOCK,
+        QCOW2_OL_INACTIVE_L2,
+    };
+    BDRVQcow2State *s = bs->opaque;
+    OverlapIndexQuery q = {
+        .s      = s,
+        .chk    = chk,
+    };
+    int i, ret;
+
+    if (chk & ~s->overlap_index_types) {
+        ret = overlap_index_rebuild(bs, s->overlap_check & QCOW2_OL_INDEXED);
+        if (ret < 0) {
+            return ret;
+        }
+        q.chk &= s->overlap_index_types;
+    }
+
+    for (;;) {
+        q.found = 0;
+        q.stale = NULL;
+        interval_tree_find(&s->overlap_index, offset, offset + size,
+                           overlap_index_match, &q);
+        if (!q.stale) {
+            break;
+        }
+        overlap_index_remove(s, q.stale);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(order); i++) {
+        if (q.found & order[i]) {
+            return order[i];
+        }
+    }
+    return 0;
+}
+
 #define overlaps_with(ofs, sz) \
     ranges_overlap(offset, size, ofs, sz)
 
@@ -2667,7 +3286,6 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
 {
     BDRVQcow2State *s = bs->opaque;
     int chk = s->overlap_check & ~ign;
-    int i, j;
 
     if (!size) {
         return 0;
@@ -2702,75 +3320,10 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
-    if ((chk & QCOW2_OL_INACTIVE_L1) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            if (s->snapshots[i].l1_size &&
-                overlaps_with(s->snapshots[i].l1_table_offset,
-                s->snapshots[i].l1_size * sizeof(uint64_t))) {
-                return QCOW2_OL_INACTIVE_L1;
-            }
-        }
-    }
-
-    if ((chk & QCOW2_OL_ACTIVE_L2) && s->l1_table) {
-        for (i = 0; i < s->l1_size; i++) {
-            if ((s->l1_table[i] & L1E_OFFSET_MASK) &&
-                overlaps_with(s->l1_table[i] & L1E_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_ACTIVE_L2;
-            }
-        }
-    }
-
-    if ((chk & QCOW2_OL_REFCOUNT_BLOCK) && s->refcount_table) {
-        unsigned last_entry = s->max_refcount_table_index;
-        assert(last_entry < s->refcount_table_size);
-        assert(last_entry + 1 == s->refcount_table_size ||
-               (s->refcount_table[last_entry + 1] & REFT_OFFSET_MASK) == 0);
-        for (i = 0; i <= last_entry; i++) {
-            if ((s->refcount_table[i] & REFT_OFFSET_MASK) &&
-                overlaps_with(s->refcount_table[i] & REFT_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_REFCOUNT_BLOCK;
-            }
-        }
-    }
-
-    if ((chk & QCOW2_OL_INACTIVE_L2) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            uint64_t l1_ofs = s->snapshots[i].l1_table_offset;
-            uint32_t l1_sz  = s->snapshots[i].l1_size;
-            uint64_t l1_sz2 = l1_sz * sizeof(uint64_t);
-            uint64_t *l1;
-            int ret;
-
-            ret = qcow2_validate_table(bs, l1_ofs, l1_sz, sizeof(uint64_t),
-                                       QCOW_MAX_L1_SIZE, "", NULL);
-            if (ret < 0) {
-                return ret;
-            }
-
-            l1 = g_try_malloc(l1_sz2);
-
-            if (l1_sz2 && l1 == NULL) {
-                return -ENOMEM;
-            }
-
-            ret = bdrv_pread(bs->file, l1_ofs, l1, l1_sz2);
-            if (ret < 0) {
-                g_free(l1);
-                return ret;
-            }
-
-            for (j = 0; j < l1_sz; j++) {
-                uint64_t l2_ofs = be64_to_cpu(l1[j]) & L1E_OFFSET_MASK;
-                if (l2_ofs && overlaps_with(l2_ofs, s->cluster_size)) {
-                    g_free(l1);
-                    return QCOW2_OL_INACTIVE_L2;
-                }
-            }
-
-            g_free(l1);
+    if (chk & QCOW2_OL_INDEXED) {
+        int ret = overlap_index_check(bs, chk & QCOW2_OL_INDEXED, offset, size);
+        if (ret != 0) {
+            return ret;
         }
     }
 
@@ -3243,6 +3796,8 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     old_reftable = s->refcount_table;
     s->refcount_table = new_reftable;
     update_max_refcount_table_index(s);
+    qcow2_free_index_reset(s);
+    qcow2_overlap_index_reset(s);
 
     s->refcount_bits = 1 << refcount_order;
     s->refcount_max = UINT64_C(1) << (s->refcount_bits - 1);
@@ -3341,6 +3896,7 @@ static int qcow2_discard_refcount_block(BlockDriverState *bs,
         return -EINVAL;
     }
     s->set_refcount(refblock, block_index, 0);
+    free_index_update(s, cluster_index, true);
 
     qcow2_cache_entry_mark_dirty(s->refcount_block_cache, refblock);
 
@@ -3418,6 +3974,7 @@ int qcow2_shrink_reftable(BlockDriverState *bs)
             s->refcount_table[i] = 0;
         }
     }
+    qcow2_free_index_reset(s);
 
     if (!s->cache_discards) {
         qcow2_process_discards(bs, ret);
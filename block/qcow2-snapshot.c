@@ -51,6 +51,7 @@ void qcow2_free_snapshots(BlockDriverState *bs)
     g_free(s->snapshots);
     s->snapshots = NULL;
     s->nb_snapshots = 0;
+    qcow2_overlap_index_reset(s);
 }
 
 /*
@@ -246,6 +247,7 @@ static int qcow2_do_read_snapshots(BlockDriverState *bs, bool repair,
 
     assert(offset - s->snapshots_offset <= INT_MAX);
     s->snapshots_size = offset - s->snapshots_offset;
+    qcow2_overlap_index_reset(s);
     return 0;
 
 fail:
@@ -469,6 +471,7 @@ int coroutine_fn qcow2_check_read_snapshot_table(BlockDriverState *bs,
         /* We did not read the snapshot table, so invalidate this information */
         s->snapshots_offset = 0;
         s->nb_snapshots = 0;
+        qcow2_overlap_index_reset(s);
 
         return ret;
     }
@@ -711,12 +714,14 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     }
     s->snapshots = new_snapshot_list;
     s->snapshots[s->nb_snapshots++] = *sn;
+    qcow2_overlap_index_reset(s);
 
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         g_free(s->snapshots);
         s->snapshots = old_snapshot_list;
         s->nb_snapshots--;
+        qcow2_overlap_index_reset(s);
         goto fail;
     }
 
@@ -853,6 +858,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
+    qcow2_overlap_index_reset(s);
 
     if (ret < 0) {
         goto fail;
@@ -916,6 +922,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
             s->snapshots + snapshot_index + 1,
             (s->nb_snapshots - snapshot_index - 1) * sizeof(sn));
     s->nb_snapshots--;
+    qcow2_overlap_index_reset(s);
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret,
@@ -1047,6 +1054,7 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
     for(i = 0;i < s->l1_size; i++) {
         be64_to_cpus(&s->l1_table[i]);
     }
+    qcow2_overlap_index_reset(s);
 
     return 0;
 }
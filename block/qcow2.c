@@ -684,6 +684,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_COMPRESSED_READAHEAD,
     NULL
 };
 
@@ -795,6 +796,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_COMPRESSED_READAHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of compressed clusters to decompress ahead of "
+                    "sequential reads",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -870,7 +877,7 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     uint64_t max_l2_entries = DIV_ROUND_UP(virtual_disk_size, s->cluster_size);
     /* An L2 table is always one cluster in size so the max cache size
      * should be a multiple of the cluster size. */
-    uint64_t max_l2_cache = ROUND_UP(max_l2_entries * sizeof(uint64_t),
+    uint64_t max_l2_cache = ROUND_UP(max_l2_entries * l2_entry_size(s),
                                      s->cluster_size);
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
@@ -954,6 +961,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    int compressed_readahead;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -967,6 +975,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t compressed_readahead;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1031,7 +1040,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
@@ -1060,6 +1069,18 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Readahead for compressed clusters, limited by the decompression cache */
+    compressed_readahead =
+        qemu_opt_get_number(opts, QCOW2_OPT_COMPRESSED_READAHEAD,
+                            DEFAULT_COMPRESSED_READAHEAD);
+    if (compressed_readahead >= QCOW2_DECOMPRESS_CACHE_SIZE) {
+        error_setg(errp, QCOW2_OPT_COMPRESSED_READAHEAD " must be less "
+                   "than %d", QCOW2_DECOMPRESS_CACHE_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->compressed_readahead = compressed_readahead;
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1210,6 +1231,8 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    s->compressed_readahead = r->compressed_readahead;
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1242,6 +1265,42 @@ static int qcow2_update_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+static int validate_compression_type(BDRVQcow2State *s, Error **errp)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+#endif
+        break;
+
+    default:
+        error_setg(errp, "qcow2: unknown compression type: %u",
+                   s->compression_type);
+        return -ENOTSUP;
+    }
+
+    /*
+     * If the compression type differs from zlib, the incompatible feature
+     * bit must be set, and it must not be set otherwise
+     */
+    if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB) {
+        if (s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) {
+            error_setg(errp, "qcow2: Compression type incompatible feature "
+                             "bit must not be set");
+            return -EINVAL;
+        }
+    } else {
+        if (!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION)) {
+            error_setg(errp, "qcow2: Compression type incompatible feature "
+                             "bit must be set");
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
 /* Called with s->lock held.  */
 static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
                                       int flags, Error **errp)
@@ -1328,6 +1387,12 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
+    if (header.header_length > offsetof(QCowHeader, compression_type)) {
+        s->compression_type = header.compression_type;
+    } else {
+        s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+
     if (header.header_length > sizeof(header)) {
         s->unknown_header_fields_size = header.header_length - sizeof(header);
         s->unknown_header_fields = g_malloc(s->unknown_header_fields_size);
@@ -1369,6 +1434,11 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
+    ret = validate_compression_type(s, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     if (s->incompatible_features & QCOW2_INCOMPAT_CORRUPT) {
         /* Corrupt images may not be written to unless they are being repaired
          */
@@ -1420,7 +1490,23 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s)) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Images with extended L2 entries need a cluster "
+                       "size of at least %d bytes",
+                       1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->subclusters_per_cluster = QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+    } else {
+        s->subclusters_per_cluster = 1;
+    }
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1751,6 +1837,9 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        qemu_co_queue_init(&s->decompress_cache[i].waiters);
+    }
 
     return ret;
 
@@ -1836,7 +1925,7 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
         /* Encryption works on a sector granularity */
         bs->bl.request_alignment = qcrypto_block_get_sector_size(s->crypto);
     }
-    bs->bl.pwrite_zeroes_alignment = s->cluster_size;
+    bs->bl.pwrite_zeroes_alignment = s->subcluster_size;
     bs->bl.pdiscard_alignment = s->cluster_size;
 }
 
@@ -2338,6 +2427,9 @@ static int handle_alloc_space(BlockDriverState *bs, QCowL2Meta *l2meta)
 
     for (m = l2meta; m != NULL; m = m->next) {
         int ret;
+        uint64_t start_offset = m->alloc_offset + m->cow_start.offset;
+        unsigned nb_bytes = m->cow_end.offset + m->cow_end.nb_bytes -
+            m->cow_start.offset;
 
         if (!m->cow_start.nb_bytes && !m->cow_end.nb_bytes) {
             continue;
@@ -2348,20 +2440,19 @@ static int handle_alloc_space(BlockDriverState *bs, QCowL2Meta *l2meta)
         }
 
         /*
-         * instead of writing zero COW buffers,
-         * efficiently zero out the whole clusters
+         * instead of writing zero COW buffers, efficiently zero out the
+         * whole area covered by the request; with subclusters this may be
+         * less than the allocated clusters
          */
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, m->alloc_offset,
-                                            m->nb_clusters * s->cluster_size,
+        ret = qcow2_pre_write_overlap_check(bs, 0, start_offset, nb_bytes,
                                             true);
         if (ret < 0) {
             return ret;
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_ALLOC_SPACE);
-        ret = bdrv_co_pwrite_zeroes(s->data_file, m->alloc_offset,
-                                    m->nb_clusters * s->cluster_size,
+        ret = bdrv_co_pwrite_zeroes(s->data_file, start_offset, nb_bytes,
                                     BDRV_REQ_NO_FALLBACK);
         if (ret < 0) {
             if (ret != -ENOTSUP && ret != -EAGAIN) {
@@ -2592,6 +2683,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    int i;
+
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -2604,6 +2697,11 @@ static void qcow2_close(BlockDriverState *bs)
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
 
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        assert(!s->decompress_cache[i].in_flight);
+        qemu_vfree(s->decompress_cache[i].buf);
+    }
+
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
 
@@ -2716,7 +2814,16 @@ int qcow2_update_header(BlockDriverState *bs)
         goto fail;
     }
 
-    header_length = sizeof(*header) + s->unknown_header_fields_size;
+    /*
+     * The compression type field may be omitted for zlib, keep the header
+     * short then so that older versions of qemu see the same image layout
+     */
+    if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB &&
+        !s->unknown_header_fields_size) {
+        header_length = offsetof(QCowHeader, compression_type);
+    } else {
+        header_length = sizeof(*header) + s->unknown_header_fields_size;
+    }
     total_size = bs->total_sectors * BDRV_SECTOR_SIZE;
     refcount_table_clusters = s->refcount_table_size >> (s->cluster_bits - 3);
 
@@ -2742,6 +2849,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -2750,7 +2858,7 @@ int qcow2_update_header(BlockDriverState *bs)
         ret = offsetof(QCowHeader, incompatible_features);
         break;
     case 3:
-        ret = sizeof(*header);
+        ret = header_length - s->unknown_header_fields_size;
         break;
     default:
         ret = -EINVAL;
@@ -2834,6 +2942,16 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_DATA_FILE_BITNR,
                 .name = "external data file",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3134,28 +3252,31 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
  * @total_size: virtual disk size in bytes
  * @cluster_size: cluster size in bytes
  * @refcount_order: refcount bits power-of-2 exponent
+ * @extended_l2: true if the image has extended L2 entries
  *
  * Returns: Total number of bytes required for the fully allocated image
  * (including metadata).
  */
 static int64_t qcow2_calc_prealloc_size(int64_t total_size,
                                         size_t cluster_size,
-                                        int refcount_order)
+                                        int refcount_order,
+                                        bool extended_l2)
 {
     int64_t meta_size = 0;
     uint64_t nl1e, nl2e;
     int64_t aligned_total_size = ROUND_UP(total_size, cluster_size);
+    size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
 
     /* header: 1 cluster */
     meta_size += cluster_size;
 
     /* total size of L2 tables */
     nl2e = aligned_total_size / cluster_size;
-    nl2e = ROUND_UP(nl2e, cluster_size / sizeof(uint64_t));
-    meta_size += nl2e * sizeof(uint64_t);
+    nl2e = ROUND_UP(nl2e, cluster_size / l2e_size);
+    meta_size += nl2e * l2e_size;
 
     /* total size of L1 tables */
-    nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+    nl1e = nl2e * l2e_size / cluster_size;
     nl1e = ROUND_UP(nl1e, cluster_size / sizeof(uint64_t));
     meta_size += nl1e * sizeof(uint64_t);
 
@@ -3167,7 +3288,8 @@ static int64_t qcow2_calc_prealloc_size(int64_t total_size,
     return meta_size + aligned_total_size;
 }
 
-static bool validate_cluster_size(size_t cluster_size, Error **errp)
+static bool validate_cluster_size(size_t cluster_size, bool extended_l2,
+                                  Error **errp)
 {
     int cluster_bits = ctz32(cluster_size);
     if (cluster_bits < MIN_CLUSTER_BITS || cluster_bits > MAX_CLUSTER_BITS ||
@@ -3177,16 +3299,24 @@ static bool validate_cluster_size(size_t cluster_size, Error **errp)
                    "%dk", 1 << MIN_CLUSTER_BITS, 1 << (MAX_CLUSTER_BITS - 10));
         return false;
     }
+
+    if (extended_l2 && cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries are only supported with cluster "
+                   "sizes of at least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+        return false;
+    }
+
     return true;
 }
 
-static size_t qcow2_opt_get_cluster_size_del(QemuOpts *opts, Error **errp)
+static size_t qcow2_opt_get_cluster_size_del(QemuOpts *opts, bool extended_l2,
+                                             Error **errp)
 {
     size_t cluster_size;
 
     cluster_size = qemu_opt_get_size_del(opts, BLOCK_OPT_CLUSTER_SIZE,
                                          DEFAULT_CLUSTER_SIZE);
-    if (!validate_cluster_size(cluster_size, errp)) {
+    if (!validate_cluster_size(cluster_size, extended_l2, errp)) {
         return 0;
     }
     return cluster_size;
@@ -3262,6 +3392,7 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     uint64_t* refcount_table;
     Error *local_err = NULL;
     int ret;
+    uint8_t compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
 
     assert(create_options->driver == BLOCKDEV_DRIVER_QCOW2);
     qcow2_opts = &create_options->u.qcow2;
@@ -3294,13 +3425,24 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         version = 3;
     }
 
+    if (!qcow2_opts->has_extended_l2) {
+        qcow2_opts->extended_l2 = false;
+    }
+    if (qcow2_opts->extended_l2 && version < 3) {
+        error_setg(errp, "Extended L2 entries are only supported with "
+                   "compatibility level 1.1 and above (use version=v3 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto out;
+    }
+
     if (qcow2_opts->has_cluster_size) {
         cluster_size = qcow2_opts->cluster_size;
     } else {
         cluster_size = DEFAULT_CLUSTER_SIZE;
     }
 
-    if (!validate_cluster_size(cluster_size, errp)) {
+    if (!validate_cluster_size(cluster_size, qcow2_opts->extended_l2, errp)) {
         ret = -EINVAL;
         goto out;
     }
@@ -3364,6 +3506,30 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    if (qcow2_opts->has_compression_type &&
+        qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        if (version < 3) {
+            error_setg(errp, "Non-zlib compression type is only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+
+        switch (qcow2_opts->compression_type) {
+#ifdef CONFIG_ZSTD
+        case QCOW2_COMPRESSION_TYPE_ZSTD:
+            break;
+#endif
+        default:
+            error_setg(errp, "Unknown compression type");
+            ret = -EINVAL;
+            goto out;
+        }
+
+        compression_type = qcow2_opts->compression_type;
+    }
+
     if (qcow2_opts->data_file) {
         if (version < 3) {
             error_setg(errp, "External data files are only supported with "
@@ -3401,9 +3567,18 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         .refcount_table_offset      = cpu_to_be64(cluster_size),
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
-        .header_length              = cpu_to_be32(sizeof(*header)),
+        .compression_type           = compression_type,
     };
 
+    if (compression_type == QCOW2_COMPRESSION_TYPE_ZLIB) {
+        header->header_length =
+            cpu_to_be32(offsetof(QCowHeader, compression_type));
+    } else {
+        header->header_length = cpu_to_be32(sizeof(*header));
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
+    }
+
     /* We'll update this to correct value later */
     header->crypt_method = cpu_to_be32(QCOW_CRYPT_NONE);
 
@@ -3415,6 +3590,10 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         header->incompatible_features |=
             cpu_to_be64(QCOW2_INCOMPAT_DATA_FILE);
     }
+    if (qcow2_opts->extended_l2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
     if (qcow2_opts->data_file_raw) {
         header->autoclear_features |=
             cpu_to_be64(QCOW2_AUTOCLEAR_DATA_FILE_RAW);
@@ -3602,6 +3781,8 @@ static int coroutine_fn qcow2_co_create_opts(const char *filename, QemuOpts *opt
         { BLOCK_OPT_ENCRYPT,            BLOCK_OPT_ENCRYPT_FORMAT },
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
+        { BLOCK_OPT_EXTL2,              "extended-l2" },
+        { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
         { NULL, NULL },
     };
 
@@ -3706,8 +3887,8 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
-    uint32_t head = offset % s->cluster_size;
-    uint32_t tail = (offset + bytes) % s->cluster_size;
+    uint32_t head = offset % s->subcluster_size;
+    uint32_t tail = (offset + bytes) % s->subcluster_size;
 
     trace_qcow2_pwrite_zeroes_start_req(qemu_coroutine_self(), offset, bytes);
     if (offset + bytes == bs->total_sectors * BDRV_SECTOR_SIZE) {
@@ -3718,20 +3899,20 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         uint64_t off;
         unsigned int nr;
 
-        assert(head + bytes <= s->cluster_size);
+        assert(head + bytes <= s->subcluster_size);
 
-        /* check whether remainder of cluster already reads as zero */
+        /* check whether remainder of subcluster already reads as zero */
         if (!(is_zero(bs, offset - head, head) &&
               is_zero(bs, offset + bytes,
-                      tail ? s->cluster_size - tail : 0))) {
+                      tail ? s->subcluster_size - tail : 0))) {
             return -ENOTSUP;
         }
 
         qemu_co_mutex_lock(&s->lock);
         /* We can have new write after previous check */
-        offset = QEMU_ALIGN_DOWN(offset, s->cluster_size);
-        bytes = s->cluster_size;
-        nr = s->cluster_size;
+        offset = QEMU_ALIGN_DOWN(offset, s->subcluster_size);
+        bytes = s->subcluster_size;
+        nr = s->subcluster_size;
         ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
         if (ret != QCOW2_CLUSTER_UNALLOCATED &&
             ret != QCOW2_CLUSTER_ZERO_PLAIN &&
@@ -3745,7 +3926,7 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
 
     trace_qcow2_pwrite_zeroes(qemu_coroutine_self(), offset, bytes);
 
-    /* Whatever is left can use real zero clusters */
+    /* Whatever is left can use real zero (sub)clusters */
     ret = qcow2_cluster_zeroize(bs, offset, bytes, flags);
     qemu_co_mutex_unlock(&s->lock);
 
@@ -4269,6 +4450,8 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
     ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
+    /* Readahead may have picked up the new L2 entry before the data */
+    qcow2_decompress_cache_invalidate(bs);
     if (ret < 0) {
         goto fail;
     }
@@ -4351,22 +4534,21 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Read the compressed cluster described by @l2_entry and decompress it into
+ * @dest, which must be s->cluster_size bytes long.
+ */
 static int coroutine_fn
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t file_cluster_offset,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset)
+qcow2_co_decompress_cluster(BlockDriverState *bs, uint64_t l2_entry,
+                            uint8_t *dest)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret = 0, csize, nb_csectors;
     uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
+    uint8_t *buf;
 
-    coffset = file_cluster_offset & s->cluster_offset_mask;
-    nb_csectors = ((file_cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    coffset = l2_entry & s->cluster_offset_mask;
+    nb_csectors = ((l2_entry >> s->csize_shift) & s->csize_mask) + 1;
     csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
         (coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
 
@@ -4375,28 +4557,275 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         return -ENOMEM;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
     BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
     ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
     if (ret < 0) {
         goto fail;
     }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+    if (qcow2_co_decompress(bs, dest, s->cluster_size, buf, csize) < 0) {
         ret = -EIO;
         goto fail;
     }
 
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
 fail:
-    qemu_vfree(out_buf);
     g_free(buf);
 
     return ret;
 }
 
+/*
+ * Decompressed clusters are kept in a small cache so that sequential reads
+ * smaller than a cluster don't decompress the same cluster over and over,
+ * and so that readahead has somewhere to put its results.
+ *
+ * The cache is only accessed from coroutines in the AioContext of @bs and
+ * none of the helpers below yield, so no lock is needed; a slot that is being
+ * filled is marked in_flight and is never evicted.
+ */
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_find(BDRVQcow2State *s, uint64_t l2_entry)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        if (s->decompress_cache[i].l2_entry == l2_entry) {
+            return &s->decompress_cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Reserve a slot for @l2_entry, evicting the least recently used one if
+ * needed.  Returns NULL if all slots are busy or no memory is available.
+ */
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_claim(BlockDriverState *bs, uint64_t l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressedCluster *c = NULL;
+    uint64_t min_lru_counter = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        Qcow2DecompressedCluster *slot = &s->decompress_cache[i];
+
+        if (slot->in_flight) {
+            continue;
+        }
+        if (!slot->l2_entry) {
+            c = slot;
+            break;
+        }
+        if (slot->lru_counter < min_lru_counter) {
+            min_lru_counter = slot->lru_counter;
+            c = slot;
+        }
+    }
+
+    if (!c) {
+        return NULL;
+    }
+
+    if (!c->buf) {
+        c->buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+        if (!c->buf) {
+            return NULL;
+        }
+    }
+
+    c->l2_entry = l2_entry;
+    c->lru_counter = ++s->decompress_cache_lru_counter;
+    c->generation = s->decompress_cache_gen;
+    c->in_flight = true;
+
+    return c;
+}
+
+static int coroutine_fn
+qcow2_decompress_cache_fill(BlockDriverState *bs, Qcow2DecompressedCluster *c)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    assert(c->in_flight);
+
+    ret = qcow2_co_decompress_cluster(bs, c->l2_entry, c->buf);
+
+    c->in_flight = false;
+    if (ret < 0 || c->generation != s->decompress_cache_gen) {
+        c->l2_entry = 0;
+    }
+    qemu_co_queue_restart_all(&c->waiters);
+
+    return ret;
+}
+
+/*
+ * Drop all cached clusters.  Must be called whenever a compressed cluster
+ * descriptor could start to refer to different data, i.e. when compressed
+ * clusters are allocated.
+ */
+void qcow2_decompress_cache_invalidate(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    /* Slots that are in flight are dropped when they complete */
+    s->decompress_cache_gen++;
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        if (!s->decompress_cache[i].in_flight) {
+            s->decompress_cache[i].l2_entry = 0;
+        }
+    }
+}
+
+typedef struct Qcow2ReadaheadCo {
+    BlockDriverState *bs;
+    Qcow2DecompressedCluster *c;
+} Qcow2ReadaheadCo;
+
+static void coroutine_fn qcow2_co_readahead_entry(void *opaque)
+{
+    Qcow2ReadaheadCo *rco = opaque;
+    BlockDriverState *bs = rco->bs;
+
+    /* Errors are reported again to whoever reads the cluster for real */
+    qcow2_decompress_cache_fill(bs, rco->c);
+
+    g_free(rco);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Called for every read from the compressed guest cluster at @offset.  If
+ * the guest reads sequentially, start reading and decompressing the
+ * following compressed clusters in the background so that they are
+ * decompressed in parallel on the thread pool and ready when the guest
+ * gets there.
+ */
+static void coroutine_fn
+qcow2_co_compressed_readahead(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    uint64_t cluster = start_of_cluster(s, offset);
+    uint64_t start, end, disk_size, ra_offset;
+
+    if (cluster != s->compressed_ra_last &&
+        cluster != s->compressed_ra_last + s->cluster_size)
+    {
+        /* Not a sequential reader (yet), start over */
+        s->compressed_ra_last = cluster;
+        s->compressed_ra_end = 0;
+        return;
+    }
+
+    s->compressed_ra_last = cluster;
+    if (!s->compressed_readahead) {
+        return;
+    }
+
+    disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    start = MAX(cluster + s->cluster_size, s->compressed_ra_end);
+    end = MIN(cluster + (1 + s->compressed_readahead) * s->cluster_size,
+              ROUND_UP(disk_size, s->cluster_size));
+    if (start >= end) {
+        return;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    for (ra_offset = start; ra_offset < end; ra_offset += s->cluster_size) {
+        unsigned int bytes = s->cluster_size;
+        uint64_t l2_entry;
+        Qcow2DecompressedCluster *c;
+        Qcow2ReadaheadCo *rco;
+        int ret;
+
+        ret = qcow2_get_cluster_offset(bs, ra_offset, &bytes, &l2_entry);
+        if (ret != QCOW2_CLUSTER_COMPRESSED) {
+            break;
+        }
+        if (qcow2_decompress_cache_find(s, l2_entry)) {
+            continue;
+        }
+
+        c = qcow2_decompress_cache_claim(bs, l2_entry);
+        if (!c) {
+            break;
+        }
+
+        rco = g_new(Qcow2ReadaheadCo, 1);
+        *rco = (Qcow2ReadaheadCo) {
+            .bs = bs,
+            .c = c,
+        };
+        bdrv_inc_in_flight(bs);
+        aio_co_enter(ctx, qemu_coroutine_create(qcow2_co_readahead_entry,
+                                                rco));
+    }
+    s->compressed_ra_end = ra_offset;
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static int coroutine_fn
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t file_cluster_offset,
+                           uint64_t offset,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov,
+                           size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressedCluster *c;
+    int ret;
+    uint8_t *out_buf;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+
+    qcow2_co_compressed_readahead(bs, offset);
+
+    while ((c = qcow2_decompress_cache_find(s, file_cluster_offset)) &&
+           c->in_flight)
+    {
+        qemu_co_queue_wait(&c->waiters, NULL);
+    }
+
+    if (c) {
+        c->lru_counter = ++s->decompress_cache_lru_counter;
+        qemu_iovec_from_buf(qiov, qiov_offset, c->buf + offset_in_cluster,
+                            bytes);
+        return 0;
+    }
+
+    c = qcow2_decompress_cache_claim(bs, file_cluster_offset);
+    if (c) {
+        ret = qcow2_decompress_cache_fill(bs, c);
+        if (ret == 0) {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                c->buf + offset_in_cluster, bytes);
+        }
+        return ret;
+    }
+
+    /* All slots are busy, decompress into a temporary buffer */
+    out_buf = qemu_try_blockalign(bs, s->cluster_size);
+    if (!out_buf) {
+        return -ENOMEM;
+    }
+
+    ret = qcow2_co_decompress_cluster(bs, file_cluster_offset, out_buf);
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                            bytes);
+    }
+
+    qemu_vfree(out_buf);
+
+    return ret;
+}
+
 static int make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -4489,6 +4918,7 @@ static int make_completely_empty(BlockDriverState *bs)
     g_free(s->refcount_table);
     s->refcount_table = new_reftable;
     new_reftable = NULL;
+    qcow2_free_index_reset(s);
 
     /* Now the in-memory refcount information again corresponds to the on-disk
      * information (reftable is empty and no refblocks (the refblock cache is
@@ -4506,6 +4936,7 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail_broken_refcounts;
     }
     s->refcount_table[0] = 2 * s->cluster_size;
+    qcow2_overlap_index_reset(s);
 
     s->free_cluster_index = 0;
     assert(3 + l1_clusters <= s->refcount_block_size);
@@ -4674,9 +5105,14 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     PreallocMode prealloc;
     bool has_backing_file;
     bool has_luks;
+    bool extended_l2;
+    size_t l2e_size;
 
     /* Parse image creation options */
-    cluster_size = qcow2_opt_get_cluster_size_del(opts, &local_err);
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+
+    cluster_size = qcow2_opt_get_cluster_size_del(opts, extended_l2,
+                                                  &local_err);
     if (local_err) {
         goto err;
     }
@@ -4721,8 +5157,9 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     virtual_size = ROUND_UP(virtual_size, cluster_size);
 
     /* Check that virtual disk size is valid */
+    l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
-                             cluster_size / sizeof(uint64_t));
+                             cluster_size / l2e_size);
     if (l2_tables * sizeof(uint64_t) > QCOW_MAX_L1_SIZE) {
         error_setg(&local_err, "The image size is too large "
                                "(try using a larger cluster size)");
@@ -4787,7 +5224,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     info = g_new(BlockMeasureInfo, 1);
     info->fully_allocated =
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
-                                 ctz32(refcount_bits)) + luks_payload_size;
+                                 ctz32(refcount_bits), extended_l2) +
+        luks_payload_size;
 
     /* Remove data clusters that are not required.  This overestimates the
      * required size because metadata needed for the fully allocated file is
@@ -4807,6 +5245,8 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->unallocated_blocks_are_zero = true;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+    /* Compressed clusters are allocated under s->lock */
+    bdi->unordered_compressed_writes = true;
     return 0;
 }
 
@@ -4859,6 +5299,11 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
             .data_file          = g_strdup(s->image_data_file),
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
+            .has_extended_l2    = has_subclusters(s),
+            .extended_l2        = has_subclusters(s),
+            .has_compression_type = s->compression_type !=
+                                    QCOW2_COMPRESSION_TYPE_ZLIB,
+            .compression_type   = s->compression_type,
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -5248,6 +5693,23 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "images");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2,
+                                  has_subclusters(s)) != has_subclusters(s)) {
+                error_setg(errp, "Changing extended_l2 is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *compression_type =
+                qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+
+            if (compression_type &&
+                strcmp(compression_type,
+                       Qcow2CompressionType_str(s->compression_type))) {
+                error_setg(errp, "Changing the compression type "
+                           "is not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -5473,6 +5935,16 @@ static QemuOptsList qcow2_create_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "The external data file must stay valid as a raw image"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables",
+        },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for image cluster compression",
+        },
         {
             .name = BLOCK_OPT_ENCRYPT,
             .type = QEMU_OPT_BOOL,
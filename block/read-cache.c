@@ -0,0 +1,955 @@
+/*
+ * Read cache filter block driver
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The cache keeps the most recently used blocks of its file child in RAM.
+ * With a "disk" child, every block read from the file child is also written
+ * to the same offset of the disk child, which then serves as a second tier
+ * for blocks that were evicted from RAM.  Which blocks of the disk child are
+ * valid is only tracked in memory, so its content is not reused across
+ * restarts.
+ *
+ * Populating the cache never blocks guest requests: blocks are added once
+ * their data has been read, and writes that overlap a read in flight mark it
+ * stale so that old data is never inserted after the write completed.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/util.h"
+#include "qemu/bitmap.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+
+#define READ_CACHE_OPT_BLOCK_SIZE   "block-size"
+#define READ_CACHE_OPT_RAM_SIZE     "ram-size"
+#define READ_CACHE_OPT_WRITE_POLICY "write-policy"
+#define READ_CACHE_OPT_READAHEAD    "readahead"
+
+#define READ_CACHE_DEFAULT_BLOCK_SIZE   (64 * KiB)
+#define READ_CACHE_DEFAULT_RAM_SIZE     (32 * MiB)
+#define READ_CACHE_MAX_BLOCK_SIZE       (16 * MiB)
+#define READ_CACHE_MAX_READAHEAD        (64 * MiB)
+
+/* Largest read of uncached blocks issued to the file child at once */
+#define READ_CACHE_MAX_FETCH            (4 * MiB)
+
+typedef struct ReadCacheBlock {
+    int64_t index;
+    uint8_t *data;
+    QTAILQ_ENTRY(ReadCacheBlock) next;
+} ReadCacheBlock;
+
+/* A read whose result is going to be added to the cache */
+typedef struct ReadCacheInflight {
+    int64_t offset;
+    int64_t bytes;
+    bool stale;
+    QLIST_ENTRY(ReadCacheInflight) next;
+} ReadCacheInflight;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *disk;
+
+    int64_t block_size;
+    int64_t ram_blocks_max;
+    int64_t readahead;
+    ReadCacheWritePolicy write_policy;
+
+    /* RAM tier, most recently used block first */
+    GHashTable *ram;
+    QTAILQ_HEAD(, ReadCacheBlock) lru;
+
+    /* Disk tier */
+    unsigned long *disk_valid;
+    int64_t disk_blocks;
+    CoMutex disk_lock;
+
+    QLIST_HEAD(, ReadCacheInflight) inflight;
+
+    /* Sequential stream detection */
+    int64_t last_end;
+    int64_t readahead_end;
+    bool readahead_running;
+
+    uint64_t ram_hits;
+    uint64_t disk_hits;
+    uint64_t misses;
+    uint64_t readahead_blocks;
+} BDRVReadCacheState;
+
+typedef struct ReadCacheStore {
+    BlockDriverState *bs;
+    ReadCacheInflight req;
+    int64_t first;
+    int64_t last;
+    void *buf;
+} ReadCacheStore;
+
+typedef struct ReadCacheReadahead {
+    BlockDriverState *bs;
+    int64_t offset;
+    int64_t bytes;
+} ReadCacheReadahead;
+
+static QemuOptsList read_cache_runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the cache",
+        },
+        {
+            .name = READ_CACHE_OPT_RAM_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of RAM used for cached data",
+        },
+        {
+            .name = READ_CACHE_OPT_WRITE_POLICY,
+            .type = QEMU_OPT_STRING,
+            .help = "What to do with cached data on writes "
+                    "(write-through, write-around)",
+        },
+        {
+            .name = READ_CACHE_OPT_READAHEAD,
+            .type = QEMU_OPT_SIZE,
+            .help = "Amount of data to read ahead of sequential reads",
+        },
+        { /* end of list */ }
+    },
+};
+
+static BdrvChildRole child_read_cache_disk;
+
+static void read_cache_disk_options(int *child_flags, QDict *child_options,
+                                    int parent_flags, QDict *parent_options)
+{
+    /* The cache is written to even if the filter is read-only */
+    qdict_set_default_str(child_options, BDRV_OPT_READ_ONLY, "off");
+    qdict_set_default_str(child_options, BDRV_OPT_AUTO_READ_ONLY, "off");
+    qdict_set_default_str(child_options, BDRV_OPT_CACHE_NO_FLUSH, "on");
+
+    child_file.inherit_options(child_flags, child_options,
+                               parent_flags, parent_options);
+}
+
+static bool read_cache_disk_valid(BDRVReadCacheState *s, int64_t index)
+{
+    return s->disk_valid && index < s->disk_blocks &&
+           test_bit(index, s->disk_valid);
+}
+
+static bool read_cache_disk_writable(BDRVReadCacheState *s)
+{
+    return s->disk && (s->disk->perm & BLK_PERM_WRITE);
+}
+
+static bool read_cache_is_cached(BDRVReadCacheState *s, int64_t index)
+{
+    return g_hash_table_contains(s->ram, &index) ||
+           read_cache_disk_valid(s, index);
+}
+
+static void read_cache_inflight_begin(BDRVReadCacheState *s,
+                                      ReadCacheInflight *req,
+                                      int64_t offset, int64_t bytes)
+{
+    *req = (ReadCacheInflight) {
+        .offset = offset,
+        .bytes  = bytes,
+    };
+    QLIST_INSERT_HEAD(&s->inflight, req, next);
+}
+
+static void read_cache_inflight_end(ReadCacheInflight *req)
+{
+    QLIST_REMOVE(req, next);
+}
+
+static void read_cache_mark_stale(BDRVReadCacheState *s,
+                                  int64_t offset, int64_t bytes)
+{
+    ReadCacheInflight *req;
+
+    QLIST_FOREACH(req, &s->inflight, next) {
+        if (offset < req->offset + req->bytes &&
+            req->offset < offset + bytes)
+        {
+            req->stale = true;
+        }
+    }
+}
+
+static void read_cache_ram_touch(BDRVReadCacheState *s, ReadCacheBlock *blk)
+{
+    QTAILQ_REMOVE(&s->lru, blk, next);
+    QTAILQ_INSERT_HEAD(&s->lru, blk, next);
+}
+
+static void read_cache_ram_remove(BDRVReadCacheState *s, ReadCacheBlock *blk)
+{
+    QTAILQ_REMOVE(&s->lru, blk, next);
+    g_hash_table_remove(s->ram, &blk->index);
+    g_free(blk->data);
+    g_free(blk);
+}
+
+/*
+ * Return the RAM block for @index, creating it and evicting the least
+ * recently used block if needed.  The content of a new block is undefined.
+ */
+static ReadCacheBlock *read_cache_ram_get(BDRVReadCacheState *s,
+                                          int64_t index)
+{
+    ReadCacheBlock *blk = g_hash_table_lookup(s->ram, &index);
+
+    if (blk) {
+        read_cache_ram_touch(s, blk);
+        return blk;
+    }
+
+    if (g_hash_table_size(s->ram) >= s->ram_blocks_max) {
+        blk = QTAILQ_LAST(&s->lru);
+        QTAILQ_REMOVE(&s->lru, blk, next);
+        g_hash_table_remove(s->ram, &blk->index);
+    } else {
+        blk = g_new(ReadCacheBlock, 1);
+        blk->data = g_malloc(s->block_size);
+    }
+
+    blk->index = index;
+    g_hash_table_insert(s->ram, &blk->index, blk);
+    QTAILQ_INSERT_HEAD(&s->lru, blk, next);
+
+    return blk;
+}
+
+static void read_cache_invalidate_disk(BDRVReadCacheState *s,
+                                       int64_t first, int64_t last)
+{
+    if (s->disk_valid && first < s->disk_blocks) {
+        bitmap_clear(s->disk_valid, first,
+                     MIN(last + 1, s->disk_blocks) - first);
+    }
+}
+
+static void read_cache_invalidate(BDRVReadCacheState *s,
+                                  int64_t offset, int64_t bytes)
+{
+    int64_t first = offset / s->block_size;
+    int64_t last = (offset + bytes - 1) / s->block_size;
+    ReadCacheBlock *blk, *next_blk;
+
+    if (bytes <= 0) {
+        return;
+    }
+
+    if (last - first + 1 > g_hash_table_size(s->ram)) {
+        QTAILQ_FOREACH_SAFE(blk, &s->lru, next, next_blk) {
+            if (blk->index >= first && blk->index <= last) {
+                read_cache_ram_remove(s, blk);
+            }
+        }
+    } else {
+        int64_t i;
+
+        for (i = first; i <= last; i++) {
+            blk = g_hash_table_lookup(s->ram, &i);
+            if (blk) {
+                read_cache_ram_remove(s, blk);
+            }
+        }
+    }
+
+    read_cache_invalidate_disk(s, first, last);
+}
+
+static void read_cache_invalidate_all(BDRVReadCacheState *s)
+{
+    ReadCacheBlock *blk, *next_blk;
+
+    read_cache_mark_stale(s, 0, INT64_MAX);
+
+    QTAILQ_FOREACH_SAFE(blk, &s->lru, next, next_blk) {
+        read_cache_ram_remove(s, blk);
+    }
+    if (s->disk_valid) {
+        bitmap_zero(s->disk_valid, s->disk_blocks);
+    }
+}
+
+static void coroutine_fn read_cache_store_entry(void *opaque)
+{
+    ReadCacheStore *st = opaque;
+    BlockDriverState *bs = st->bs;
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    /*
+     * Stores must reach the disk in the order in which they were issued,
+     * otherwise stale data could overwrite a block that is marked as valid.
+     */
+    qemu_co_mutex_lock(&s->disk_lock);
+    ret = bdrv_co_pwrite(s->disk, st->req.offset, st->req.bytes, st->buf, 0);
+    qemu_co_mutex_unlock(&s->disk_lock);
+
+    if (ret >= 0 && !st->req.stale) {
+        bitmap_set(s->disk_valid, st->first, st->last - st->first + 1);
+    }
+
+    read_cache_inflight_end(&st->req);
+    qemu_vfree(st->buf);
+    g_free(st);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Write [@offset, @offset + @bytes) to the disk tier in the background and
+ * mark the blocks @first to @last as valid afterwards.  Takes ownership of
+ * @buf.
+ */
+static void read_cache_store(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes, void *buf,
+                             int64_t first, int64_t last)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheStore *st;
+    Coroutine *co;
+
+    last = MIN(last, s->disk_blocks - 1);
+    if (!read_cache_disk_writable(s) || first > last) {
+        qemu_vfree(buf);
+        return;
+    }
+    bytes = MIN(bytes, s->disk_blocks * s->block_size - offset);
+
+    st = g_new(ReadCacheStore, 1);
+    *st = (ReadCacheStore) {
+        .bs     = bs,
+        .first  = first,
+        .last   = last,
+        .buf    = buf,
+    };
+    read_cache_inflight_begin(s, &st->req, offset, bytes);
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(read_cache_store_entry, st);
+    bdrv_coroutine_enter(bs, co);
+}
+
+/*
+ * Read the block-aligned range [@offset, @offset + @bytes) from the file
+ * child into @buf and add it to the cache.
+ */
+static int coroutine_fn read_cache_fetch(BlockDriverState *bs,
+                                         int64_t offset, int64_t bytes,
+                                         uint8_t *buf, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t first = offset / s->block_size;
+    int64_t last = (offset + bytes) / s->block_size - 1;
+    ReadCacheInflight req;
+    int64_t i;
+    int ret;
+
+    read_cache_inflight_begin(s, &req, offset, bytes);
+    ret = bdrv_co_pread(bs->file, offset, bytes, buf, flags);
+    read_cache_inflight_end(&req);
+
+    if (ret < 0 || req.stale) {
+        return ret;
+    }
+
+    for (i = first; i <= last; i++) {
+        ReadCacheBlock *blk = read_cache_ram_get(s, i);
+        memcpy(blk->data, buf + (i - first) * s->block_size, s->block_size);
+    }
+
+    if (read_cache_disk_writable(s) && first < s->disk_blocks) {
+        void *copy = qemu_try_blockalign(s->disk->bs, bytes);
+        if (copy) {
+            memcpy(copy, buf, bytes);
+            read_cache_store(bs, offset, bytes, copy, first, last);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the part of block @index that lies in [@offset, @offset + @bytes)
+ * from the disk tier to @qiov at @qiov_offset, and promote the block to RAM.
+ */
+static int coroutine_fn read_cache_read_disk(BlockDriverState *bs,
+                                             int64_t index,
+                                             int64_t offset, int64_t bytes,
+                                             QEMUIOVector *qiov,
+                                             size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t block_start = index * s->block_size;
+    ReadCacheInflight req;
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_try_blockalign(s->disk->bs, s->block_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    read_cache_inflight_begin(s, &req, block_start, s->block_size);
+    ret = bdrv_co_pread(s->disk, block_start, s->block_size, buf, 0);
+    read_cache_inflight_end(&req);
+
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - block_start),
+                            bytes);
+        if (!req.stale) {
+            ReadCacheBlock *blk = read_cache_ram_get(s, index);
+            memcpy(blk->data, buf, s->block_size);
+        }
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void coroutine_fn read_cache_readahead_entry(void *opaque)
+{
+    ReadCacheReadahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t first = ra->offset / s->block_size;
+    int64_t last = (ra->offset + ra->bytes) / s->block_size - 1;
+
+    while (first <= last && read_cache_is_cached(s, first)) {
+        first++;
+    }
+    while (last >= first && read_cache_is_cached(s, last)) {
+        last--;
+    }
+
+    if (first <= last) {
+        int64_t bytes = (last - first + 1) * s->block_size;
+        uint8_t *buf = qemu_try_blockalign(bs->file->bs, bytes);
+
+        if (buf) {
+            if (read_cache_fetch(bs, first * s->block_size, bytes,
+                                 buf, 0) >= 0)
+            {
+                s->readahead_blocks += last - first + 1;
+            }
+            qemu_vfree(buf);
+        }
+    }
+
+    s->readahead_running = false;
+    g_free(ra);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Start reading ahead if [@offset, @offset + @bytes) continues the previous
+ * read.  A new readahead is only issued once the stream is less than half
+ * the readahead window away from the end of the previous one.
+ */
+static void read_cache_readahead(BlockDriverState *bs,
+                                 int64_t offset, int64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t end = offset + bytes;
+    int64_t length = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int64_t start, ra_end;
+    ReadCacheReadahead *ra;
+    Coroutine *co;
+    bool sequential = offset == s->last_end;
+
+    s->last_end = end;
+    if (!s->readahead || !sequential || s->readahead_running ||
+        end + s->readahead / 2 < s->readahead_end)
+    {
+        return;
+    }
+
+    start = QEMU_ALIGN_DOWN(MAX(end, s->readahead_end), s->block_size);
+    ra_end = QEMU_ALIGN_UP(MIN(end + s->readahead, length), s->block_size);
+    if (start >= ra_end) {
+        return;
+    }
+    s->readahead_end = ra_end;
+
+    ra = g_new(ReadCacheReadahead, 1);
+    *ra = (ReadCacheReadahead) {
+        .bs     = bs,
+        .offset = start,
+        .bytes  = ra_end - start,
+    };
+
+    s->readahead_running = true;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(read_cache_readahead_entry, ra);
+    bdrv_coroutine_enter(bs, co);
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t ram_size;
+    int64_t length;
+    int ret;
+
+    opts = qemu_opts_create(&read_cache_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->block_size = qemu_opt_get_size(opts, READ_CACHE_OPT_BLOCK_SIZE,
+                                      READ_CACHE_DEFAULT_BLOCK_SIZE);
+    if (s->block_size < BDRV_SECTOR_SIZE ||
+        s->block_size > READ_CACHE_MAX_BLOCK_SIZE ||
+        !is_power_of_2(s->block_size))
+    {
+        error_setg(errp, "block-size must be a power of two between 512 "
+                   "bytes and 16 MiB");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ram_size = qemu_opt_get_size(opts, READ_CACHE_OPT_RAM_SIZE,
+                                 READ_CACHE_DEFAULT_RAM_SIZE);
+    if (ram_size < s->block_size) {
+        error_setg(errp, "ram-size must be at least block-size");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->ram_blocks_max = ram_size / s->block_size;
+
+    s->readahead = qemu_opt_get_size(opts, READ_CACHE_OPT_READAHEAD, 0);
+    if (s->readahead > READ_CACHE_MAX_READAHEAD) {
+        error_setg(errp, "readahead must not exceed 64 MiB");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->write_policy =
+        qapi_enum_parse(&ReadCacheWritePolicy_lookup,
+                        qemu_opt_get(opts, READ_CACHE_OPT_WRITE_POLICY),
+                        READ_CACHE_WRITE_POLICY_WRITE_THROUGH, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               errp);
+    if (!bs->file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->disk = bdrv_open_child(NULL, options, "disk", bs,
+                              &child_read_cache_disk, true, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    s->ram = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    QLIST_INIT(&s->inflight);
+    qemu_co_mutex_init(&s->disk_lock);
+    s->last_end = -1;
+
+    if (s->disk) {
+        length = bdrv_getlength(bs->file->bs);
+        if (length < 0) {
+            error_setg_errno(errp, -length, "Could not get the image size");
+            ret = length;
+            goto fail;
+        }
+        s->disk_blocks = DIV_ROUND_UP(length, s->block_size);
+
+        length = bdrv_getlength(s->disk->bs);
+        if (length < 0) {
+            error_setg_errno(errp, -length,
+                             "Could not get the size of the cache disk");
+            ret = length;
+            goto fail;
+        }
+        if (length < s->disk_blocks * s->block_size) {
+            ret = bdrv_truncate(s->disk, s->disk_blocks * s->block_size,
+                                false, PREALLOC_MODE_OFF, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+        s->disk_valid = bitmap_new(s->disk_blocks);
+    }
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        if (s->ram) {
+            g_hash_table_destroy(s->ram);
+            s->ram = NULL;
+        }
+        bdrv_unref_child(bs, s->disk);
+        s->disk = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    read_cache_invalidate_all(s);
+    g_hash_table_destroy(s->ram);
+    g_free(s->disk_valid);
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  const BdrvChildRole *role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    if (role != &child_read_cache_disk) {
+        bdrv_filter_default_perms(bs, c, role, reopen_queue, perm, shared,
+                                  nperm, nshared);
+        /* Writes that bypass the cache would leave stale data in it */
+        *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_WRITE_UNCHANGED |
+                      BLK_PERM_RESIZE);
+        return;
+    }
+
+    /* Nobody else may write to the cache disk behind our back */
+    *nperm = BLK_PERM_CONSISTENT_READ;
+    *nshared = BLK_PERM_ALL & ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+
+    /* We must not request write permissions for an inactive node, the child
+     * cannot provide it. */
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        *nperm |= BLK_PERM_WRITE | BLK_PERM_RESIZE;
+    }
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int coroutine_fn read_cache_co_preadv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t pos = offset;
+    int64_t end = offset + bytes;
+    int64_t max_fetch = MAX(READ_CACHE_MAX_FETCH / s->block_size, 1);
+    int ret;
+
+    while (pos < end) {
+        int64_t index = pos / s->block_size;
+        int64_t block_start = index * s->block_size;
+        int64_t n = MIN(end, block_start + s->block_size) - pos;
+        ReadCacheBlock *blk = g_hash_table_lookup(s->ram, &index);
+
+        if (blk) {
+            qemu_iovec_from_buf(qiov, pos - offset,
+                                blk->data + (pos - block_start), n);
+            read_cache_ram_touch(s, blk);
+            s->ram_hits++;
+        } else if (read_cache_disk_valid(s, index)) {
+            ret = read_cache_read_disk(bs, index, pos, n, qiov, pos - offset);
+            if (ret < 0) {
+                /* Drop the block and read it from the file child instead */
+                clear_bit(index, s->disk_valid);
+                continue;
+            }
+            s->disk_hits++;
+        } else {
+            int64_t last = index;
+            int64_t fetch_bytes;
+            uint8_t *buf;
+
+            while ((last + 1) * s->block_size < end &&
+                   last + 1 - index < max_fetch &&
+                   !read_cache_is_cached(s, last + 1))
+            {
+                last++;
+            }
+
+            fetch_bytes = (last - index + 1) * s->block_size;
+            buf = qemu_try_blockalign(bs->file->bs, fetch_bytes);
+            if (!buf) {
+                return -ENOMEM;
+            }
+
+            ret = read_cache_fetch(bs, block_start, fetch_bytes, buf, flags);
+            if (ret < 0) {
+                qemu_vfree(buf);
+                return ret;
+            }
+
+            n = MIN(end, block_start + fetch_bytes) - pos;
+            qemu_iovec_from_buf(qiov, pos - offset,
+                                buf + (pos - block_start), n);
+            qemu_vfree(buf);
+            s->misses += last - index + 1;
+        }
+
+        pos += n;
+    }
+
+    read_cache_readahead(bs, offset, bytes);
+    return 0;
+}
+
+/*
+ * Copy the data of a completed write into the cache: blocks that are cached
+ * in RAM are updated, blocks that are fully covered by the write are added.
+ * On disk, blocks that were valid before or are fully covered are rewritten.
+ */
+static void read_cache_write_through(BlockDriverState *bs,
+                                     int64_t offset, int64_t bytes,
+                                     QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t end = offset + bytes;
+    int64_t first = offset / s->block_size;
+    int64_t last = (end - 1) / s->block_size;
+    int64_t disk_first = first;
+    int64_t disk_last = last;
+    int64_t i;
+
+    for (i = first; i <= last; i++) {
+        int64_t block_start = i * s->block_size;
+        int64_t from = MAX(offset, block_start);
+        int64_t to = MIN(end, block_start + s->block_size);
+        ReadCacheBlock *blk = g_hash_table_lookup(s->ram, &i);
+
+        if (blk) {
+            read_cache_ram_touch(s, blk);
+        } else if (to - from == s->block_size) {
+            blk = read_cache_ram_get(s, i);
+        } else {
+            continue;
+        }
+        qemu_iovec_to_buf(qiov, from - offset, blk->data + (from - block_start),
+                          to - from);
+    }
+
+    if (!QEMU_IS_ALIGNED(offset, s->block_size) &&
+        !read_cache_disk_valid(s, first))
+    {
+        disk_first++;
+    }
+    if (!QEMU_IS_ALIGNED(end, s->block_size) &&
+        !read_cache_disk_valid(s, last))
+    {
+        disk_last--;
+    }
+    read_cache_invalidate_disk(s, first, last);
+    disk_last = MIN(disk_last, s->disk_blocks - 1);
+
+    if (disk_first <= disk_last && read_cache_disk_writable(s)) {
+        int64_t from = MAX(offset, disk_first * s->block_size);
+        int64_t to = MIN(end, (disk_last + 1) * s->block_size);
+        void *buf = qemu_try_blockalign(s->disk->bs, to - from);
+
+        if (buf) {
+            qemu_iovec_to_buf(qiov, from - offset, buf, to - from);
+            read_cache_store(bs, from, to - from, buf, disk_first, disk_last);
+        }
+    }
+}
+
+static int coroutine_fn read_cache_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_mark_stale(s, offset, bytes);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    read_cache_mark_stale(s, offset, bytes);
+
+    if (ret >= 0 && s->write_policy == READ_CACHE_WRITE_POLICY_WRITE_THROUGH) {
+        read_cache_write_through(bs, offset, bytes, qiov);
+    } else {
+        read_cache_invalidate(s, offset, bytes);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_mark_stale(s, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_mark_stale(s, offset, bytes);
+    read_cache_invalidate(s, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_mark_stale(s, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_mark_stale(s, offset, bytes);
+    read_cache_invalidate(s, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_truncate(BlockDriverState *bs,
+                                               int64_t offset, bool exact,
+                                               PreallocMode prealloc,
+                                               Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, errp);
+    read_cache_invalidate_all(s);
+    s->last_end = -1;
+    s->readahead_end = 0;
+
+    if (ret >= 0 && s->disk) {
+        int64_t disk_blocks = DIV_ROUND_UP(offset, s->block_size);
+        int64_t length = bdrv_getlength(s->disk->bs);
+
+        /* If the cache disk cannot grow, the new area is only kept in RAM */
+        if (length < disk_blocks * s->block_size &&
+            (length < 0 ||
+             bdrv_co_truncate(s->disk, disk_blocks * s->block_size, false,
+                              PREALLOC_MODE_OFF, NULL) < 0))
+        {
+            disk_blocks = MIN(disk_blocks, s->disk_blocks);
+        }
+
+        g_free(s->disk_valid);
+        s->disk_blocks = disk_blocks;
+        s->disk_valid = bitmap_new(disk_blocks);
+    }
+
+    return ret;
+}
+
+static void coroutine_fn read_cache_co_invalidate_cache(BlockDriverState *bs,
+                                                        Error **errp)
+{
+    /* The image may have been changed by somebody else, e.g. after
+     * migration, so nothing that we cached can be trusted any more */
+    read_cache_invalidate_all(bs->opaque);
+}
+
+static BlockStatsSpecific *read_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_READ_CACHE;
+    stats->u.read_cache = (BlockStatsSpecificReadCache) {
+        .ram_hits           = s->ram_hits,
+        .disk_hits          = s->disk_hits,
+        .misses             = s->misses,
+        .readahead_blocks   = s->readahead_blocks,
+        .ram_blocks         = g_hash_table_size(s->ram),
+        .disk_blocks        = s->disk_valid ?
+                              bitmap_count_one(s->disk_valid,
+                                               s->disk_blocks) : 0,
+    };
+
+    return stats;
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_reopen_prepare                = read_cache_reopen_prepare,
+    .bdrv_child_perm                    = read_cache_child_perm,
+
+    .bdrv_getlength                     = read_cache_getlength,
+    .bdrv_co_truncate                   = read_cache_co_truncate,
+
+    .bdrv_co_preadv                     = read_cache_co_preadv,
+    .bdrv_co_pwritev                    = read_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+    .bdrv_co_invalidate_cache           = read_cache_co_invalidate_cache,
+    .bdrv_get_specific_stats            = read_cache_get_specific_stats,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    /* Like child_file, but always writable */
+    child_read_cache_disk = child_file;
+    child_read_cache_disk.inherit_options = read_cache_disk_options;
+
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
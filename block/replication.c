@@ -329,6 +329,7 @@ static void secondary_do_checkpoint(BDRVReplicationState *s, Error **errp)
     }
 
     ret = s->active_disk->bs->drv->bdrv_make_empty(s->active_disk->bs);
+    bdrv_bsc_invalidate(s->active_disk->bs);
     if (ret < 0) {
         error_setg(errp, "Cannot make active disk empty");
         return;
@@ -341,6 +342,7 @@ static void secondary_do_checkpoint(BDRVReplicationState *s, Error **errp)
     }
 
     ret = s->hidden_disk->bs->drv->bdrv_make_empty(s->hidden_disk->bs);
+    bdrv_bsc_invalidate(s->hidden_disk->bs);
     if (ret < 0) {
         error_setg(errp, "Cannot make hidden disk empty");
         return;
@@ -197,6 +197,8 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
         return -EBUSY;
     }
 
+    bdrv_bsc_invalidate(bs);
+
     if (drv->bdrv_snapshot_goto) {
         ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
         if (ret < 0) {
@@ -358,6 +360,7 @@ int bdrv_snapshot_load_tmp(BlockDriverState *bs,
         return -EINVAL;
     }
     if (drv->bdrv_snapshot_load_tmp) {
+        bdrv_bsc_invalidate(bs);
         return drv->bdrv_snapshot_load_tmp(bs, snapshot_id, name, errp);
     }
     error_setg(errp, "Block format '%s' used by device '%s' "
@@ -2962,6 +2962,7 @@ static int do_commit(BDRVVVFATState* s)
 
     if (s->qcow->bs->drv && s->qcow->bs->drv->bdrv_make_empty) {
         s->qcow->bs->drv->bdrv_make_empty(s->qcow->bs);
+        bdrv_bsc_invalidate(s->qcow->bs);
     }
 
     memset(s->used_clusters, 0, sector2cluster(s, s->sector_count));
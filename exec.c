@@ -2576,6 +2576,59 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
 }
 #endif /* !_WIN32 */
 
+/*
+ * Back a shared, file backed block with 'fd' instead of its own file,
+ * typically the same memory as another process had in this block.  The
+ * host address does not change, so existing users of the mapping (e.g.
+ * KVM memory slots) keep working.  Takes ownership of 'fd'.
+ */
+int qemu_ram_remap_fd(RAMBlock *block, int fd, Error **errp)
+{
+#ifndef _WIN32
+    struct stat st;
+    void *area;
+
+    if (block->fd < 0 || !(block->flags & RAM_SHARED) ||
+        block->flags & RAM_PREALLOC) {
+        error_setg(errp, "RAM block %s is not backed by a shared file",
+                   block->idstr);
+        goto err;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Cannot stat memory of RAM block %s",
+                         block->idstr);
+        goto err;
+    }
+    if (st.st_size < block->max_length) {
+        error_setg(errp, "Memory passed for RAM block %s is too small "
+                   "(%" PRId64 " < " RAM_ADDR_FMT ")", block->idstr,
+                   (int64_t)st.st_size, block->max_length);
+        goto err;
+    }
+
+    area = mmap(block->host, block->max_length, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+    if (area != block->host) {
+        error_setg_errno(errp, errno, "Cannot map memory of RAM block %s",
+                         block->idstr);
+        goto err;
+    }
+    memory_try_enable_merging(area, block->max_length);
+    qemu_ram_setup_dump(area, block->max_length);
+
+    close(block->fd);
+    block->fd = fd;
+    return 0;
+
+err:
+    close(fd);
+    return -EINVAL;
+#else
+    error_setg(errp, "Passing RAM by file descriptor is not supported");
+    return -ENOTSUP;
+#endif
+}
+
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
  * This should not be used for general purpose DMA.  Use address_space_map
  * or address_space_rw instead. For local memory (e.g. video ram) that the
@@ -615,6 +615,21 @@ STEXI
 @item info migrate_cache_size
 @findex info migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "migrate_devices",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show device state save and load statistics",
+        .cmd        = hmp_info_migrate_devices,
+    },
+
+STEXI
+@item info migrate_devices
+@findex info migrate_devices
+Show the time spent and bytes used saving and loading each device state
+in the last migration.
 ETEXI
 
     {
@@ -150,6 +150,9 @@ struct AioContext {
      * locking.
      */
     struct LuringState *linux_io_uring;
+
+    /* Same, for a ring whose submission queue is polled by the kernel */
+    struct LuringState *linux_io_uring_sqpoll;
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -415,11 +418,16 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
-/* Setup the LuringState bound to this AioContext */
-struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+/*
+ * Setup the LuringState bound to this AioContext.  There is a separate
+ * LuringState for rings with a kernel thread polling the submission queue
+ * (@sqpoll).
+ */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, bool sqpoll,
+                                             Error **errp);
 
 /* Return the LuringState bound to this AioContext */
-struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx, bool sqpoll);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
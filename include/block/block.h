@@ -30,6 +30,12 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if compressed writes may be issued in any order and in parallel.
+     * Otherwise they must be sequential, e.g. because the format lays out
+     * compressed data as a stream.
+     */
+    bool unordered_compressed_writes;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
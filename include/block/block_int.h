@@ -32,6 +32,7 @@
 #include "qemu/stats64.h"
 #include "qemu/timer.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/throttle.h"
 
@@ -57,6 +58,8 @@
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
+#define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -78,12 +81,32 @@ typedef struct BdrvTrackedRequest {
     uint64_t overlap_bytes;
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
+    IntervalTreeNode node;              /* in bs->tracked_tree */
+    IntervalTreeNode serialising_node;  /* in bs->serialising_tree */
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
 
+typedef struct BdrvBlockStatusCacheEntry BdrvBlockStatusCacheEntry;
+
+/*
+ * Driver block-status results that are known to be still valid, as
+ * non-overlapping extents.  Only accessed from the node's AioContext.
+ */
+typedef struct BdrvBlockStatusCache {
+    IntervalTreeRoot extents;
+    QTAILQ_HEAD(, BdrvBlockStatusCacheEntry) entries; /* oldest first */
+    int nb_entries;
+
+    /* Incremented on every invalidation */
+    unsigned int gen;
+
+    Stat64 hits;
+    Stat64 misses;
+} BdrvBlockStatusCache;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -920,9 +943,14 @@ struct BlockDriverState {
 
     unsigned int write_gen;               /* Current data generation */
 
+    BdrvBlockStatusCache bsc;
+
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    /* Overlap ranges of all tracked requests, and of the serialising ones */
+    IntervalTreeRoot tracked_tree;
+    IntervalTreeRoot serialising_tree;
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
@@ -1297,6 +1325,10 @@ bool blk_dev_is_medium_locked(BlockBackend *blk);
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t offset, int64_t bytes);
 
+void bdrv_bsc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes);
+void bdrv_bsc_invalidate(BlockDriverState *bs);
+
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out);
 void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup);
 bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
@@ -82,6 +82,9 @@ typedef uint64_t target_ulong;
 /* use a fully associative victim tlb of 8 entries */
 #define CPU_VTLB_SIZE 8
 
+/* track up to 8 large pages per mmu_idx individually */
+#define CPU_TLB_LARGE_PAGES 8
+
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
 #else
@@ -148,15 +151,33 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/*
+ * A single large page allocated into the tlb.  A page is within it if
+ * (page & mask) == addr.  Unused slots have both fields set to -1,
+ * which can never match a page-aligned address.
+ */
+typedef struct CPUTLBLargePage {
+    target_ulong addr;
+    target_ulong mask;
+} CPUTLBLargePage;
+
 /*
  * Data elements that are per MMU mode, minus the bits accessed by
  * the TCG fast path.
  */
 typedef struct CPUTLBDesc {
     /*
-     * Describe a region covering all of the large pages allocated
-     * into the tlb.  When any page within this region is flushed,
-     * we must flush the entire tlb.  The region is matched if
+     * The most recently allocated large pages.  When a page within one
+     * of these is flushed, only the entries belonging to that large page
+     * are evicted from the tlb.
+     */
+    CPUTLBLargePage large_pages[CPU_TLB_LARGE_PAGES];
+    /* The next index to replace in large_pages.  */
+    size_t lp_index;
+    /*
+     * Describe a region covering all of the large pages that have been
+     * evicted from large_pages.  When any page within this region is
+     * flushed, we must flush the entire tlb.  The region is matched if
      * (addr & large_page_mask) == large_page_addr.
      */
     target_ulong large_page_addr;
@@ -206,6 +227,13 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    /*
+     * Page flushes that hit a large page: lp_full_flush_count counts
+     * those that required flushing the whole mmu_idx, lp_part_flush_count
+     * those that only evicted the entries of one tracked large page.
+     */
+    size_t lp_full_flush_count;
+    size_t lp_part_flush_count;
 } CPUTLBCommon;
 
 /*
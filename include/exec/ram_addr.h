@@ -439,8 +439,47 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_CODE);
 }
 
+/**
+ * ramblock_dirty_summary_set: note that a word of bmap may be dirty
+ *
+ * @rb: the RAMBlock whose migration bitmap was updated
+ * @word: index of the bmap word that has bits set
+ *
+ * Safe to call concurrently for different words of the same RAMBlock.
+ */
+static inline void ramblock_dirty_summary_set(RAMBlock *rb,
+                                              unsigned long word)
+{
+    if (!test_bit(word, rb->bmap_summary)) {
+        set_bit_atomic(word, rb->bmap_summary);
+    }
+    if (!test_bit(BIT_WORD(word), rb->bmap_summary_top)) {
+        set_bit_atomic(BIT_WORD(word), rb->bmap_summary_top);
+    }
+}
+
+/**
+ * ramblock_dirty_summary_set_all: mark all of bmap as possibly dirty
+ *
+ * To be used after bmap was rewritten as a whole.
+ *
+ * @rb: the RAMBlock whose migration bitmap was updated
+ * @pages: number of pages covered by bmap
+ */
+static inline void ramblock_dirty_summary_set_all(RAMBlock *rb,
+                                                  unsigned long pages)
+{
+    unsigned long words = BITS_TO_LONGS(pages);
 
-/* Called with RCU critical section */
+    bitmap_set(rb->bmap_summary, 0, words);
+    bitmap_set(rb->bmap_summary_top, 0, BITS_TO_LONGS(words));
+}
+
+/*
+ * Called with RCU critical section.  Different threads may sync
+ * disjoint ranges of the same RAMBlock, as long as the ranges are
+ * aligned to BITS_PER_LONG pages.
+ */
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                                                ram_addr_t start,
@@ -476,6 +515,7 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 dest[k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
+                ramblock_dirty_summary_set(rb, k);
             }
 
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
@@ -509,6 +549,7 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
+                ramblock_dirty_summary_set(rb, BIT_WORD(k));
             }
         }
     }
@@ -41,6 +41,15 @@ struct RAMBlock {
     size_t page_size;
     /* dirty bitmap used during migration */
     unsigned long *bmap;
+    /*
+     * Summaries of bmap used to skip clean regions quickly: bit N of
+     * bmap_summary is set when word N of bmap may be non-zero, and bit
+     * N of bmap_summary_top when word N of bmap_summary may be non-zero.
+     * Bits are set together with bmap and only cleared by the dirty
+     * page search, so they are always a superset of the real state.
+     */
+    unsigned long *bmap_summary;
+    unsigned long *bmap_summary_top;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
 
@@ -59,6 +68,15 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * With the mapped-ram cap: bitmap of the pages present in the
+     * migration file, and where the bitmap and the pages of this block
+     * are stored in the file.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 #endif
 #endif
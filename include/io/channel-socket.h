@@ -48,6 +48,14 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* sendmsg() calls made with MSG_ZEROCOPY, and those completed */
+    uint32_t zero_copy_queued;
+    uint32_t zero_copy_sent;
+    /* bytes of each call not completed yet, from zero_copy_base on */
+    GArray *zero_copy_lens;
+    uint32_t zero_copy_base;
+    /* bytes the kernel copied anyway since the last flush */
+    uint64_t zero_copy_copied;
 };
 
 
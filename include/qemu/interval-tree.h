@@ -0,0 +1,88 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * An intrusive tree of half-open intervals [start, end), supporting
+ * O(log n) insertion, removal and lookup of intervals that overlap a
+ * given range.  Several nodes may describe the same interval.
+ *
+ * The tree is a treap augmented with the maximum end offset of each
+ * subtree.  A zero-initialized IntervalTreeRoot is an empty tree.
+ *
+ * No locking is done; callers are responsible for serialising accesses.
+ */
+
+typedef struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t end;
+
+    /* private */
+    uint64_t subtree_end;
+    uint32_t priority;
+    struct IntervalTreeNode *left;
+    struct IntervalTreeNode *right;
+} IntervalTreeNode;
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+    uint32_t seed;
+} IntervalTreeRoot;
+
+/*
+ * Called for each node overlapping the range passed to interval_tree_find().
+ * Return true to stop the search at this node.
+ */
+typedef bool (*IntervalTreeFunc)(IntervalTreeNode *node, void *opaque);
+
+/**
+ * interval_tree_insert:
+ * @root: the tree
+ * @node: the node to insert, not part of any tree
+ * @start: first offset of the interval
+ * @end: offset after the last one of the interval
+ *
+ * Insert @node into @root, describing [@start, @end).
+ */
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node,
+                          uint64_t start, uint64_t end);
+
+/**
+ * interval_tree_remove:
+ * @root: the tree
+ * @node: a node that was inserted into @root
+ *
+ * Remove @node from @root.
+ */
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_find:
+ * @root: the tree
+ * @start: first offset of the range
+ * @end: offset after the last one of the range
+ * @func: the callback
+ * @opaque: passed to @func
+ *
+ * Call @func in order of increasing start offset for the nodes that overlap
+ * [@start, @end), i.e. node->start < @end and @start < node->end, until it
+ * returns true.
+ *
+ * Returns: the node for which @func returned true, or NULL.
+ */
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t end,
+                                     IntervalTreeFunc func, void *opaque);
+
+static inline bool interval_tree_is_empty(IntervalTreeRoot *root)
+{
+    return !root->root;
+}
+
+#endif
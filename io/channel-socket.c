@@ -27,6 +27,15 @@
 #include "trace.h"
 #include "qapi/clone-visitor.h"
 
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+#include <sys/socket.h>
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define QEMU_MSG_ZEROCOPY
+#endif
+#endif
+
 #define SOCKET_MAX_FDS 16
 
 SocketAddress *
@@ -154,6 +163,20 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
+#ifdef QEMU_MSG_ZEROCOPY
+    {
+        int v = 1;
+
+        /* Only TCP sockets support it, ignore failures */
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) == 0) {
+            qio_channel_set_feature(QIO_CHANNEL(ioc),
+                                    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+            ioc->zero_copy_lens = g_array_new(FALSE, FALSE,
+                                              sizeof(uint32_t));
+        }
+    }
+#endif
+
     return 0;
 }
 
@@ -422,6 +445,10 @@ static void qio_channel_socket_finalize(Object *obj)
         closesocket(ioc->fd);
         ioc->fd = -1;
     }
+    if (ioc->zero_copy_lens) {
+        g_array_free(ioc->zero_copy_lens, TRUE);
+        ioc->zero_copy_lens = NULL;
+    }
 }
 
 
@@ -520,11 +547,102 @@ static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
     return ret;
 }
 
+#ifdef QEMU_MSG_ZEROCOPY
+/*
+ * Wait for the completion of all the sendmsg() calls made with
+ * MSG_ZEROCOPY.  The kernel reports them on the socket error queue as
+ * ranges of call sequence numbers, flagged when it had to copy the
+ * data after all.
+ */
+static int qio_channel_socket_reap_zero_copy(QIOChannelSocket *sioc,
+                                             Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
+    struct msghdr msg = { NULL, };
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    char control[CMSG_SPACE(sizeof(*serr))];
+    uint32_t seq, idx;
+    ssize_t ret;
+
+    while (sioc->zero_copy_sent != sioc->zero_copy_queued) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                qio_channel_wait(ioc, G_IO_ERR);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to read socket error queue");
+            return -1;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm ||
+            !((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+              (cm->cmsg_level == SOL_IPV6 &&
+               cm->cmsg_type == IPV6_RECVERR))) {
+            error_setg_errno(errp, EPROTOTYPE,
+                             "Unexpected message in socket error queue");
+            return -1;
+        }
+
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_errno || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            error_setg_errno(errp, serr->ee_errno,
+                             "Zero copy write to socket failed");
+            return -1;
+        }
+
+        /* Calls [ee_info, ee_data] are complete */
+        seq = serr->ee_info;
+        do {
+            idx = seq - sioc->zero_copy_base;
+            if (serr->ee_code == SO_EE_CODE_ZEROCOPY_COPIED &&
+                idx < sioc->zero_copy_lens->len) {
+                sioc->zero_copy_copied +=
+                    g_array_index(sioc->zero_copy_lens, uint32_t, idx);
+            }
+            sioc->zero_copy_sent++;
+        } while (seq++ != serr->ee_data);
+    }
+
+    g_array_set_size(sioc->zero_copy_lens, 0);
+    sioc->zero_copy_base = sioc->zero_copy_queued;
+
+    return 0;
+}
+
+static ssize_t qio_channel_socket_flush(QIOChannel *ioc,
+                                        Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    ssize_t copied;
+
+    if (qio_channel_socket_reap_zero_copy(sioc, errp) < 0) {
+        return -1;
+    }
+
+    copied = sioc->zero_copy_copied;
+    sioc->zero_copy_copied = 0;
+
+    return copied;
+}
+#endif
+
 static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
                                          const struct iovec *iov,
                                          size_t niov,
                                          int *fds,
                                          size_t nfds,
+                                         int flags,
                                          Error **errp)
 {
     QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
@@ -533,6 +651,19 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     char control[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)];
     size_t fdsize = sizeof(int) * nfds;
     struct cmsghdr *cmsg;
+    int sflags = 0;
+#ifdef QEMU_MSG_ZEROCOPY
+    bool reaped = false;
+#endif
+
+    if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+#ifdef QEMU_MSG_ZEROCOPY
+        sflags = MSG_ZEROCOPY;
+#else
+        /* qio_channel_writev_full() checked the feature */
+        g_assert_not_reached();
+#endif
+    }
 
     memset(control, 0, CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS));
 
@@ -558,7 +689,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     }
 
  retry:
-    ret = sendmsg(sioc->fd, &msg, 0);
+    ret = sendmsg(sioc->fd, &msg, sflags);
     if (ret <= 0) {
         if (errno == EAGAIN) {
             return QIO_CHANNEL_ERR_BLOCK;
@@ -566,10 +697,35 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
         if (errno == EINTR) {
             goto retry;
         }
+#ifdef QEMU_MSG_ZEROCOPY
+        if (errno == ENOBUFS && (sflags & MSG_ZEROCOPY)) {
+            /* Too much data pinned, wait for the pending writes once */
+            if (!reaped) {
+                if (qio_channel_socket_reap_zero_copy(sioc, errp) < 0) {
+                    return -1;
+                }
+                reaped = true;
+                goto retry;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to write to socket, the locked "
+                             "memory limit may be too low for zero copy");
+            return -1;
+        }
+#endif
         error_setg_errno(errp, errno,
                          "Unable to write to socket");
         return -1;
     }
+
+#ifdef QEMU_MSG_ZEROCOPY
+    if (sflags & MSG_ZEROCOPY) {
+        uint32_t len = ret;
+
+        g_array_append_val(sioc->zero_copy_lens, len);
+        sioc->zero_copy_queued++;
+    }
+#endif
     return ret;
 }
 #else /* WIN32 */
@@ -620,6 +776,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
                                          size_t niov,
                                          int *fds,
                                          size_t nfds,
+                                         int flags,
                                          Error **errp)
 {
     QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
@@ -786,6 +943,9 @@ static void qio_channel_socket_class_init(ObjectClass *klass,
     ioc_klass->io_set_delay = qio_channel_socket_set_delay;
     ioc_klass->io_create_watch = qio_channel_socket_create_watch;
     ioc_klass->io_set_aio_fd_handler = qio_channel_socket_set_aio_fd_handler;
+#ifdef QEMU_MSG_ZEROCOPY
+    ioc_klass->io_flush = qio_channel_socket_flush;
+#endif
 }
 
 static const TypeInfo qio_channel_socket_info = {
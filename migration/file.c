@@ -0,0 +1,113 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * Unlike fd: and exec:, the channel is known to be seekable, which is
+ * what the mapped-ram capability needs to write each page at a fixed
+ * offset of the file.  With mapped-ram the pages go through a second
+ * channel on the same file, which may bypass the page cache and which
+ * a lazy restore keeps reading from after the stream is closed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "qemu-file-channel.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+static QEMUFile *file_open_pages(const char *filename, int flags,
+                                 Error **errp)
+{
+    QIOChannelFile *fioc;
+    QEMUFile *f;
+
+    if (migrate_mapped_ram_direct_io()) {
+#ifdef O_DIRECT
+        flags |= O_DIRECT;
+#else
+        error_setg(errp, "Direct I/O is not supported on this host");
+        return NULL;
+#endif
+    }
+
+    fioc = qio_channel_file_new_path(filename, flags, 0, errp);
+    if (!fioc) {
+        return NULL;
+    }
+
+    if ((flags & O_ACCMODE) == O_RDONLY) {
+        qio_channel_set_name(QIO_CHANNEL(fioc),
+                             "migration-file-pages-incoming");
+        f = qemu_fopen_channel_input(QIO_CHANNEL(fioc));
+    } else {
+        qio_channel_set_name(QIO_CHANNEL(fioc),
+                             "migration-file-pages-outgoing");
+        f = qemu_fopen_channel_output(QIO_CHANNEL(fioc));
+    }
+    object_unref(OBJECT(fioc));
+    return f;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_outgoing(filename);
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    if (migrate_mapped_ram()) {
+        s->mapped_ram_file = file_open_pages(filename, O_WRONLY, errp);
+        if (!s->mapped_ram_file) {
+            object_unref(OBJECT(fioc));
+            return;
+        }
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL, NULL);
+    object_unref(OBJECT(fioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(filename);
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    if (migrate_mapped_ram()) {
+        mis->mapped_ram_file = file_open_pages(filename, O_RDONLY, errp);
+        if (!mis->mapped_ram_file) {
+            object_unref(OBJECT(fioc));
+            return;
+        }
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch_full(QIO_CHANNEL(fioc), G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
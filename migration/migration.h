@@ -18,6 +18,7 @@
 #include "hw/qdev-core.h"
 #include "qapi/qapi-types-migration.h"
 #include "qemu/thread.h"
+#include "qemu/units.h"
 #include "qemu/coroutine_int.h"
 #include "io/channel.h"
 #include "net/announce.h"
@@ -43,6 +44,25 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+#define BITMAP_SYNC_THREADS_DEFAULT        4
+
+/*
+ * Host pages sent along with each page requested during postcopy with
+ * the postcopy-preempt capability, at most POSTCOPY_PREFETCH_MAX_BYTES
+ */
+#define POSTCOPY_PREFETCH_PAGES_DEFAULT    4
+#define POSTCOPY_PREFETCH_MAX_BYTES        (256 * KiB)
+
+/* Threads writing and reading pages with the mapped-ram cap */
+#define MAPPED_RAM_THREADS_DEFAULT         4
+
+/* Channels the destination receives RAM pages on */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -75,7 +95,10 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Temporary host pages for each channel, see RAM_CHANNEL_* */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
+    /* Last RAMBlock received on each channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
@@ -103,6 +126,22 @@ struct MigrationIncomingState {
 
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
+
+    /* Channel used for requested pages, with the postcopy-preempt cap */
+    QEMUFile *postcopy_qemufile_dst;
+    bool have_preempt_thread;
+    QemuThread preempt_thread;
+    /* Set this when we want the preempt thread to quit */
+    bool preempt_thread_quit;
+
+    /* Second channel on the migration file for pages, with mapped-ram */
+    QEMUFile *mapped_ram_file;
+    /*
+     * Set while RAM saved with mapped-ram is loaded lazily; the fault
+     * thread then reads the pages from the file instead of asking the
+     * source for them.
+     */
+    bool ram_lazy_load;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -261,6 +300,38 @@ struct MigrationState
      * (which is in 4M chunk).
      */
     uint8_t clear_bitmap_shift;
+
+    /*
+     * Number of threads, including the migration thread, that sync the
+     * dirty bitmap of large guests.  The work is split in 1G chunks of
+     * guest memory, so smaller guests are always synced by the
+     * migration thread alone.
+     */
+    uint8_t bitmap_sync_threads;
+
+    /*
+     * Number of host pages following a page requested by the destination
+     * during postcopy that are sent along with it.
+     */
+    uint32_t postcopy_prefetch_pages;
+
+    /*
+     * Number of threads writing pages to the migration file on the
+     * source, and reading them back on the destination, with the
+     * mapped-ram cap.
+     */
+    uint8_t mapped_ram_threads;
+    /* Whether pages written and read with mapped-ram bypass the page cache */
+    bool mapped_ram_direct_io;
+    /* Second channel on the migration file for pages, with mapped-ram */
+    QEMUFile *mapped_ram_file;
+
+    /* Channel used for requested pages, with the postcopy-preempt cap */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once the connection attempt for the channel is over */
+    QemuSemaphore postcopy_qemufile_src_sem;
+    /* Set while the connection attempt for the channel is in flight */
+    bool postcopy_preempt_pending;
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
@@ -300,6 +371,13 @@ bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
+MultiFDCompression migrate_multifd_compression(void);
+int migrate_multifd_zlib_level(void);
+int migrate_multifd_zstd_level(void);
+ZeroPageDetection migrate_zero_page_detection(void);
+bool migrate_multifd_zero_page(void);
+bool migrate_zero_copy_send(void);
+bool migrate_local_update(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -319,6 +397,12 @@ int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+bool migrate_postcopy_preempt(void);
+uint32_t migrate_postcopy_prefetch_pages(void);
+bool migrate_mapped_ram(void);
+bool migrate_mapped_ram_lazy(void);
+uint8_t migrate_mapped_ram_threads(void);
+bool migrate_mapped_ram_direct_io(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
@@ -23,9 +23,11 @@
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "socket.h"
 #include "qapi/error.h"
 #include "qemu/notify.h"
 #include "qemu/rcu.h"
+#include "qemu/host-utils.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
@@ -92,6 +94,9 @@ int postcopy_notify(enum PostcopyNotifyReason reason, Error **errp)
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
+/* Buckets of the fault latency histogram, the last one catches all */
+#define POSTCOPY_LATENCY_BUCKETS 24
+
 typedef struct PostcopyBlocktimeContext {
     /* time when page fault initiated per vCPU */
     uint32_t *page_fault_vcpu_time;
@@ -106,6 +111,14 @@ typedef struct PostcopyBlocktimeContext {
     int smp_cpus_down;
     uint64_t start_time;
 
+    /* Fault latency, measured per requested host page */
+    QemuMutex latency_lock;
+    /* host page -> fault time in us since latency_start_us */
+    GHashTable *fault_time;
+    int64_t latency_start_us;
+    /* bucket N counts latencies in [2^N, 2^(N+1)) us */
+    uint64_t latency_histogram[POSTCOPY_LATENCY_BUCKETS];
+
     /*
      * Handler for exit event, necessary for
      * releasing whole blocktime_ctx
@@ -118,6 +131,8 @@ static void destroy_blocktime_context(struct PostcopyBlocktimeContext *ctx)
     g_free(ctx->page_fault_vcpu_time);
     g_free(ctx->vcpu_addr);
     g_free(ctx->vcpu_blocktime);
+    g_hash_table_destroy(ctx->fault_time);
+    qemu_mutex_destroy(&ctx->latency_lock);
     g_free(ctx);
 }
 
@@ -136,6 +151,9 @@ static struct PostcopyBlocktimeContext *blocktime_context_new(void)
     ctx->page_fault_vcpu_time = g_new0(uint32_t, smp_cpus);
     ctx->vcpu_addr = g_new0(uintptr_t, smp_cpus);
     ctx->vcpu_blocktime = g_new0(uint32_t, smp_cpus);
+    qemu_mutex_init(&ctx->latency_lock);
+    ctx->fault_time = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ctx->latency_start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     ctx->exit_notifier.notify = migration_exit_cb;
     ctx->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -159,6 +177,23 @@ static uint32List *get_vcpu_blocktime_list(PostcopyBlocktimeContext *ctx)
     return list;
 }
 
+static uint64List *get_latency_histogram_list(PostcopyBlocktimeContext *ctx)
+{
+    uint64List *list = NULL, *entry = NULL;
+    int i;
+
+    qemu_mutex_lock(&ctx->latency_lock);
+    for (i = POSTCOPY_LATENCY_BUCKETS - 1; i >= 0; i--) {
+        entry = g_new0(uint64List, 1);
+        entry->value = ctx->latency_histogram[i];
+        entry->next = list;
+        list = entry;
+    }
+    qemu_mutex_unlock(&ctx->latency_lock);
+
+    return list;
+}
+
 /*
  * This function just populates MigrationInfo from postcopy's
  * blocktime context. It will not populate MigrationInfo,
@@ -179,6 +214,8 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     info->postcopy_blocktime = bc->total_blocktime;
     info->has_postcopy_vcpu_blocktime = true;
     info->postcopy_vcpu_blocktime = get_vcpu_blocktime_list(bc);
+    info->has_postcopy_latency_histogram = true;
+    info->postcopy_latency_histogram = get_latency_histogram_list(bc);
 }
 
 static uint32_t get_postcopy_total_blocktime(void)
@@ -539,8 +576,12 @@ static void postcopy_balloon_inhibit(bool state)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    postcopy_preempt_thread_cleanup(mis);
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -577,9 +618,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -629,6 +672,25 @@ int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
     return 0;
 }
 
+/*
+ * Empty RAM and make accesses to it fault, for a lazy restore of RAM
+ * saved with mapped-ram.  Unlike postcopy the state is left alone, the
+ * faults are served from the file by ram.c while mis->ram_lazy_load is
+ * set.
+ */
+int postcopy_ram_incoming_lazy_setup(MigrationIncomingState *mis)
+{
+    if (foreach_not_ignored_block(nhp_range, mis)) {
+        return -1;
+    }
+
+    if (foreach_not_ignored_block(init_range, mis)) {
+        return -1;
+    }
+
+    return postcopy_ram_incoming_setup(mis);
+}
+
 /*
  * Mark the given area of RAM as requiring notification to unwritten areas
  * Used as a  callback on foreach_not_ignored_block.
@@ -858,6 +920,76 @@ static void mark_postcopy_blocktime_end(uintptr_t addr)
                                       affected_cpu);
 }
 
+/*
+ * Remember when a host page was first requested, unless it already
+ * arrived in the meantime.
+ *
+ * @addr: faulted host virtual address
+ * @rb: ramblock appropriate to addr
+ */
+static void mark_postcopy_latency_begin(uintptr_t addr, RAMBlock *rb)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyBlocktimeContext *dc = mis->blocktime_ctx;
+    gpointer key;
+    uint32_t now;
+
+    if (!dc) {
+        return;
+    }
+
+    key = (gpointer)QEMU_ALIGN_DOWN(addr, qemu_ram_pagesize(rb));
+    now = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - dc->latency_start_us;
+
+    qemu_mutex_lock(&dc->latency_lock);
+    if (!g_hash_table_contains(dc->fault_time, key)) {
+        g_hash_table_insert(dc->fault_time, key, GUINT_TO_POINTER(now));
+    }
+    qemu_mutex_unlock(&dc->latency_lock);
+
+    /* Same race with qemu_ufd_copy_ioctl as in the blocktime case */
+    if (ramblock_recv_bitmap_test(rb, (void *)addr)) {
+        qemu_mutex_lock(&dc->latency_lock);
+        g_hash_table_remove(dc->fault_time, key);
+        qemu_mutex_unlock(&dc->latency_lock);
+    }
+}
+
+/*
+ * Account the latency of a host page that was placed, if the guest
+ * faulted on it.
+ *
+ * @addr: host virtual address of the start of the host page
+ */
+static void mark_postcopy_latency_end(uintptr_t addr)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyBlocktimeContext *dc = mis->blocktime_ctx;
+    gpointer value;
+    uint32_t now, latency;
+    int bucket = 0;
+
+    if (!dc) {
+        return;
+    }
+
+    now = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - dc->latency_start_us;
+
+    qemu_mutex_lock(&dc->latency_lock);
+    if (g_hash_table_lookup_extended(dc->fault_time, (gpointer)addr,
+                                     NULL, &value)) {
+        g_hash_table_remove(dc->fault_time, (gpointer)addr);
+        /* Wraps after ~71 minutes, well above any sane latency */
+        latency = now - GPOINTER_TO_UINT(value);
+        if (latency) {
+            bucket = MIN(31 - clz32(latency), POSTCOPY_LATENCY_BUCKETS - 1);
+        }
+        dc->latency_histogram[bucket]++;
+        trace_mark_postcopy_latency_end(addr, latency);
+    }
+    qemu_mutex_unlock(&dc->latency_lock);
+}
+
 static bool postcopy_pause_fault_thread(MigrationIncomingState *mis)
 {
     trace_postcopy_pause_fault_thread();
@@ -920,7 +1052,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        if (!mis->to_src_file) {
+        if (!mis->to_src_file && !mis->ram_lazy_load) {
             /*
              * Possibly someone tells us that the return path is
              * broken already using the event. We should hold until
@@ -997,6 +1129,19 @@ static void *postcopy_ram_fault_thread(void *opaque)
             mark_postcopy_blocktime_begin(
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
+            mark_postcopy_latency_begin(
+                    (uintptr_t)(msg.arg.pagefault.address), rb);
+
+            /* There is no source, the page is read from the file */
+            if (mis->ram_lazy_load) {
+                ret = ram_load_lazy_fault(rb, rb_offset);
+                if (ret) {
+                    error_report("%s: ram_load_lazy_fault() get %d",
+                                 __func__, ret);
+                    break;
+                }
+                continue;
+            }
 
 retry:
             /*
@@ -1096,6 +1241,8 @@ retry:
 
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int i;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1134,14 +1281,17 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                                  MAP_ANONYMOUS, -1, 0);
-    if (mis->postcopy_tmp_page == MAP_FAILED) {
-        mis->postcopy_tmp_page = NULL;
-        error_report("%s: Failed to map postcopy_tmp_page %s",
-                     __func__, strerror(errno));
-        return -1;
+    /* Each channel assembles its host pages separately */
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        mis->postcopy_tmp_pages[i] = mmap(NULL, mis->largest_page_size,
+                                          PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                          MAP_ANONYMOUS, -1, 0);
+        if (mis->postcopy_tmp_pages[i] == MAP_FAILED) {
+            mis->postcopy_tmp_pages[i] = NULL;
+            error_report("%s: Failed to map postcopy_tmp_page %s",
+                         __func__, strerror(errno));
+            return -1;
+        }
     }
 
     /*
@@ -1166,34 +1316,43 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
      */
     postcopy_balloon_inhibit(true);
 
+    if (postcopy_preempt_thread_setup(mis)) {
+        return -1;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
 }
 
 static int qemu_ufd_copy_ioctl(int userfault_fd, void *host_addr,
-                               void *from_addr, uint64_t pagesize, RAMBlock *rb)
+                               void *from_addr, uint64_t len, RAMBlock *rb)
 {
+    size_t pagesize = qemu_ram_pagesize(rb);
+    uint64_t done;
     int ret;
     if (from_addr) {
         struct uffdio_copy copy_struct;
         copy_struct.dst = (uint64_t)(uintptr_t)host_addr;
         copy_struct.src = (uint64_t)(uintptr_t)from_addr;
-        copy_struct.len = pagesize;
+        copy_struct.len = len;
         copy_struct.mode = 0;
         ret = ioctl(userfault_fd, UFFDIO_COPY, &copy_struct);
     } else {
         struct uffdio_zeropage zero_struct;
         zero_struct.range.start = (uint64_t)(uintptr_t)host_addr;
-        zero_struct.range.len = pagesize;
+        zero_struct.range.len = len;
         zero_struct.mode = 0;
         ret = ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
     }
     if (!ret) {
         ramblock_recv_bitmap_set_range(rb, host_addr,
-                                       pagesize / qemu_target_page_size());
-        mark_postcopy_blocktime_end((uintptr_t)host_addr);
-
+                                       len / qemu_target_page_size());
+        /* Faults are accounted per host page */
+        for (done = 0; done < len; done += pagesize) {
+            mark_postcopy_blocktime_end((uintptr_t)host_addr + done);
+            mark_postcopy_latency_end((uintptr_t)host_addr + done);
+        }
     }
     return ret;
 }
@@ -1214,60 +1373,108 @@ int postcopy_notify_shared_wake(RAMBlock *rb, uint64_t offset)
     return 0;
 }
 
+/* Wake the sharers of each host page of a range that was just placed */
+static int postcopy_notify_shared_wake_range(RAMBlock *rb, void *host,
+                                             size_t len)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    size_t done;
+    int ret;
+
+    for (done = 0; done < len; done += pagesize) {
+        uint64_t offset = qemu_ram_block_host_offset(rb,
+                                                     (uint8_t *)host + done);
+
+        ret = postcopy_notify_shared_wake(rb, offset);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
 /*
- * Place a host page (from) at (host) atomically
+ * Place host pages (from) at (host) atomically, @len is a multiple of
+ * the host page size of @rb
  * returns 0 on success
  */
-int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
-                        RAMBlock *rb)
+int postcopy_place_pages(MigrationIncomingState *mis, void *host, void *from,
+                         size_t len, RAMBlock *rb)
 {
-    size_t pagesize = qemu_ram_pagesize(rb);
-
     /* copy also acks to the kernel waking the stalled thread up
      * TODO: We can inhibit that ack and only do it if it was requested
      * which would be slightly cheaper, but we'd have to be careful
      * of the order of updating our page state.
      */
-    if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, from, pagesize, rb)) {
+    if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, from, len, rb)) {
         int e = errno;
         error_report("%s: %s copy host: %p from: %p (size: %zd)",
-                     __func__, strerror(e), host, from, pagesize);
+                     __func__, strerror(e), host, from, len);
 
         return -e;
     }
 
     trace_postcopy_place_page(host);
-    return postcopy_notify_shared_wake(rb,
-                                       qemu_ram_block_host_offset(rb, host));
+    return postcopy_notify_shared_wake_range(rb, host, len);
 }
 
 /*
- * Place a zero page at (host) atomically
+ * Place zero pages at (host) atomically, @len is a multiple of the host
+ * page size of @rb
  * returns 0 on success
  */
-int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
-                             RAMBlock *rb)
+int postcopy_place_pages_zero(MigrationIncomingState *mis, void *host,
+                              size_t len, RAMBlock *rb)
 {
     size_t pagesize = qemu_ram_pagesize(rb);
+    size_t done;
+    int ret;
+
     trace_postcopy_place_page_zero(host);
 
     /* Normal RAMBlocks can zero a page using UFFDIO_ZEROPAGE
      * but it's not available for everything (e.g. hugetlbpages)
      */
     if (qemu_ram_is_uf_zeroable(rb)) {
-        if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, NULL, pagesize, rb)) {
+        if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, NULL, len, rb)) {
             int e = errno;
             error_report("%s: %s zero host: %p",
                          __func__, strerror(e), host);
 
             return -e;
         }
-        return postcopy_notify_shared_wake(rb,
-                                           qemu_ram_block_host_offset(rb,
-                                                                      host));
-    } else {
-        return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page, rb);
+        return postcopy_notify_shared_wake_range(rb, host, len);
     }
+
+    /* The zero page is only as large as the largest host page */
+    for (done = 0; done < len; done += pagesize) {
+        ret = postcopy_place_pages(mis, (uint8_t *)host + done,
+                                   mis->postcopy_tmp_zero_page, pagesize, rb);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Place a host page (from) at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
+                        RAMBlock *rb)
+{
+    return postcopy_place_pages(mis, host, from, qemu_ram_pagesize(rb), rb);
+}
+
+/*
+ * Place a zero page at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
+                             RAMBlock *rb)
+{
+    return postcopy_place_pages_zero(mis, host, qemu_ram_pagesize(rb), rb);
 }
 
 #else
@@ -1313,6 +1520,12 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     return -1;
 }
 
+int postcopy_ram_incoming_lazy_setup(MigrationIncomingState *mis)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
 int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
                         RAMBlock *rb)
 {
@@ -1327,6 +1540,20 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
+int postcopy_place_pages(MigrationIncomingState *mis, void *host, void *from,
+                         size_t len, RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_pages_zero(MigrationIncomingState *mis, void *host,
+                              size_t len, RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
 int postcopy_wake_shared(struct PostCopyFD *pcfd,
                          uint64_t client_addr,
                          RAMBlock *rb)
@@ -1469,3 +1696,160 @@ void postcopy_unregister_shared_ufd(struct PostCopyFD *pcfd)
         }
     }
 }
+
+/* ------------------------------------------------------------------------- */
+/* Postcopy preempt channel, see the postcopy-preempt capability */
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (!s->postcopy_preempt_pending) {
+        /* The migration was cleaned up while we were connecting */
+        object_unref(OBJECT(ioc));
+        return;
+    }
+    s->postcopy_preempt_pending = false;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        /* The destination won't start without it, so fail the migration */
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+        qemu_mutex_lock(&s->qemu_file_lock);
+        if (s->to_dst_file) {
+            qemu_file_set_error(s->to_dst_file, -EIO);
+        }
+        qemu_mutex_unlock(&s->qemu_file_lock);
+    } else {
+        s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+        trace_postcopy_preempt_new_channel();
+    }
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/*
+ * Start connecting the preempt channel.  It is only used once postcopy
+ * starts, so nothing waits for it here.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preempt does not support TLS");
+        return -1;
+    }
+
+    if (!socket_send_channel_usable()) {
+        error_setg(errp, "Postcopy preempt requires a socket transport");
+        return -1;
+    }
+
+    /* Drop a post left over from a previous migration */
+    qemu_sem_destroy(&s->postcopy_qemufile_src_sem);
+    qemu_sem_init(&s->postcopy_qemufile_src_sem, 0);
+
+    s->postcopy_preempt_pending = true;
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+    return 0;
+}
+
+/* Called from the migration thread, without the iothread lock held */
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    if (!s->postcopy_qemufile_src) {
+        qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+    }
+
+    if (!s->postcopy_qemufile_src) {
+        error_report("%s: postcopy preempt channel is not connected",
+                     __func__);
+        return -1;
+    }
+    return 0;
+}
+
+void postcopy_preempt_cleanup(MigrationState *s)
+{
+    s->postcopy_preempt_pending = false;
+
+    if (s->postcopy_qemufile_src) {
+        qemu_fclose(s->postcopy_qemufile_src);
+        s->postcopy_qemufile_src = NULL;
+    }
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    /* Only the preempt thread reads from it, so it can block */
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    trace_postcopy_preempt_new_channel();
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    /* Each requested host page is followed by an EOS */
+    while (!ret) {
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_load_postcopy(mis->postcopy_qemufile_dst,
+                                    RAM_CHANNEL_POSTCOPY);
+        }
+    }
+
+    if (!atomic_read(&mis->preempt_thread_quit)) {
+        /* Make the source fall back to the main channel */
+        error_report("%s: postcopy preempt channel failed: %s", __func__,
+                     strerror(-ret));
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit();
+    return NULL;
+}
+
+int postcopy_preempt_thread_setup(MigrationIncomingState *mis)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    if (!mis->postcopy_qemufile_dst) {
+        error_report("%s: postcopy preempt channel is not connected",
+                     __func__);
+        return -1;
+    }
+
+    mis->preempt_thread_quit = false;
+    qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+    mis->have_preempt_thread = true;
+    return 0;
+}
+
+void postcopy_preempt_thread_cleanup(MigrationIncomingState *mis)
+{
+    if (!mis->have_preempt_thread) {
+        return;
+    }
+
+    atomic_set(&mis->preempt_thread_quit, true);
+    qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    qemu_thread_join(&mis->preempt_thread);
+    mis->have_preempt_thread = false;
+}
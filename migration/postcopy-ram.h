@@ -41,6 +41,12 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
  */
 int postcopy_ram_prepare_discard(MigrationIncomingState *mis);
 
+/*
+ * Discard RAM and register it with userfault, so that RAM saved with
+ * mapped-ram can be loaded lazily; ram.c serves the faults.
+ */
+int postcopy_ram_incoming_lazy_setup(MigrationIncomingState *mis);
+
 /*
  * Called at the start of each RAMBlock by the bitmap code.
  */
@@ -78,6 +84,21 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
 int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                              RAMBlock *rb);
 
+/*
+ * Place a range of host pages (from) at (host), @len is a multiple of
+ * the host page size of @rb
+ * returns 0 on success
+ */
+int postcopy_place_pages(MigrationIncomingState *mis, void *host, void *from,
+                         size_t len, RAMBlock *rb);
+
+/*
+ * Place a range of zero host pages at (host)
+ * returns 0 on success
+ */
+int postcopy_place_pages_zero(MigrationIncomingState *mis, void *host,
+                              size_t len, RAMBlock *rb);
+
 /* The current postcopy state is read/set by postcopy_state_get/set
  * which update it atomically.
  * The state is updated as postcopy messages are received, and
@@ -179,4 +200,13 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/* Postcopy preempt channel, source side */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+int postcopy_preempt_wait_channel(MigrationState *s);
+void postcopy_preempt_cleanup(MigrationState *s);
+/* Postcopy preempt channel, destination side */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+int postcopy_preempt_thread_setup(MigrationIncomingState *mis);
+void postcopy_preempt_thread_cleanup(MigrationIncomingState *mis);
+
 #endif
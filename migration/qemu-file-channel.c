@@ -26,6 +26,7 @@
 #include "qemu-file-channel.h"
 #include "qemu-file.h"
 #include "io/channel-socket.h"
+#include "io/channel-file.h"
 #include "qemu/iov.h"
 
 
@@ -99,6 +100,78 @@ static ssize_t channel_get_buffer(void *opaque,
 }
 
 
+static ssize_t channel_get_buffer_fds(void *opaque,
+                                      uint8_t *buf,
+                                      int64_t pos,
+                                      size_t size,
+                                      int **fds,
+                                      size_t *nfds,
+                                      Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    ssize_t ret;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS)) {
+        return channel_get_buffer(opaque, buf, pos, size, errp);
+    }
+
+    do {
+        ret = qio_channel_readv_full(ioc, &iov, 1, fds, nfds, errp);
+        if (ret < 0) {
+            if (ret == QIO_CHANNEL_ERR_BLOCK) {
+                if (qemu_in_coroutine()) {
+                    qio_channel_yield(ioc, G_IO_IN);
+                } else {
+                    qio_channel_wait(ioc, G_IO_IN);
+                }
+            } else {
+                return -EIO;
+            }
+        }
+    } while (ret == QIO_CHANNEL_ERR_BLOCK);
+
+    return ret;
+}
+
+
+static ssize_t channel_put_fd(void *opaque,
+                              const uint8_t *buf,
+                              size_t size,
+                              int fd,
+                              Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+    ssize_t len;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS)) {
+        error_setg(errp, "Migration channel cannot pass file descriptors");
+        return -EINVAL;
+    }
+
+    do {
+        len = qio_channel_writev_full(ioc, &iov, 1, &fd, 1, 0, errp);
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            if (qemu_in_coroutine()) {
+                qio_channel_yield(ioc, G_IO_OUT);
+            } else {
+                qio_channel_wait(ioc, G_IO_OUT);
+            }
+        }
+    } while (len == QIO_CHANNEL_ERR_BLOCK);
+
+    if (len < 0) {
+        return -EIO;
+    }
+    if (len != size) {
+        error_setg(errp, "Short write passing a file descriptor");
+        return -EIO;
+    }
+    return len;
+}
+
+
 static int channel_close(void *opaque, Error **errp)
 {
     int ret;
@@ -146,6 +219,98 @@ static int channel_set_blocking(void *opaque,
     return 0;
 }
 
+static QIOChannelFile *channel_get_file(void *opaque, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "Migration channel is not a file");
+        return NULL;
+    }
+    return QIO_CHANNEL_FILE(ioc);
+}
+
+
+static ssize_t channel_pread_buffer(void *opaque,
+                                    uint8_t *buf,
+                                    size_t size,
+                                    off_t pos,
+                                    Error **errp)
+{
+    QIOChannelFile *fioc = channel_get_file(opaque, errp);
+    size_t done = 0;
+
+    if (!fioc) {
+        return -EINVAL;
+    }
+
+    while (done < size) {
+        ssize_t len = pread(fioc->fd, buf + done, size - done, pos + done);
+        if (len < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, err, "Unable to read from file");
+            return -err;
+        }
+        if (len == 0) {
+            error_setg(errp, "Unexpected end of file at offset %" PRId64,
+                       (int64_t)(pos + done));
+            return -EIO;
+        }
+        done += len;
+    }
+    return done;
+}
+
+
+static ssize_t channel_pwrite_buffer(void *opaque,
+                                     const uint8_t *buf,
+                                     size_t size,
+                                     off_t pos,
+                                     Error **errp)
+{
+    QIOChannelFile *fioc = channel_get_file(opaque, errp);
+    size_t done = 0;
+
+    if (!fioc) {
+        return -EINVAL;
+    }
+
+    while (done < size) {
+        ssize_t len = pwrite(fioc->fd, buf + done, size - done, pos + done);
+        if (len < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, err, "Unable to write to file");
+            return -err;
+        }
+        done += len;
+    }
+    return done;
+}
+
+
+static int channel_seek(void *opaque,
+                        off_t pos,
+                        Error **errp)
+{
+    QIOChannelFile *fioc = channel_get_file(opaque, errp);
+
+    if (!fioc) {
+        return -EINVAL;
+    }
+
+    if (qio_channel_io_seek(QIO_CHANNEL(fioc), pos, SEEK_SET, errp) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+
 static QEMUFile *channel_get_input_return_path(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -166,6 +331,9 @@ static const QEMUFileOps channel_input_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .pread_buffer = channel_pread_buffer,
+    .seek = channel_seek,
+    .get_buffer_fds = channel_get_buffer_fds,
 };
 
 
@@ -175,6 +343,9 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .pwrite_buffer = channel_pwrite_buffer,
+    .seek = channel_seek,
+    .put_fd = channel_put_fd,
 };
 
 
@@ -25,6 +25,7 @@
 #include <zlib.h>
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
+#include "qemu/bswap.h"
 #include "migration.h"
 #include "qemu-file.h"
 #include "trace.h"
@@ -32,6 +33,8 @@
 
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+/* Stream byte that carries a descriptor passed with qemu_file_send_fd() */
+#define QEMU_FILE_FD_MARKER 0xfd
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -55,6 +58,12 @@ struct QEMUFile {
     Error *last_error_obj;
     /* has the file has been shutdown */
     bool shutdown;
+
+    /* file offset minus stream position, moved by qemu_set_offset() */
+    int64_t offset_delta;
+
+    /* descriptors received with the stream and not yet claimed, in order */
+    GQueue fds;
 };
 
 /*
@@ -345,8 +354,21 @@ static ssize_t qemu_fill_buffer(QEMUFile *f)
         return 0;
     }
 
-    len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                             IO_BUF_SIZE - pending, &local_error);
+    if (f->ops->get_buffer_fds) {
+        int *fds = NULL;
+        size_t nfds = 0, i;
+
+        len = f->ops->get_buffer_fds(f->opaque, f->buf + pending, f->pos,
+                                     IO_BUF_SIZE - pending, &fds, &nfds,
+                                     &local_error);
+        for (i = 0; i < nfds; i++) {
+            g_queue_push_tail(&f->fds, GINT_TO_POINTER(fds[i]));
+        }
+        g_free(fds);
+    } else {
+        len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
+                                 IO_BUF_SIZE - pending, &local_error);
+    }
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -392,6 +414,9 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    while (!g_queue_is_empty(&f->fds)) {
+        close(GPOINTER_TO_INT(g_queue_pop_head(&f->fds)));
+    }
     error_free(f->last_error_obj);
     g_free(f);
     trace_qemu_file_fclose();
@@ -487,6 +512,75 @@ void qemu_put_byte(QEMUFile *f, int v)
     add_buf_to_iovec(f, 1);
 }
 
+/*
+ * Copy 'n' integers of 'size' bytes between host and big endian order.
+ * The conversion is its own inverse, so the same helper serves both
+ * directions.
+ */
+static void qemu_file_swap_be(uint8_t *dst, const uint8_t *src, size_t n,
+                              size_t size)
+{
+    size_t i;
+
+    switch (size) {
+    case 1:
+        memcpy(dst, src, n);
+        break;
+    case 2:
+        for (i = 0; i < n; i++) {
+            stw_be_p(dst + i * 2, lduw_he_p(src + i * 2));
+        }
+        break;
+    case 4:
+        for (i = 0; i < n; i++) {
+            stl_be_p(dst + i * 4, ldl_he_p(src + i * 4));
+        }
+        break;
+    case 8:
+        for (i = 0; i < n; i++) {
+            stq_be_p(dst + i * 8, ldq_he_p(src + i * 8));
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * Write 'n' host order integers of 'size' bytes (1, 2, 4 or 8) from 'buf'
+ * as big endian, converting them straight into the file buffer.  The
+ * result on the wire is the same as 'n' calls to qemu_put_be{16,32,64}.
+ */
+void qemu_put_be_array(QEMUFile *f, const void *buf, size_t n, size_t size)
+{
+    const uint8_t *src = buf;
+    size_t count;
+
+    if (f->last_error) {
+        return;
+    }
+
+    while (n > 0) {
+        count = MIN(n, (IO_BUF_SIZE - f->buf_index) / size);
+        if (!count) {
+            /* Not enough room left for a whole element */
+            qemu_fflush(f);
+            if (qemu_file_get_error(f)) {
+                break;
+            }
+            continue;
+        }
+        qemu_file_swap_be(f->buf + f->buf_index, src, count, size);
+        f->bytes_xfer += count * size;
+        add_buf_to_iovec(f, count * size);
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+        src += count * size;
+        n -= count;
+    }
+}
+
 void qemu_file_skip(QEMUFile *f, int size)
 {
     if (f->buf_index + size <= f->buf_size) {
@@ -572,6 +666,36 @@ size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size)
     return done;
 }
 
+/*
+ * Read 'n' big endian integers of 'size' bytes (1, 2, 4 or 8) into 'buf'
+ * in host order; the counterpart of qemu_put_be_array().
+ *
+ * Returns the number of whole elements read, which is less than 'n' only
+ * on error or end of file.
+ */
+size_t qemu_get_be_array(QEMUFile *f, void *buf, size_t n, size_t size)
+{
+    uint8_t *dst = buf;
+    size_t done = 0;
+
+    while (done < n) {
+        size_t res, count;
+        uint8_t *src;
+
+        count = MIN(n - done, IO_BUF_SIZE / size);
+        res = qemu_peek_buffer(f, &src, count * size, 0);
+        count = res / size;
+        if (count == 0) {
+            break;
+        }
+        qemu_file_swap_be(dst, src, count, size);
+        qemu_file_skip(f, count * size);
+        dst += count * size;
+        done += count;
+    }
+    return done;
+}
+
 /*
  * Read 'size' bytes of data from the file.
  * 'size' can be larger than the internal buffer.
@@ -657,6 +781,165 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Read @buflen bytes at offset @pos of the underlying file.  The stream
+ * buffer and position are left alone, and several threads may call
+ * this at once.
+ *
+ * Returns 0 on success or a negative errno; the error of the stream
+ * is not updated.
+ */
+int qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t buflen, off_t pos,
+                       Error **errp)
+{
+    ssize_t ret;
+
+    if (!f->ops->pread_buffer) {
+        error_setg(errp, "Migration stream does not support positioned reads");
+        return -EINVAL;
+    }
+
+    ret = f->ops->pread_buffer(f->opaque, buf, buflen, pos, errp);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Write @buflen bytes at offset @pos of the underlying file, see
+ * qemu_get_buffer_at().  The bytes are not accounted as transferred,
+ * use qemu_file_credit_transfer() from the thread owning the stream.
+ */
+int qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t buflen,
+                       off_t pos, Error **errp)
+{
+    ssize_t ret;
+
+    if (!f->ops->pwrite_buffer) {
+        error_setg(errp, "Migration stream does not support positioned writes");
+        return -EINVAL;
+    }
+
+    ret = f->ops->pwrite_buffer(f->opaque, buf, buflen, pos, errp);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Account @size bytes written outside of the stream as transferred, for
+ * rate limiting and statistics, like qemu_update_position() does.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->pos += size;
+    f->bytes_xfer += size;
+    f->offset_delta -= size;
+}
+
+/* Offset in the underlying file of the next byte of the stream */
+off_t qemu_get_offset(QEMUFile *f)
+{
+    if (qemu_file_is_writable(f)) {
+        return qemu_ftell_fast(f) + f->offset_delta;
+    }
+    return f->pos - (f->buf_size - f->buf_index) + f->offset_delta;
+}
+
+/*
+ * Continue the stream at offset @pos of the underlying file.  Pending
+ * writes are flushed first, and read-ahead data is dropped.
+ *
+ * Returns 0 on success or a negative errno, which is also set as the
+ * error of the stream.
+ */
+int qemu_set_offset(QEMUFile *f, off_t pos)
+{
+    Error *local_error = NULL;
+    int ret;
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->pos -= f->buf_size - f->buf_index;
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -EINVAL);
+        return -EINVAL;
+    }
+
+    ret = f->ops->seek(f->opaque, pos, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, ret, local_error);
+        return ret;
+    }
+
+    f->offset_delta = pos - f->pos;
+    return 0;
+}
+
+/*
+ * Pass 'fd' to the other end, in order with the rest of the stream.  The
+ * descriptor rides on a single marker byte, sent after flushing whatever
+ * is buffered.  Returns 0 on success, -err on error.
+ */
+int qemu_file_send_fd(QEMUFile *f, int fd)
+{
+    Error *local_error = NULL;
+    uint8_t marker = QEMU_FILE_FD_MARKER;
+    ssize_t ret;
+
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    if (!f->ops->put_fd) {
+        qemu_file_set_error(f, -EINVAL);
+        return -EINVAL;
+    }
+
+    ret = f->ops->put_fd(f->opaque, &marker, 1, fd, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, ret, local_error);
+        return ret;
+    }
+
+    f->pos++;
+    f->bytes_xfer++;
+    return 0;
+}
+
+/*
+ * Receive a descriptor sent with qemu_file_send_fd().  Returns the
+ * descriptor, which now belongs to the caller, or -err on error.
+ */
+int qemu_file_recv_fd(QEMUFile *f)
+{
+    int marker = qemu_get_byte(f);
+    int ret = qemu_file_get_error(f);
+
+    if (ret) {
+        return ret;
+    }
+
+    if (marker != QEMU_FILE_FD_MARKER || g_queue_is_empty(&f->fds)) {
+        Error *local_error = NULL;
+
+        error_setg(&local_error, "Expected a file descriptor in the "
+                   "migration stream");
+        qemu_file_set_error_obj(f, -EINVAL, local_error);
+        return -EINVAL;
+    }
+
+    return GPOINTER_TO_INT(g_queue_pop_head(&f->fds));
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
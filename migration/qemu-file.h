@@ -103,6 +103,39 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr,
                                    Error **errp);
 
+/*
+ * Read or write a buffer at a fixed offset of the underlying file,
+ * bypassing the stream.  The handler must transfer all of the data or
+ * return a negative errno value.  Only seekable files support this.
+ */
+typedef ssize_t (QEMUFilePreadFunc)(void *opaque, uint8_t *buf, size_t size,
+                                    off_t pos, Error **errp);
+typedef ssize_t (QEMUFilePwriteFunc)(void *opaque, const uint8_t *buf,
+                                     size_t size, off_t pos, Error **errp);
+
+/*
+ * Move the stream to an offset of the underlying file.
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFileSeekFunc)(void *opaque, off_t pos, Error **errp);
+
+/*
+ * Pass a file descriptor in band: 'buf' is written with 'fd' attached,
+ * so the other side receives it together with that data.  Only unix
+ * sockets support this.  Returns the bytes written or -err on error.
+ */
+typedef ssize_t (QEMUFilePutFdFunc)(void *opaque, const uint8_t *buf,
+                                    size_t size, int fd, Error **errp);
+
+/*
+ * Like QEMUFileGetBufferFunc, but also returns the file descriptors that
+ * arrived with the data in a newly allocated '*fds' array.
+ */
+typedef ssize_t (QEMUFileGetBufferFdsFunc)(void *opaque, uint8_t *buf,
+                                           int64_t pos, size_t size,
+                                           int **fds, size_t *nfds,
+                                           Error **errp);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -110,6 +143,11 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFilePreadFunc *pread_buffer;
+    QEMUFilePwriteFunc *pwrite_buffer;
+    QEMUFileSeekFunc *seek;
+    QEMUFilePutFdFunc *put_fd;
+    QEMUFileGetBufferFdsFunc *get_buffer_fds;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -134,10 +172,22 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size,
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
 
+int qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t buflen, off_t pos,
+                       Error **errp);
+int qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t buflen,
+                       off_t pos, Error **errp);
+void qemu_file_credit_transfer(QEMUFile *f, size_t size);
+off_t qemu_get_offset(QEMUFile *f);
+int qemu_set_offset(QEMUFile *f, off_t pos);
+int qemu_file_send_fd(QEMUFile *f, int fd);
+int qemu_file_recv_fd(QEMUFile *f);
+
 #include "migration/qemu-file-types.h"
 
 size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset);
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size);
+void qemu_put_be_array(QEMUFile *f, const void *buf, size_t n, size_t size);
+size_t qemu_get_be_array(QEMUFile *f, void *buf, size_t n, size_t size);
 ssize_t qemu_put_compression_data(QEMUFile *f, z_stream *stream,
                                   const uint8_t *p, size_t size);
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
@@ -157,10 +157,21 @@ out:
     return ret;
 }
 
+/*
+ * With local-update, blocks backed by a shared file or memfd are passed to
+ * the destination by file descriptor and never go through the stream.
+ */
+static bool ramblock_is_fd_passed(RAMBlock *block)
+{
+    return migrate_local_update() && qemu_ram_is_shared(block) &&
+           block->fd >= 0;
+}
+
 static bool ramblock_is_ignored(RAMBlock *block)
 {
     return !qemu_ram_is_migratable(block) ||
-           (migrate_ignore_shared() && qemu_ram_is_shared(block));
+           (migrate_ignore_shared() && qemu_ram_is_shared(block)) ||
+           ramblock_is_fd_passed(block);
 }
 
 /* Should be holding either ram_list.mutex, or the RCU lock. */
@@ -308,6 +319,8 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Last block sent on the postcopy preempt channel */
+    RAMBlock *postcopy_preempt_last_sent_block;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -743,6 +756,82 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     return 1;
 }
 
+/**
+ * ramblock_summary_find_next: find the next bmap word that may be dirty
+ *
+ * Returns the index of the first word of @rb's bmap at or after @word
+ * whose bmap_summary bit is set, or @nwords if there is none.
+ *
+ * Words of bmap_summary found to be clear on the way get their
+ * bmap_summary_top bit cleared.  This is only done from the thread
+ * that searches the bitmap, which is also the only one that updates
+ * the summaries while the search can run.
+ *
+ * @rb: RAMBlock where to search
+ * @nwords: number of words of bmap to consider
+ * @word: word where we start the search
+ */
+static unsigned long ramblock_summary_find_next(RAMBlock *rb,
+                                                unsigned long nwords,
+                                                unsigned long word)
+{
+    unsigned long ntop = BITS_TO_LONGS(nwords);
+
+    while (word < nwords) {
+        unsigned long top = BIT_WORD(word);
+        unsigned long bits = rb->bmap_summary[top] &
+                             BITMAP_FIRST_WORD_MASK(word);
+
+        if (bits) {
+            return MIN(top * BITS_PER_LONG + ctzl(bits), nwords);
+        }
+        if (!rb->bmap_summary[top]) {
+            clear_bit(top, rb->bmap_summary_top);
+        }
+        top = find_next_bit(rb->bmap_summary_top, ntop, top + 1);
+        word = top * BITS_PER_LONG;
+    }
+
+    return nwords;
+}
+
+/**
+ * ramblock_find_next_dirty: find the next dirty bit of a RAMBlock's bmap
+ *
+ * Same as find_next_bit() on @rb->bmap, but clean regions are skipped
+ * with the help of the summary bitmaps rather than word by word.
+ *
+ * @rb: RAMBlock where to search
+ * @size: number of bits of bmap to consider
+ * @start: bit where we start the search
+ */
+static unsigned long ramblock_find_next_dirty(RAMBlock *rb,
+                                              unsigned long size,
+                                              unsigned long start)
+{
+    unsigned long nwords = BITS_TO_LONGS(size);
+    unsigned long word = BIT_WORD(start);
+    unsigned long bits;
+
+    if (start >= size) {
+        return size;
+    }
+
+    bits = rb->bmap[word] & BITMAP_FIRST_WORD_MASK(start);
+    while (!bits) {
+        if (!rb->bmap[word]) {
+            clear_bit(word, rb->bmap_summary);
+        }
+        word = ramblock_summary_find_next(rb, nwords, word + 1);
+        if (word >= nwords) {
+            return size;
+        }
+        bits = rb->bmap[word];
+    }
+
+    return MIN(word * BITS_PER_LONG + ctzl(bits), size);
+}
+
 /**
  * migration_bitmap_find_dirty: find the next dirty page from start
  *
@@ -757,7 +846,6 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
                                           unsigned long start)
 {
     unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
-    unsigned long *bitmap = rb->bmap;
     unsigned long next;
 
     if (ramblock_is_ignored(rb)) {
@@ -771,7 +859,7 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
     if (!rs->fpo_enabled && rs->ram_bulk_stage && start > 0) {
         next = start + 1;
     } else {
-        next = find_next_bit(bitmap, size, start);
+        next = ramblock_find_next_dirty(rb, size, start);
     }
 
     return next;
@@ -829,6 +917,223 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
                                               &rs->num_dirty_pages_period);
 }
 
+/*
+ * On large guests the dirty bitmap sync is split in chunks of guest
+ * memory that are handed out to the bitmap sync threads.  The size
+ * is a multiple of BITS_PER_LONG pages, so that two threads never
+ * update the same word of a RAMBlock's bmap.
+ */
+#define BITMAP_SYNC_CHUNK_SIZE (1ULL << 30)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncChunk;
+
+typedef struct {
+    /* Helper threads; the migration thread takes part in the sync too */
+    QemuThread *threads;
+    int thread_count;
+    /* Posted once per thread when a new list of chunks is ready */
+    QemuSemaphore sem;
+    /* Posted by each thread when no chunks are left */
+    QemuSemaphore sem_done;
+    bool quit;
+    /* The chunks of the current sync */
+    BitmapSyncChunk *chunks;
+    unsigned int nr_chunks;
+    unsigned int chunks_allocated;
+    /* Index of the next chunk to sync, taken atomically */
+    unsigned int next_chunk;
+    /* Protects the counters below */
+    QemuMutex mutex;
+    uint64_t dirty_pages;
+    uint64_t real_dirty_pages;
+} BitmapSyncState;
+
+static BitmapSyncState *bitmap_sync_state;
+
+static void bitmap_sync_do_chunks(BitmapSyncState *s)
+{
+    uint64_t dirty_pages = 0;
+    uint64_t real_dirty_pages = 0;
+    unsigned int i;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        while ((i = atomic_fetch_inc(&s->next_chunk)) < s->nr_chunks) {
+            BitmapSyncChunk *chunk = &s->chunks[i];
+
+            dirty_pages +=
+                cpu_physical_memory_sync_dirty_bitmap(chunk->block,
+                                                      chunk->start,
+                                                      chunk->length,
+                                                      &real_dirty_pages);
+        }
+    }
+
+    qemu_mutex_lock(&s->mutex);
+    s->dirty_pages += dirty_pages;
+    s->real_dirty_pages += real_dirty_pages;
+    qemu_mutex_unlock(&s->mutex);
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncState *s = opaque;
+
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&s->sem);
+        if (atomic_read(&s->quit)) {
+            break;
+        }
+        bitmap_sync_do_chunks(s);
+        qemu_sem_post(&s->sem_done);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void bitmap_sync_threads_setup(void)
+{
+    int threads = migrate_get_current()->bitmap_sync_threads;
+    BitmapSyncState *s;
+    int i;
+
+    if (threads <= 1) {
+        return;
+    }
+
+    s = g_new0(BitmapSyncState, 1);
+    s->thread_count = threads - 1;
+    s->threads = g_new0(QemuThread, s->thread_count);
+    qemu_sem_init(&s->sem, 0);
+    qemu_sem_init(&s->sem_done, 0);
+    qemu_mutex_init(&s->mutex);
+    for (i = 0; i < s->thread_count; i++) {
+        qemu_thread_create(&s->threads[i], "bitmapsync", bitmap_sync_thread,
+                           s, QEMU_THREAD_JOINABLE);
+    }
+    bitmap_sync_state = s;
+}
+
+static void bitmap_sync_threads_cleanup(void)
+{
+    BitmapSyncState *s = bitmap_sync_state;
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    atomic_set(&s->quit, true);
+    for (i = 0; i < s->thread_count; i++) {
+        qemu_sem_post(&s->sem);
+    }
+    for (i = 0; i < s->thread_count; i++) {
+        qemu_thread_join(&s->threads[i]);
+    }
+    qemu_sem_destroy(&s->sem);
+    qemu_sem_destroy(&s->sem_done);
+    qemu_mutex_destroy(&s->mutex);
+    g_free(s->chunks);
+    g_free(s->threads);
+    g_free(s);
+    bitmap_sync_state = NULL;
+}
+
+static void bitmap_sync_add_chunk(BitmapSyncState *s, RAMBlock *block,
+                                  ram_addr_t start, ram_addr_t length)
+{
+    BitmapSyncChunk *chunk;
+
+    if (s->nr_chunks == s->chunks_allocated) {
+        s->chunks_allocated = MAX(s->chunks_allocated * 2, 16);
+        s->chunks = g_renew(BitmapSyncChunk, s->chunks, s->chunks_allocated);
+    }
+    chunk = &s->chunks[s->nr_chunks++];
+    chunk->block = block;
+    chunk->start = start;
+    chunk->length = length;
+}
+
+/*
+ * Sync the dirty bitmap of all the RAMBlocks, spreading the work over
+ * the bitmap sync threads when there is more than one chunk to sync.
+ *
+ * Called with RCU critical section and bitmap_mutex held.
+ */
+static void ram_sync_dirty_bitmaps(RAMState *rs)
+{
+    BitmapSyncState *s = bitmap_sync_state;
+    RAMBlock *block;
+    int i;
+
+    if (!s) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+        return;
+    }
+
+    s->nr_chunks = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length;
+             start += BITMAP_SYNC_CHUNK_SIZE) {
+            bitmap_sync_add_chunk(s, block, start,
+                                  MIN(BITMAP_SYNC_CHUNK_SIZE,
+                                      block->used_length - start));
+        }
+    }
+
+    s->next_chunk = 0;
+    s->dirty_pages = 0;
+    s->real_dirty_pages = 0;
+    if (s->nr_chunks == 1) {
+        bitmap_sync_do_chunks(s);
+    } else {
+        trace_ram_sync_dirty_bitmaps(s->nr_chunks, s->thread_count + 1);
+        for (i = 0; i < s->thread_count; i++) {
+            qemu_sem_post(&s->sem);
+        }
+        bitmap_sync_do_chunks(s);
+        for (i = 0; i < s->thread_count; i++) {
+            qemu_sem_wait(&s->sem_done);
+        }
+    }
+    rs->migration_dirty_pages += s->dirty_pages;
+    rs->num_dirty_pages_period += s->real_dirty_pages;
+}
+
+/*
+ * Allocate the migration bitmap of a RAMBlock, with all the pages
+ * marked as dirty, and its summaries.
+ */
+static void ramblock_bitmap_new(RAMBlock *block, unsigned long pages)
+{
+    unsigned long words = BITS_TO_LONGS(pages);
+
+    block->bmap = bitmap_new(pages);
+    bitmap_set(block->bmap, 0, pages);
+    block->bmap_summary = bitmap_new(words);
+    block->bmap_summary_top = bitmap_new(BITS_TO_LONGS(words));
+    ramblock_dirty_summary_set_all(block, pages);
+}
+
+static void ramblock_bitmap_free(RAMBlock *block)
+{
+    g_free(block->bmap);
+    block->bmap = NULL;
+    g_free(block->bmap_summary);
+    block->bmap_summary = NULL;
+    g_free(block->bmap_summary_top);
+    block->bmap_summary_top = NULL;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -913,9 +1218,7 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
-        }
+        ram_sync_dirty_bitmaps(rs);
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
@@ -998,167 +1301,1026 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
     uint8_t *p = block->host + offset;
     int len = 0;
 
-    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
-        len += save_page_header(rs, file, block, offset | RAM_SAVE_FLAG_ZERO);
-        qemu_put_byte(file, 0);
-        len += 1;
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        len += save_page_header(rs, file, block, offset | RAM_SAVE_FLAG_ZERO);
+        qemu_put_byte(file, 0);
+        len += 1;
+    }
+    return len;
+}
+
+/**
+ * save_zero_page: send the zero page to the stream
+ *
+ * Returns the number of pages written.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+{
+    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+
+    if (len) {
+        ram_counters.duplicate++;
+        ram_counters.transferred += len;
+        return 1;
+    }
+    return -1;
+}
+
+static void ram_release_pages(const char *rbname, uint64_t offset, int pages)
+{
+    if (!migrate_release_ram() || !migration_in_postcopy()) {
+        return;
+    }
+
+    ram_discard_range(rbname, offset, ((ram_addr_t)pages) << TARGET_PAGE_BITS);
+}
+
+/*
+ * @pages: the number of pages written by the control path,
+ *        < 0 - error
+ *        > 0 - number of pages written
+ *
+ * Return true if the pages has been saved, otherwise false is returned.
+ */
+static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
+                              int *pages)
+{
+    uint64_t bytes_xmit = 0;
+    int ret;
+
+    *pages = -1;
+    ret = ram_control_save_page(rs->f, block->offset, offset, TARGET_PAGE_SIZE,
+                                &bytes_xmit);
+    if (ret == RAM_SAVE_CONTROL_NOT_SUPP) {
+        return false;
+    }
+
+    if (bytes_xmit) {
+        ram_counters.transferred += bytes_xmit;
+        *pages = 1;
+    }
+
+    if (ret == RAM_SAVE_CONTROL_DELAYED) {
+        return true;
+    }
+
+    if (bytes_xmit > 0) {
+        ram_counters.normal++;
+    } else if (bytes_xmit == 0) {
+        ram_counters.duplicate++;
+    }
+
+    return true;
+}
+
+/*
+ * directly send the page to the stream
+ *
+ * Returns the number of pages written.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @buf: the page to be sent
+ * @async: send to page asyncly
+ */
+static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
+                            uint8_t *buf, bool async)
+{
+    ram_counters.transferred += save_page_header(rs, rs->f, block,
+                                                 offset | RAM_SAVE_FLAG_PAGE);
+    if (async) {
+        qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
+                              migrate_release_ram() &
+                              migration_in_postcopy());
+    } else {
+        qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+    }
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+    return 1;
+}
+
+/**
+ * ram_save_page: send the given page to the stream
+ *
+ * Returns the number of pages written.
+ *          < 0 - error
+ *          >=0 - Number of pages written - this might legally be 0
+ *                if xbzrle noticed the page was the same.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
+{
+    int pages = -1;
+    uint8_t *p;
+    bool send_async = true;
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    ram_addr_t current_addr = block->offset + offset;
+
+    p = block->host + offset;
+    trace_ram_save_page(block->idstr, (uint64_t)offset, p);
+
+    XBZRLE_cache_lock();
+    if (!rs->ram_bulk_stage && !migration_in_postcopy() &&
+        migrate_use_xbzrle()) {
+        pages = save_xbzrle_page(rs, &p, current_addr, block,
+                                 offset, last_stage);
+        if (!last_stage) {
+            /* Can't send this cached data async, since the cache page
+             * might get updated before it gets to the wire
+             */
+            send_async = false;
+        }
+    }
+
+    /* XBZRLE overflow or normal page */
+    if (pages == -1) {
+        pages = save_normal_page(rs, block, offset, p, send_async);
+    }
+
+    XBZRLE_cache_unlock();
+
+    return pages;
+}
+
+static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
+                                 ram_addr_t offset)
+{
+    if (multifd_queue_page(rs->f, block, offset) < 0) {
+        return -1;
+    }
+    /*
+     * The multifd channels account the pages once they know whether
+     * they are zero pages or not, see multifd_send_sync_main().
+     */
+
+    return 1;
+}
+
+/*
+ * Mapped RAM
+ *
+ * With the mapped-ram capability the migration goes to a file, and every
+ * RAMBlock owns a region of it where each page is always stored at the
+ * same offset.  The region starts with a bitmap of the pages present in
+ * the file, followed by the pages, aligned so that they can be read
+ * straight into guest memory.  The stream itself carries no pages, just
+ * a header per RAMBlock pointing at its region, and the bitmaps are
+ * written out when RAM is complete.
+ *
+ * Pages are written by a pool of threads, each owning a fixed share of
+ * the MAPPED_RAM_CHUNK_SIZE chunks of the file, so that two writes of
+ * the same page are never reordered.  Loading splits each RAMBlock
+ * between a pool of threads as well.
+ *
+ * The pages go through a second channel on the file, opened by file.c,
+ * which may bypass the page cache; I/O that isn't aligned for that goes
+ * through the stream instead.
+ */
+#define MAPPED_RAM_HDR_VERSION            1
+#define MAPPED_RAM_HDR_SIZE               (4 + 3 * 8)
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT  (1 * MiB)
+#define MAPPED_RAM_CHUNK_SIZE             (1 * MiB)
+#define MAPPED_RAM_QUEUE_SIZE             64
+/* Smaller RAMBlocks are loaded by the incoming coroutine alone */
+#define MAPPED_RAM_LOAD_THREAD_MIN        (64 * MiB)
+
+typedef struct MappedRamState MappedRamState;
+
+typedef struct {
+    uint8_t *host;
+    off_t offset;
+    size_t len;
+} MappedRamWrite;
+
+typedef struct {
+    QemuThread thread;
+    MappedRamState *s;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* ring of pending writes, contiguous pages are merged */
+    MappedRamWrite queue[MAPPED_RAM_QUEUE_SIZE];
+    unsigned int head;
+    unsigned int count;
+    /* a write taken off the ring is in progress */
+    bool busy;
+    bool quit;
+} MappedRamWriter;
+
+struct MappedRamState {
+    QEMUFile *f;
+    /* second channel on the file for the pages, if any */
+    QEMUFile *pages_file;
+    MappedRamWriter *writers;
+    int nr_writers;
+    /* first error hit by a writer, as a negative errno */
+    int error;
+};
+
+static MappedRamState *mapped_ram_state;
+
+/* Pick the channel for page I/O of @len bytes between @buf and @offset */
+static QEMUFile *mapped_ram_file_for(QEMUFile *f, QEMUFile *pages_file,
+                                     const void *buf, off_t offset,
+                                     size_t len)
+{
+    uintptr_t mask = qemu_real_host_page_size - 1;
+
+    if (!pages_file) {
+        return f;
+    }
+    if (migrate_mapped_ram_direct_io() &&
+        (((uintptr_t)buf | (uintptr_t)offset | len) & mask)) {
+        return f;
+    }
+    return pages_file;
+}
+
+static void *mapped_ram_writer_thread(void *opaque)
+{
+    MappedRamWriter *w = opaque;
+    MappedRamWrite req;
+    QEMUFile *f;
+    Error *local_err = NULL;
+    int ret;
+
+    qemu_mutex_lock(&w->mutex);
+    while (true) {
+        while (!w->count && !w->quit) {
+            qemu_cond_wait(&w->cond, &w->mutex);
+        }
+        /* Pending writes are drained before quitting */
+        if (!w->count) {
+            break;
+        }
+        req = w->queue[w->head];
+        w->head = (w->head + 1) % MAPPED_RAM_QUEUE_SIZE;
+        w->count--;
+        w->busy = true;
+        qemu_cond_broadcast(&w->cond);
+        qemu_mutex_unlock(&w->mutex);
+
+        f = mapped_ram_file_for(w->s->f, w->s->pages_file, req.host,
+                                req.offset, req.len);
+        ret = qemu_put_buffer_at(f, req.host, req.len, req.offset,
+                                 &local_err);
+        if (ret < 0) {
+            if (atomic_cmpxchg(&w->s->error, 0, ret) == 0) {
+                error_report_err(local_err);
+            } else {
+                error_free(local_err);
+            }
+            local_err = NULL;
+        }
+
+        qemu_mutex_lock(&w->mutex);
+        w->busy = false;
+        qemu_cond_broadcast(&w->cond);
+    }
+    qemu_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+static void mapped_ram_queue_write(MappedRamState *s, uint8_t *host,
+                                   off_t offset, size_t len)
+{
+    MappedRamWriter *w;
+    MappedRamWrite *tail;
+
+    w = &s->writers[(offset / MAPPED_RAM_CHUNK_SIZE) % s->nr_writers];
+
+    qemu_mutex_lock(&w->mutex);
+    if (w->count) {
+        tail = &w->queue[(w->head + w->count - 1) % MAPPED_RAM_QUEUE_SIZE];
+        if (tail->host + tail->len == host &&
+            tail->offset + tail->len == offset &&
+            tail->len + len <= MAPPED_RAM_CHUNK_SIZE) {
+            tail->len += len;
+            goto out;
+        }
+    }
+
+    while (w->count == MAPPED_RAM_QUEUE_SIZE) {
+        qemu_cond_wait(&w->cond, &w->mutex);
+    }
+    tail = &w->queue[(w->head + w->count) % MAPPED_RAM_QUEUE_SIZE];
+    tail->host = host;
+    tail->offset = offset;
+    tail->len = len;
+    w->count++;
+    qemu_cond_broadcast(&w->cond);
+out:
+    qemu_mutex_unlock(&w->mutex);
+}
+
+/* Wait for all queued writes, returns the first error hit by a writer */
+static int mapped_ram_flush(MappedRamState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_writers; i++) {
+        MappedRamWriter *w = &s->writers[i];
+
+        qemu_mutex_lock(&w->mutex);
+        while (w->count || w->busy) {
+            qemu_cond_wait(&w->cond, &w->mutex);
+        }
+        qemu_mutex_unlock(&w->mutex);
+    }
+
+    return atomic_read(&s->error);
+}
+
+static void mapped_ram_save_setup(QEMUFile *f)
+{
+    MappedRamState *s = g_new0(MappedRamState, 1);
+    int i;
+
+    s->f = f;
+    s->pages_file = migrate_get_current()->mapped_ram_file;
+    s->nr_writers = MAX(migrate_mapped_ram_threads(), 1);
+    s->writers = g_new0(MappedRamWriter, s->nr_writers);
+    for (i = 0; i < s->nr_writers; i++) {
+        MappedRamWriter *w = &s->writers[i];
+
+        w->s = s;
+        qemu_mutex_init(&w->mutex);
+        qemu_cond_init(&w->cond);
+        qemu_thread_create(&w->thread, "mapped-ram-save",
+                           mapped_ram_writer_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+    mapped_ram_state = s;
+}
+
+static void mapped_ram_save_cleanup(void)
+{
+    MappedRamState *s = mapped_ram_state;
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    for (i = 0; i < s->nr_writers; i++) {
+        MappedRamWriter *w = &s->writers[i];
+
+        qemu_mutex_lock(&w->mutex);
+        w->quit = true;
+        qemu_cond_broadcast(&w->cond);
+        qemu_mutex_unlock(&w->mutex);
+        qemu_thread_join(&w->thread);
+        qemu_cond_destroy(&w->cond);
+        qemu_mutex_destroy(&w->mutex);
+    }
+    g_free(s->writers);
+    g_free(s);
+    mapped_ram_state = NULL;
+}
+
+static size_t mapped_ram_bitmap_size(ram_addr_t length)
+{
+    return BITS_TO_LONGS(length >> TARGET_PAGE_BITS) * sizeof(unsigned long);
+}
+
+/*
+ * Called after the id and length of @block are put in the stream, lays
+ * out its region of the file and points the stream past it.
+ */
+static void mapped_ram_setup_ramblock(QEMUFile *f, RAMBlock *block)
+{
+    off_t header_end = qemu_get_offset(f) + MAPPED_RAM_HDR_SIZE;
+
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+    block->bitmap_offset = header_end;
+    block->pages_offset = ROUND_UP(header_end +
+                                   mapped_ram_bitmap_size(block->used_length),
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    qemu_set_offset(f, block->pages_offset + block->used_length);
+}
+
+static int ram_save_mapped_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    MappedRamState *s = mapped_ram_state;
+    uint8_t *p = block->host + offset;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    int ret = atomic_read(&s->error);
+
+    if (ret) {
+        qemu_file_set_error(rs->f, ret);
+        return ret;
+    }
+
+    /*
+     * Zero pages are left out of the file, the destination clears the
+     * pages missing from the bitmap.  A write of older contents may
+     * still be queued, but it is never read back.
+     */
+    if (migrate_zero_page_detection() != ZERO_PAGE_DETECTION_NONE &&
+        is_zero_range(p, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    set_bit(page, block->file_bmap);
+    mapped_ram_queue_write(s, p, block->pages_offset + offset,
+                           TARGET_PAGE_SIZE);
+    /* Account the page as if it went through the stream */
+    qemu_file_credit_transfer(rs->f, TARGET_PAGE_SIZE);
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+
+    return 1;
+}
+
+/* Wait for the page writes, then store the bitmaps of present pages */
+static int mapped_ram_save_complete(QEMUFile *f)
+{
+    RAMBlock *block;
+    Error *local_err = NULL;
+    int ret;
+
+    ret = mapped_ram_flush(mapped_ram_state);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long *le_bitmap = bitmap_new(pages);
+
+        bitmap_to_le(le_bitmap, block->file_bmap, pages);
+        ret = qemu_put_buffer_at(f, (uint8_t *)le_bitmap,
+                                 mapped_ram_bitmap_size(block->used_length),
+                                 block->bitmap_offset, &local_err);
+        g_free(le_bitmap);
+        if (ret < 0) {
+            qemu_file_set_error_obj(f, ret, local_err);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+typedef struct {
+    QemuThread thread;
+    QEMUFile *f;
+    QEMUFile *pages_file;
+    RAMBlock *block;
+    unsigned long *bitmap;
+    /* pages [start, end) of the block are loaded by this thread */
+    unsigned long start;
+    unsigned long end;
+    off_t pages_offset;
+    int ret;
+} MappedRamLoader;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoader *l = opaque;
+    unsigned long page = l->start;
+    unsigned long run_end;
+    QEMUFile *f;
+    off_t offset;
+    size_t len;
+    Error *local_err = NULL;
+
+    while (page < l->end) {
+        uint8_t *host = l->block->host + (page << TARGET_PAGE_BITS);
+
+        if (!test_bit(page, l->bitmap)) {
+            /* Only touch the pages that need clearing */
+            run_end = find_next_bit(l->bitmap, l->end, page);
+            for (; page < run_end; page++, host += TARGET_PAGE_SIZE) {
+                if (!is_zero_range(host, TARGET_PAGE_SIZE)) {
+                    memset(host, 0, TARGET_PAGE_SIZE);
+                }
+            }
+            continue;
+        }
+
+        run_end = find_next_zero_bit(l->bitmap, l->end, page);
+        len = (run_end - page) << TARGET_PAGE_BITS;
+        offset = l->pages_offset + (page << TARGET_PAGE_BITS);
+        f = mapped_ram_file_for(l->f, l->pages_file, host, offset, len);
+        l->ret = qemu_get_buffer_at(f, host, len, offset, &local_err);
+        if (l->ret < 0) {
+            error_report_err(local_err);
+            break;
+        }
+        page = run_end;
+    }
+
+    return NULL;
+}
+
+static int mapped_ram_load_pages(QEMUFile *f, RAMBlock *block,
+                                 unsigned long *bitmap, off_t pages_offset)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    unsigned long per_thread;
+    MappedRamLoader *loaders;
+    int nr = 1;
+    int i, ret = 0;
+
+    if (block->used_length >= MAPPED_RAM_LOAD_THREAD_MIN) {
+        nr = MAX(migrate_mapped_ram_threads(), 1);
+    }
+    per_thread = DIV_ROUND_UP(pages, nr);
+
+    loaders = g_new0(MappedRamLoader, nr);
+    for (i = 0; i < nr; i++) {
+        MappedRamLoader *l = &loaders[i];
+
+        l->f = f;
+        l->pages_file = migration_incoming_get_current()->mapped_ram_file;
+        l->block = block;
+        l->bitmap = bitmap;
+        l->start = MIN(i * per_thread, pages);
+        l->end = MIN(l->start + per_thread, pages);
+        l->pages_offset = pages_offset;
+        if (nr == 1) {
+            mapped_ram_load_thread(l);
+        } else {
+            qemu_thread_create(&l->thread, "mapped-ram-load",
+                               mapped_ram_load_thread, l,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+    for (i = 0; i < nr; i++) {
+        if (nr > 1) {
+            qemu_thread_join(&loaders[i].thread);
+        }
+        if (loaders[i].ret < 0 && !ret) {
+            ret = loaders[i].ret;
+        }
+    }
+    g_free(loaders);
+
+    return ret;
+}
+
+/*
+ * Lazy restore
+ *
+ * With the mapped-ram-lazy cap the destination keeps the bitmap and the
+ * offset of each RAMBlock instead of reading its pages, then empties RAM
+ * and registers it with userfault as postcopy does.  The guest starts
+ * right away: a page it touches is read from the file by the postcopy
+ * fault thread, while a pool of threads reads the others in the
+ * background.  A host page is claimed by whoever places it, so that it
+ * is placed exactly once; a fault on a page claimed by a loader is left
+ * for the loader to wake up.
+ */
+typedef struct {
+    RAMBlock *block;
+    /* pages present in the file, and where they are stored */
+    unsigned long *bitmap;
+    off_t pages_offset;
+    /* host pages claimed by a loader or the fault thread */
+    unsigned long *claimed;
+} MappedRamLazyBlock;
+
+typedef struct {
+    QemuThread thread;
+    int id;
+} MappedRamLazyLoader;
+
+typedef struct {
+    QemuThread thread;
+    /* second channel on the file, taken over from the incoming state */
+    QEMUFile *f;
+    GArray *blocks;
+    MappedRamLazyLoader *loaders;
+    int nr_loaders;
+    /* bounce buffer of the fault thread */
+    uint8_t *fault_buf;
+    /* first error hit, as a negative errno */
+    int error;
+} MappedRamLazyState;
+
+static MappedRamLazyState *mapped_ram_lazy_state;
+
+static void mapped_ram_lazy_add(RAMBlock *block, unsigned long *bitmap,
+                                off_t pages_offset)
+{
+    MappedRamLazyState *s = mapped_ram_lazy_state;
+    MappedRamLazyBlock lb = {
+        .block = block,
+        .bitmap = bitmap,
+        .pages_offset = pages_offset,
+        .claimed = bitmap_new(block->used_length / block->page_size),
+    };
+
+    if (!s) {
+        s = g_new0(MappedRamLazyState, 1);
+        s->blocks = g_array_new(false, false, sizeof(MappedRamLazyBlock));
+        mapped_ram_lazy_state = s;
+    }
+    g_array_append_val(s->blocks, lb);
+}
+
+static void mapped_ram_lazy_free(void)
+{
+    MappedRamLazyState *s = mapped_ram_lazy_state;
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    for (i = 0; i < s->blocks->len; i++) {
+        MappedRamLazyBlock *lb = &g_array_index(s->blocks,
+                                                MappedRamLazyBlock, i);
+
+        g_free(lb->bitmap);
+        g_free(lb->claimed);
+    }
+    g_array_free(s->blocks, true);
+    if (s->f) {
+        qemu_fclose(s->f);
+    }
+    qemu_vfree(s->fault_buf);
+    g_free(s->loaders);
+    g_free(s);
+    mapped_ram_lazy_state = NULL;
+}
+
+static MappedRamLazyBlock *mapped_ram_lazy_find(RAMBlock *block)
+{
+    MappedRamLazyState *s = mapped_ram_lazy_state;
+    int i;
+
+    for (i = 0; i < s->blocks->len; i++) {
+        MappedRamLazyBlock *lb = &g_array_index(s->blocks,
+                                                MappedRamLazyBlock, i);
+
+        if (lb->block == block) {
+            return lb;
+        }
+    }
+    return NULL;
+}
+
+/* Returns true if the caller is the first to claim host page @hpage */
+static bool mapped_ram_lazy_claim(MappedRamLazyBlock *lb, unsigned long hpage)
+{
+    unsigned long mask = BIT_MASK(hpage);
+
+    return !(atomic_fetch_or(&lb->claimed[BIT_WORD(hpage)], mask) & mask);
+}
+
+/* Returns true if any target page of host page @hpage is in the file */
+static bool mapped_ram_lazy_present(MappedRamLazyBlock *lb,
+                                    unsigned long hpage)
+{
+    size_t pagesize = lb->block->page_size;
+    unsigned long first = (hpage * pagesize) >> TARGET_PAGE_BITS;
+    unsigned long last = first + (pagesize >> TARGET_PAGE_BITS);
+
+    return find_next_bit(lb->bitmap, last, first) < last;
+}
+
+/*
+ * Place @count host pages from @hpage, read through @buf, or zero pages
+ * if @buf is NULL.  The pages must have been claimed by the caller.
+ */
+static int mapped_ram_lazy_place(MappedRamLazyBlock *lb, unsigned long hpage,
+                                 unsigned long count, uint8_t *buf)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    MappedRamLazyState *s = mapped_ram_lazy_state;
+    RAMBlock *block = lb->block;
+    ram_addr_t offset = hpage * block->page_size;
+    size_t len = count * block->page_size;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    unsigned long end = (offset + len) >> TARGET_PAGE_BITS;
+    Error *local_err = NULL;
+    int ret;
+
+    if (!buf) {
+        return postcopy_place_pages_zero(mis, block->host + offset, len,
+                                         block);
+    }
+
+    ret = qemu_get_buffer_at(s->f, buf, len, lb->pages_offset + offset,
+                             &local_err);
+    if (ret < 0) {
+        error_report_err(local_err);
+        return ret;
+    }
+
+    /* The file may hold older contents of the pages left out of it */
+    for (page = find_next_zero_bit(lb->bitmap, end, page); page < end;
+         page = find_next_zero_bit(lb->bitmap, end, page + 1)) {
+        memset(buf + ((page << TARGET_PAGE_BITS) - offset), 0,
+               TARGET_PAGE_SIZE);
+    }
+
+    return postcopy_place_pages(mis, block->host + offset, buf, len, block);
+}
+
+/* Load host pages [start, end) of @lb, skipping those already claimed */
+static int mapped_ram_lazy_load_range(MappedRamLazyBlock *lb,
+                                      unsigned long start, unsigned long end,
+                                      uint8_t *buf, size_t buf_size)
+{
+    MappedRamLazyState *s = mapped_ram_lazy_state;
+    unsigned long max = buf_size / lb->block->page_size;
+    unsigned long hpage = start;
+    unsigned long count;
+    bool present;
+    int ret;
+
+    while (hpage < end && !atomic_read(&s->error)) {
+        if (!mapped_ram_lazy_claim(lb, hpage)) {
+            hpage++;
+            continue;
+        }
+
+        /* Grow the run while the pages are alike and still unclaimed */
+        present = mapped_ram_lazy_present(lb, hpage);
+        count = 1;
+        while (hpage + count < end && count < max &&
+               mapped_ram_lazy_present(lb, hpage + count) == present &&
+               mapped_ram_lazy_claim(lb, hpage + count)) {
+            count++;
+        }
+
+        ret = mapped_ram_lazy_place(lb, hpage, count, present ? buf : NULL);
+        if (ret) {
+            return ret;
+        }
+        hpage += count;
+    }
+
+    return 0;
+}
+
+static void *mapped_ram_lazy_load_thread(void *opaque)
+{
+    MappedRamLazyLoader *l = opaque;
+    MappedRamLazyState *s = mapped_ram_lazy_state;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    size_t buf_size = MAX(MAPPED_RAM_CHUNK_SIZE, mis->largest_page_size);
+    uint8_t *buf = qemu_memalign(qemu_real_host_page_size, buf_size);
+    unsigned long pages, per_thread, start, end;
+    int i, ret = 0;
+
+    for (i = 0; !ret && i < s->blocks->len; i++) {
+        MappedRamLazyBlock *lb = &g_array_index(s->blocks,
+                                                MappedRamLazyBlock, i);
+
+        pages = lb->block->used_length / lb->block->page_size;
+        if (lb->block->used_length < MAPPED_RAM_LOAD_THREAD_MIN) {
+            /* Smaller RAMBlocks are loaded by the first loader alone */
+            if (l->id) {
+                continue;
+            }
+            start = 0;
+            end = pages;
+        } else {
+            per_thread = DIV_ROUND_UP(pages, s->nr_loaders);
+            start = MIN(l->id * per_thread, pages);
+            end = MIN(start + per_thread, pages);
+        }
+
+        ret = mapped_ram_lazy_load_range(lb, start, end, buf, buf_size);
+        if (ret) {
+            atomic_cmpxchg(&s->error, 0, ret);
+        }
     }
-    return len;
+
+    qemu_vfree(buf);
+    return NULL;
 }
 
-/**
- * save_zero_page: send the zero page to the stream
- *
- * Returns the number of pages written.
- *
- * @rs: current RAM state
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
+/*
+ * Waits for the loaders, then turns userfault off and frees the state.
+ * There is no way back once the guest runs on the RAM being loaded, so
+ * errors are fatal as in the postcopy listen thread.
  */
-static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+static void *mapped_ram_lazy_thread(void *opaque)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    MappedRamLazyState *s = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int i;
 
-    if (len) {
-        ram_counters.duplicate++;
-        ram_counters.transferred += len;
-        return 1;
+    rcu_register_thread();
+
+    for (i = 0; i < s->nr_loaders; i++) {
+        qemu_thread_join(&s->loaders[i].thread);
     }
-    return -1;
+
+    trace_mapped_ram_lazy_end(atomic_read(&s->error));
+    if (atomic_read(&s->error)) {
+        error_report("Lazy restore of RAM failed: %s",
+                     strerror(-atomic_read(&s->error)));
+        exit(EXIT_FAILURE);
+    }
+
+    if (postcopy_ram_incoming_cleanup(mis)) {
+        error_report("%s: failed to clean up userfault", __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < s->blocks->len; i++) {
+        RAMBlock *block = g_array_index(s->blocks, MappedRamLazyBlock,
+                                        i).block;
+
+        g_free(block->receivedmap);
+        block->receivedmap = NULL;
+    }
+    atomic_mb_set(&mis->ram_lazy_load, false);
+    mapped_ram_lazy_free();
+
+    rcu_unregister_thread();
+    return NULL;
 }
 
-static void ram_release_pages(const char *rbname, uint64_t offset, int pages)
+/* Load the RAMBlocks kept by mapped_ram_lazy_add() now */
+static int mapped_ram_lazy_load_eagerly(QEMUFile *f)
 {
-    if (!migrate_release_ram() || !migration_in_postcopy()) {
-        return;
+    MappedRamLazyState *s = mapped_ram_lazy_state;
+    int i, ret = 0;
+
+    for (i = 0; !ret && i < s->blocks->len; i++) {
+        MappedRamLazyBlock *lb = &g_array_index(s->blocks,
+                                                MappedRamLazyBlock, i);
+
+        ret = mapped_ram_load_pages(f, lb->block, lb->bitmap,
+                                    lb->pages_offset);
     }
+    mapped_ram_lazy_free();
 
-    ram_discard_range(rbname, offset, ((ram_addr_t)pages) << TARGET_PAGE_BITS);
+    return ret;
 }
 
 /*
- * @pages: the number of pages written by the control path,
- *        < 0 - error
- *        > 0 - number of pages written
- *
- * Return true if the pages has been saved, otherwise false is returned.
+ * Called once the stream went past all the RAMBlocks, sets RAM up to be
+ * faulted in and starts loading it in the background.
  */
-static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
-                              int *pages)
+static int mapped_ram_lazy_start(QEMUFile *f)
 {
-    uint64_t bytes_xmit = 0;
-    int ret;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    MappedRamLazyState *s = mapped_ram_lazy_state;
+    int i;
 
-    *pages = -1;
-    ret = ram_control_save_page(rs->f, block->offset, offset, TARGET_PAGE_SIZE,
-                                &bytes_xmit);
-    if (ret == RAM_SAVE_CONTROL_NOT_SUPP) {
-        return false;
+    if (!mis->mapped_ram_file) {
+        warn_report("Lazy restore needs a file: migration, "
+                    "loading RAM now");
+        return mapped_ram_lazy_load_eagerly(f);
     }
+    /* Other processes mapping the RAM wouldn't wait for the pages */
+    for (i = 0; i < s->blocks->len; i++) {
+        RAMBlock *block = g_array_index(s->blocks, MappedRamLazyBlock,
+                                        i).block;
 
-    if (bytes_xmit) {
-        ram_counters.transferred += bytes_xmit;
-        *pages = 1;
+        if (qemu_ram_is_shared(block)) {
+            warn_report("Lazy restore doesn't support shared RAM block %s, "
+                        "loading RAM now", block->idstr);
+            return mapped_ram_lazy_load_eagerly(f);
+        }
     }
 
-    if (ret == RAM_SAVE_CONTROL_DELAYED) {
-        return true;
+    s->f = mis->mapped_ram_file;
+    mis->mapped_ram_file = NULL;
+    s->nr_loaders = MAX(migrate_mapped_ram_threads(), 1);
+    s->fault_buf = qemu_memalign(qemu_real_host_page_size,
+                                 mis->largest_page_size);
+
+    /* The fault thread must not wait for a return path */
+    atomic_mb_set(&mis->ram_lazy_load, true);
+    if (postcopy_ram_incoming_lazy_setup(mis)) {
+        postcopy_ram_incoming_cleanup(mis);
+        atomic_mb_set(&mis->ram_lazy_load, false);
+        mapped_ram_lazy_free();
+        return -EINVAL;
     }
 
-    if (bytes_xmit > 0) {
-        ram_counters.normal++;
-    } else if (bytes_xmit == 0) {
-        ram_counters.duplicate++;
+    trace_mapped_ram_lazy_start(s->blocks->len, s->nr_loaders);
+    s->loaders = g_new0(MappedRamLazyLoader, s->nr_loaders);
+    for (i = 0; i < s->nr_loaders; i++) {
+        s->loaders[i].id = i;
+        qemu_thread_create(&s->loaders[i].thread, "mapped-ram-load",
+                           mapped_ram_lazy_load_thread, &s->loaders[i],
+                           QEMU_THREAD_JOINABLE);
     }
+    qemu_thread_create(&s->thread, "mapped-ram-lazy", mapped_ram_lazy_thread,
+                       s, QEMU_THREAD_DETACHED);
 
-    return true;
+    return 0;
 }
 
 /*
- * directly send the page to the stream
- *
- * Returns the number of pages written.
- *
- * @rs: current RAM state
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- * @buf: the page to be sent
- * @async: send to page asyncly
+ * Called by the postcopy fault thread for a fault at @offset of @rb
+ * during a lazy restore, reads the host page in unless a loader is at
+ * it already.
  */
-static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
-                            uint8_t *buf, bool async)
+int ram_load_lazy_fault(RAMBlock *rb, ram_addr_t offset)
 {
-    ram_counters.transferred += save_page_header(rs, rs->f, block,
-                                                 offset | RAM_SAVE_FLAG_PAGE);
-    if (async) {
-        qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
-                              migrate_release_ram() &
-                              migration_in_postcopy());
-    } else {
-        qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+    MappedRamLazyState *s = mapped_ram_lazy_state;
+    MappedRamLazyBlock *lb = mapped_ram_lazy_find(rb);
+    unsigned long hpage = offset / rb->page_size;
+    int ret;
+
+    if (!lb) {
+        error_report("%s: RAM block %s is not being loaded", __func__,
+                     rb->idstr);
+        return -EINVAL;
     }
-    ram_counters.transferred += TARGET_PAGE_SIZE;
-    ram_counters.normal++;
-    return 1;
+
+    trace_ram_load_lazy_fault(rb->idstr, offset);
+    if (!mapped_ram_lazy_claim(lb, hpage)) {
+        return 0;
+    }
+
+    ret = mapped_ram_lazy_place(lb, hpage, 1,
+                                mapped_ram_lazy_present(lb, hpage) ?
+                                s->fault_buf : NULL);
+    if (ret) {
+        atomic_cmpxchg(&s->error, 0, ret);
+    }
+    return ret;
 }
 
-/**
- * ram_save_page: send the given page to the stream
- *
- * Returns the number of pages written.
- *          < 0 - error
- *          >=0 - Number of pages written - this might legally be 0
- *                if xbzrle noticed the page was the same.
- *
- * @rs: current RAM state
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- * @last_stage: if we are at the completion stage
+/*
+ * Called after the id and length of @block are read from the stream,
+ * loads its pages from the file, or keeps what is needed to load them
+ * lazily, and points the stream past its region.
  */
-static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
+static int mapped_ram_load_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
 {
-    int pages = -1;
-    uint8_t *p;
-    bool send_async = true;
-    RAMBlock *block = pss->block;
-    ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
-    ram_addr_t current_addr = block->offset + offset;
-
-    p = block->host + offset;
-    trace_ram_save_page(block->idstr, (uint64_t)offset, p);
+    uint32_t version = qemu_get_be32(f);
+    uint64_t page_size = qemu_get_be64(f);
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t pages_offset = qemu_get_be64(f);
+    unsigned long pages = length >> TARGET_PAGE_BITS;
+    unsigned long *le_bitmap, *bitmap;
+    Error *local_err = NULL;
+    int ret;
 
-    XBZRLE_cache_lock();
-    if (!rs->ram_bulk_stage && !migration_in_postcopy() &&
-        migrate_use_xbzrle()) {
-        pages = save_xbzrle_page(rs, &p, current_addr, block,
-                                 offset, last_stage);
-        if (!last_stage) {
-            /* Can't send this cached data async, since the cache page
-             * might get updated before it gets to the wire
-             */
-            send_async = false;
-        }
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_report("Unsupported mapped-ram version %u for RAM block %s",
+                     version, block->idstr);
+        return -EINVAL;
     }
-
-    /* XBZRLE overflow or normal page */
-    if (pages == -1) {
-        pages = save_normal_page(rs, block, offset, p, send_async);
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mapped-ram page size %" PRIu64 " for RAM block %s "
+                     "does not match %d", page_size, block->idstr,
+                     TARGET_PAGE_SIZE);
+        return -EINVAL;
     }
 
-    XBZRLE_cache_unlock();
-
-    return pages;
-}
+    /* Shared memory is not migrated, its region is empty */
+    if (!ramblock_is_ignored(block)) {
+        le_bitmap = bitmap_new(pages);
+        ret = qemu_get_buffer_at(f, (uint8_t *)le_bitmap,
+                                 mapped_ram_bitmap_size(length),
+                                 bitmap_offset, &local_err);
+        if (ret < 0) {
+            error_report_err(local_err);
+            g_free(le_bitmap);
+            return ret;
+        }
+        bitmap = bitmap_new(pages);
+        bitmap_from_le(bitmap, le_bitmap, pages);
+        g_free(le_bitmap);
 
-static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
-                                 ram_addr_t offset)
-{
-    if (multifd_queue_page(rs->f, block, offset) < 0) {
-        return -1;
+        if (migrate_mapped_ram_lazy()) {
+            mapped_ram_lazy_add(block, bitmap, pages_offset);
+        } else {
+            ret = mapped_ram_load_pages(f, block, bitmap, pages_offset);
+            g_free(bitmap);
+            if (ret < 0) {
+                return ret;
+            }
+        }
     }
-    ram_counters.normal++;
 
-    return 1;
+    return qemu_set_offset(f, pages_offset + length);
 }
 
 static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
@@ -1520,6 +2682,24 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
         return -1;
     }
 
+    /*
+     * The guest is likely to touch the pages right after the one it
+     * faulted on, so send a few of them along with it.  Pages that were
+     * already sent are skipped by get_queued_page().  This is only done
+     * when the preempt channel keeps the prefetched pages from delaying
+     * other faults, and is limited in bytes so that huge pages do not
+     * prefetch at all.
+     */
+    if (migrate_postcopy_preempt()) {
+        size_t pagesize = qemu_ram_pagesize(ramblock);
+        ram_addr_t prefetch;
+
+        prefetch = MIN((ram_addr_t)migrate_postcopy_prefetch_pages() *
+                       pagesize, POSTCOPY_PREFETCH_MAX_BYTES);
+        len += QEMU_ALIGN_DOWN(prefetch, pagesize);
+        len = MIN(len, ramblock->used_length - start);
+    }
+
     struct RAMSrcPageRequest *new_entry =
         g_malloc0(sizeof(struct RAMSrcPageRequest));
     new_entry->rb = ramblock;
@@ -1607,11 +2787,28 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(rs, block, offset);
+    }
+
     if (save_compress_page(rs, block, offset)) {
         return 1;
     }
 
-    res = save_zero_page(rs, block, offset);
+    /*
+     * With multifd the channel threads look for zero pages themselves,
+     * which keeps the migration thread from becoming the bottleneck.
+     */
+    if (migrate_multifd_zero_page() && !save_page_use_compression(rs) &&
+        !migration_in_postcopy()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
+    if (migrate_zero_page_detection() == ZERO_PAGE_DETECTION_NONE) {
+        res = -1;
+    } else {
+        res = save_zero_page(rs, block, offset);
+    }
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
          * page would be stale
@@ -1694,6 +2891,67 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     return pages;
 }
 
+/**
+ * postcopy_preempt_active: whether requested pages go on a separate channel
+ *
+ * The channel is not re-established on postcopy recovery, so once it
+ * breaks requested pages go on the main channel again.
+ */
+static bool postcopy_preempt_active(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return migrate_postcopy_preempt() && migration_in_postcopy() &&
+           s->postcopy_qemufile_src &&
+           !qemu_file_get_error(s->postcopy_qemufile_src);
+}
+
+/**
+ * ram_save_host_page_urgent: send a requested host page on the preempt
+ *   channel
+ *
+ * The page is followed by an EOS marker, so that the destination drops
+ * the RCU read lock between requests.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_host_page_urgent(RAMState *rs, PageSearchStatus *pss,
+                                     bool last_stage)
+{
+    MigrationState *s = migrate_get_current();
+    QEMUFile *main_file = rs->f;
+    RAMBlock *main_last_sent_block = rs->last_sent_block;
+    int pages, ret;
+
+    rs->f = s->postcopy_qemufile_src;
+    rs->last_sent_block = rs->postcopy_preempt_last_sent_block;
+
+    pages = ram_save_host_page(rs, pss, last_stage);
+    qemu_put_be64(rs->f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(rs->f);
+    ret = qemu_file_get_error(rs->f);
+    trace_ram_save_host_page_urgent(pss->block->idstr, pss->page, pages);
+
+    rs->postcopy_preempt_last_sent_block = rs->last_sent_block;
+    rs->last_sent_block = main_last_sent_block;
+    rs->f = main_file;
+
+    if (ret) {
+        /*
+         * The page may be lost, pause postcopy so that recovery resends
+         * whatever the destination did not receive.
+         */
+        qemu_file_set_error(rs->f, ret);
+        return ret;
+    }
+
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -1732,6 +2990,11 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         again = true;
         found = get_queued_page(rs, &pss);
 
+        if (found && postcopy_preempt_active()) {
+            pages = ram_save_host_page_urgent(rs, &pss, last_stage);
+            continue;
+        }
+
         if (!found) {
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(rs, &pss, &again);
@@ -1836,10 +3099,16 @@ static void ram_save_cleanup(void *opaque)
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
         block->clear_bmap = NULL;
-        g_free(block->bmap);
-        block->bmap = NULL;
+        ramblock_bitmap_free(block);
+    }
+
+    mapped_ram_save_cleanup();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
+    bitmap_sync_threads_cleanup();
     xbzrle_cleanup();
     compress_threads_save_cleanup();
     ram_state_cleanup(rsp);
@@ -1849,6 +3118,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->postcopy_preempt_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
@@ -2046,6 +3316,7 @@ static void postcopy_chunk_hostpages_pass(MigrationState *ms, RAMBlock *block)
                  * that weren't previously dirty.
                  */
                 rs->migration_dirty_pages += !test_and_set_bit(page, bitmap);
+                ramblock_dirty_summary_set(block, BIT_WORD(page));
             }
         }
 
@@ -2277,8 +3548,7 @@ static void ram_list_init_bitmaps(void)
              * dirty_memory[DIRTY_MEMORY_MIGRATION] don't include the whole
              * guest memory.
              */
-            block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
+            ramblock_bitmap_new(block, pages);
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
         }
@@ -2311,6 +3581,7 @@ static int ram_init_all(RAMState **rsp)
         return -1;
     }
 
+    bitmap_sync_threads_setup();
     ram_init_bitmaps(*rsp);
 
     return 0;
@@ -2337,6 +3608,7 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->postcopy_preempt_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     /*
@@ -2431,6 +3703,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
     (*rsp)->f = f;
 
+    if (migrate_mapped_ram()) {
+        mapped_ram_save_setup(f);
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -2445,6 +3721,24 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram()) {
+                mapped_ram_setup_ramblock(f, block);
+            }
+            if (migrate_local_update()) {
+                bool passed = ramblock_is_fd_passed(block);
+
+                qemu_put_byte(f, passed);
+                if (passed) {
+                    int ret = qemu_file_send_fd(f, block->fd);
+
+                    if (ret < 0) {
+                        error_report("Failed to pass RAM block %s: %s",
+                                     block->idstr, strerror(-ret));
+                        return ret;
+                    }
+                    trace_ram_save_pass_fd(block->idstr, block->fd);
+                }
+            }
         }
     }
 
@@ -2607,6 +3901,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
         flush_compressed_data(rs);
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+
+        if (ret >= 0 && migrate_mapped_ram()) {
+            ret = mapped_ram_save_complete(f);
+        }
     }
 
     if (ret >= 0) {
@@ -2645,6 +3943,15 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
     } else {
         *res_precopy_only += remaining_size;
     }
+
+    /*
+     * The non-iterable device state is sent while the guest is stopped
+     * as well, both when completing and when switching to postcopy, so
+     * it has to fit in the downtime together with the remaining RAM.
+     */
+    if (!migration_in_postcopy()) {
+        *res_precopy_only += qemu_savevm_non_iterable_size();
+    }
 }
 
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
@@ -2688,12 +3995,16 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * Returns a pointer from within the RCU-protected ram_list.
  *
+ * @mis: the incoming migration state
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel the page comes from, RAM_CHANNEL_*
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -2720,6 +4031,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    mis->last_recv_block[channel] = block;
     return block;
 }
 
@@ -2753,6 +4065,7 @@ static inline void *colo_cache_from_block_offset(RAMBlock *block,
     if (!test_and_set_bit(offset >> TARGET_PAGE_BITS, block->bmap)) {
         ram_state->migration_dirty_pages++;
     }
+    ramblock_dirty_summary_set(block, BIT_WORD(offset >> TARGET_PAGE_BITS));
     return block->colo_cache + offset;
 }
 
@@ -3001,8 +4314,7 @@ int colo_init_ram_cache(void)
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
             unsigned long pages = block->max_length >> TARGET_PAGE_BITS;
 
-            block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
+            ramblock_bitmap_new(block, pages);
         }
     }
     ram_state = g_new0(RAMState, 1);
@@ -3020,8 +4332,7 @@ void colo_release_ram_cache(void)
 
     memory_global_dirty_log_stop();
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        g_free(block->bmap);
-        block->bmap = NULL;
+        ramblock_bitmap_free(block);
     }
 
     WITH_RCU_READ_LOCK_GUARD() {
@@ -3068,9 +4379,12 @@ static int ram_load_cleanup(void *opaque)
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
 
-    RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
-        g_free(rb->receivedmap);
-        rb->receivedmap = NULL;
+    /* A lazy restore still marks the pages it places, it frees them */
+    if (!atomic_read(&migration_incoming_get_current()->ram_lazy_load)) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
+            g_free(rb->receivedmap);
+            rb->receivedmap = NULL;
+        }
     }
 
     return 0;
@@ -3097,19 +4411,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the pages it receives.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the channel @f belongs to, RAM_CHANNEL_*
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = mis->postcopy_tmp_pages[channel];
     void *this_host = NULL;
     bool all_zero = false;
     int target_pages = 0;
@@ -3141,7 +4457,7 @@ static int ram_load_postcopy(QEMUFile *f)
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3327,6 +4643,41 @@ static void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+/*
+ * Destination side of local-update: replace the memory of 'block' with the
+ * one the source passed, if it did.  Both sides must agree on which blocks
+ * are passed, or part of the guest RAM would never arrive.
+ */
+static int ram_load_passed_fd(QEMUFile *f, RAMBlock *block)
+{
+    Error *local_err = NULL;
+    bool passed = qemu_get_byte(f);
+    int fd;
+
+    if (passed != ramblock_is_fd_passed(block)) {
+        error_report("RAM block %s is %sbacked by a shared file on the "
+                     "source but %son the destination", block->idstr,
+                     passed ? "" : "not ", passed ? "not " : "");
+        return -EINVAL;
+    }
+    if (!passed) {
+        return 0;
+    }
+
+    fd = qemu_file_recv_fd(f);
+    if (fd < 0) {
+        error_report("Failed to receive RAM block %s", block->idstr);
+        return fd;
+    }
+    trace_ram_load_passed_fd(block->idstr, fd);
+
+    if (qemu_ram_remap_fd(block, fd, &local_err) < 0) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+    return 0;
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3339,6 +4690,7 @@ static void colo_flush_ram_cache(void)
  */
 static int ram_load_precopy(QEMUFile *f)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     int flags = 0, ret = 0, invalid_flags = 0, len = 0, i = 0;
     /* ADVISE is earlier, it shows the source has the postcopy capability on */
     bool postcopy_advised = postcopy_is_advised();
@@ -3377,7 +4729,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             /*
              * After going into COLO, we should load the Page into colo_cache.
@@ -3451,6 +4804,12 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_ramblock(f, block, length);
+                    }
+                    if (!ret && migrate_local_update()) {
+                        ret = ram_load_passed_fd(f, block);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3461,6 +4820,13 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            if (mapped_ram_lazy_state) {
+                if (!ret) {
+                    ret = mapped_ram_lazy_start(f);
+                } else {
+                    mapped_ram_lazy_free();
+                }
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -3536,7 +4902,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -3666,6 +5032,7 @@ int ram_dirty_bitmap_reload(MigrationState *s, RAMBlock *block)
      * dirty bitmap for this ramblock.
      */
     bitmap_complement(block->bmap, block->bmap, nbits);
+    ramblock_dirty_summary_set_all(block, nbits);
 
     trace_ram_dirty_bitmap_reload_complete(block->idstr);
 
@@ -52,6 +52,8 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 /* For incoming postcopy discard */
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+int ram_load_postcopy(QEMUFile *f, int channel);
+int ram_load_lazy_fault(RAMBlock *rb, ram_addr_t offset);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
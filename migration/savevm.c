@@ -246,6 +246,11 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* Time spent and bytes used saving and loading the state */
+    uint64_t save_time_us;
+    uint64_t save_bytes;
+    uint64_t load_time_us;
+    uint64_t load_bytes;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -258,6 +263,10 @@ typedef struct SaveState {
     uint32_t caps_count;
     MigrationCapability *capabilities;
     QemuUUID uuid;
+    /* Estimated size of the non-iterable device state */
+    uint64_t non_iterable_estimate;
+    /* Size of the non-iterable device state when it was last saved */
+    uint64_t non_iterable_bytes;
 } SaveState;
 
 static SaveState savevm_state = {
@@ -884,6 +893,20 @@ static int vmstate_load(QEMUFile *f, SaveStateEntry *se)
     return vmstate_load_state(f, se->vmsd, se->opaque, se->load_version_id);
 }
 
+/* vmstate_load() that adds to the load statistics of @se */
+static int vmstate_load_timed(QEMUFile *f, SaveStateEntry *se)
+{
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    off_t start_pos = qemu_get_offset(f);
+    int ret;
+
+    ret = vmstate_load(f, se);
+    se->load_time_us += qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time;
+    se->load_bytes += qemu_get_offset(f) - start_pos;
+
+    return ret;
+}
+
 static void vmstate_save_old_style(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
 {
     int64_t old_offset, size;
@@ -1185,6 +1208,70 @@ void qemu_savevm_state_setup(QEMUFile *f)
     }
 }
 
+/*
+ * Called with the iothread lock when an outgoing migration starts.
+ * Clears the save statistics of the devices, and estimates how much
+ * non-iterable device state will be sent while the guest is stopped.
+ */
+void qemu_savevm_device_stats_start(void)
+{
+    SaveStateEntry *se;
+    uint64_t estimate = 0;
+
+    /* Only a measurement from this migration is meaningful */
+    savevm_state.non_iterable_bytes = 0;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->save_time_us = 0;
+        se->save_bytes = 0;
+
+        if (!se->vmsd || !vmstate_save_needed(se->vmsd, se->opaque)) {
+            continue;
+        }
+        /* Section header and footer */
+        estimate += 1 + 4 + 1 + strlen(se->idstr) + 4 + 4 + 1 + 4;
+        estimate += vmstate_size_estimate(se->vmsd, se->opaque);
+    }
+    savevm_state.non_iterable_estimate = estimate;
+}
+
+/*
+ * Size of the non-iterable device state, as estimated when the migration
+ * started or as measured when it was last saved, whichever is larger.
+ */
+uint64_t qemu_savevm_non_iterable_size(void)
+{
+    return MAX(savevm_state.non_iterable_estimate,
+               savevm_state.non_iterable_bytes);
+}
+
+/* Save and load statistics of the devices, for query-migrate */
+VMStateDeviceStatsList *qemu_savevm_device_stats(void)
+{
+    VMStateDeviceStatsList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        VMStateDeviceStatsList *entry;
+
+        if (!se->save_bytes && !se->load_bytes) {
+            continue;
+        }
+        entry = g_new0(VMStateDeviceStatsList, 1);
+        entry->value = g_new0(VMStateDeviceStats, 1);
+        entry->value->name = g_strdup(se->idstr);
+        entry->value->instance_id = se->instance_id;
+        entry->value->save_time = se->save_time_us;
+        entry->value->save_bytes = se->save_bytes;
+        entry->value->load_time = se->load_time_us;
+        entry->value->load_bytes = se->load_bytes;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 int qemu_savevm_state_resume_prepare(MigrationState *s)
 {
     SaveStateEntry *se;
@@ -1321,6 +1408,7 @@ static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
     SaveStateEntry *se;
+    int64_t start_time, start_pos;
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1338,6 +1426,8 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_pos = qemu_ftell_fast(f);
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
@@ -1347,6 +1437,9 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
             qemu_file_set_error(f, ret);
             return -1;
         }
+        se->save_time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                           start_time;
+        se->save_bytes = qemu_ftell_fast(f) - start_pos;
     }
 
     return 0;
@@ -1360,6 +1453,8 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     g_autoptr(QJSON) vmdesc = NULL;
     int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start_time, start_pos;
+    uint64_t total_bytes = 0;
     int ret;
 
     vmdesc = qjson_new();
@@ -1381,6 +1476,8 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         json_prop_str(vmdesc, "name", se->idstr);
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
+        start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_pos = qemu_ftell_fast(f);
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
@@ -1389,9 +1486,14 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
+        se->save_time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                           start_time;
+        se->save_bytes = qemu_ftell_fast(f) - start_pos;
+        total_bytes += se->save_bytes;
 
         json_end_object(vmdesc);
     }
+    savevm_state.non_iterable_bytes = total_bytes;
 
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
@@ -2296,7 +2398,7 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
-    ret = vmstate_load(f, se);
+    ret = vmstate_load_timed(f, se);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%"PRIx32" of"
                      " device '%s'", instance_id, idstr);
@@ -2336,7 +2438,7 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
-    ret = vmstate_load(f, se);
+    ret = vmstate_load_timed(f, se);
     if (ret < 0) {
         error_report("error while loading state section id %d(%s)",
                      section_id, se->idstr);
@@ -2534,6 +2636,7 @@ int qemu_loadvm_state(QEMUFile *f)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
     Error *local_err = NULL;
+    SaveStateEntry *se;
     int ret;
 
     if (qemu_savevm_state_blocked(&local_err)) {
@@ -2546,6 +2649,11 @@ int qemu_loadvm_state(QEMUFile *f)
         return ret;
     }
 
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->load_time_us = 0;
+        se->load_bytes = 0;
+    }
+
     if (qemu_loadvm_state_setup(f) != 0) {
         return -EINVAL;
     }
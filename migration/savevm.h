@@ -31,6 +31,9 @@
 
 bool qemu_savevm_state_blocked(Error **errp);
 void qemu_savevm_state_setup(QEMUFile *f);
+void qemu_savevm_device_stats_start(void);
+uint64_t qemu_savevm_non_iterable_size(void);
+VMStateDeviceStatsList *qemu_savevm_device_stats(void);
 bool qemu_savevm_state_guest_unplug_pending(void);
 int qemu_savevm_state_resume_prepare(MigrationState *s);
 void qemu_savevm_state_header(QEMUFile *f);
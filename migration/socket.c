@@ -39,6 +39,21 @@ void socket_send_channel_create(QIOTaskFunc f, void *data)
                                      f, data, NULL, NULL);
 }
 
+/*
+ * Whether socket_send_channel_create() can open more channels to the
+ * destination, which only the socket transports know the address of.
+ */
+bool socket_send_channel_usable(void)
+{
+    return outgoing_args.saddr != NULL;
+}
+
+void socket_send_channel_reset(void)
+{
+    qapi_free_SocketAddress(outgoing_args.saddr);
+    outgoing_args.saddr = NULL;
+}
+
 int socket_send_channel_destroy(QIOChannel *send)
 {
     /* Remove channel */
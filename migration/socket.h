@@ -21,6 +21,8 @@
 #include "io/task.h"
 
 void socket_send_channel_create(QIOTaskFunc f, void *data);
+bool socket_send_channel_usable(void);
+void socket_send_channel_reset(void);
 int socket_send_channel_destroy(QIOChannel *send);
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp);
@@ -75,6 +75,55 @@ static void vmstate_handle_alloc(void *ptr, const VMStateField *field,
     }
 }
 
+/*
+ * Arrays of plain integers are moved with qemu_{put,get}_be_array(),
+ * which converts whole spans in the file buffer instead of calling the
+ * info hooks once per element.  Returns the element width if 'field'
+ * qualifies, 0 otherwise.
+ */
+static size_t vmstate_bulk_width(const VMStateField *field, int n_elems,
+                                 int size)
+{
+    size_t width;
+
+    if (n_elems < 2 ||
+        field->flags & (VMS_STRUCT | VMS_VSTRUCT | VMS_ARRAY_OF_POINTER)) {
+        return 0;
+    }
+    if (field->info == &vmstate_info_int8 ||
+        field->info == &vmstate_info_uint8) {
+        width = 1;
+    } else if (field->info == &vmstate_info_int16 ||
+               field->info == &vmstate_info_uint16) {
+        width = 2;
+    } else if (field->info == &vmstate_info_int32 ||
+               field->info == &vmstate_info_uint32) {
+        width = 4;
+    } else if (field->info == &vmstate_info_int64 ||
+               field->info == &vmstate_info_uint64) {
+        width = 8;
+    } else {
+        return 0;
+    }
+    return size == width ? width : 0;
+}
+
+/*
+ * Load the whole of a bulk eligible array; returns the number of elements
+ * handled, i.e. 0 if the field has to go through the per element loop.
+ */
+static int vmstate_load_bulk(QEMUFile *f, const VMStateField *field,
+                             void *first_elem, int n_elems, int size)
+{
+    size_t width = vmstate_bulk_width(field, n_elems, size);
+
+    if (!width) {
+        return 0;
+    }
+    qemu_get_be_array(f, first_elem, n_elems, width);
+    return n_elems;
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
@@ -123,7 +172,17 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                 first_elem = *(void **)first_elem;
                 assert(first_elem || !n_elems || !size);
             }
-            for (i = 0; i < n_elems; i++) {
+            i = vmstate_load_bulk(f, field, first_elem, n_elems, size);
+            if (i) {
+                ret = qemu_file_get_error(f);
+                if (ret < 0) {
+                    error_report("Failed to load %s:%s", vmsd->name,
+                                 field->name);
+                    trace_vmstate_load_field_error(field->name, ret);
+                    return ret;
+                }
+            }
+            for (; i < n_elems; i++) {
                 void *curr_elem = first_elem + size * i;
 
                 if (field->flags & VMS_ARRAY_OF_POINTER) {
@@ -304,6 +363,33 @@ static void vmsd_desc_field_end(const VMStateDescription *vmsd, QJSON *vmdesc,
     json_end_object(vmdesc);
 }
 
+/*
+ * Save counterpart of vmstate_load_bulk(); the vmdesc entries are emitted
+ * exactly as the per element loop would.
+ */
+static int vmstate_save_bulk(QEMUFile *f, const VMStateDescription *vmsd,
+                             const VMStateField *field, void *first_elem,
+                             int n_elems, int size, QJSON *vmdesc)
+{
+    size_t width = vmstate_bulk_width(field, n_elems, size);
+    int i;
+
+    if (!width) {
+        return 0;
+    }
+    qemu_put_be_array(f, first_elem, n_elems, width);
+
+    for (i = 0; vmdesc && i < n_elems; i++) {
+        vmsd_desc_field_start(vmsd, vmdesc, field, i, n_elems);
+        vmsd_desc_field_end(vmsd, vmdesc, field, width, i);
+        /* Compressed arrays only care about the first element */
+        if (vmsd_can_compress(field)) {
+            vmdesc = NULL;
+        }
+    }
+    return n_elems;
+}
+
 
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 {
@@ -360,7 +446,9 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
                 first_elem = *(void **)first_elem;
                 assert(first_elem || !n_elems || !size);
             }
-            for (i = 0; i < n_elems; i++) {
+            i = vmstate_save_bulk(f, vmsd, field, first_elem, n_elems, size,
+                                  vmdesc_loop);
+            for (; i < n_elems; i++) {
                 void *curr_elem = first_elem + size * i;
                 ret = 0;
 
@@ -428,6 +516,74 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
     return ret;
 }
 
+static uint64_t vmstate_size_estimate_v(const VMStateDescription *vmsd,
+                                        void *opaque, int version_id)
+{
+    const VMStateField *field = vmsd->fields;
+    const VMStateDescription **sub = vmsd->subsections;
+    uint64_t total = 0;
+
+    for (; field->name; field++) {
+        void *first_elem = opaque + field->offset;
+        int i, n_elems, size;
+
+        if (!((field->field_exists &&
+               field->field_exists(opaque, version_id)) ||
+              (!field->field_exists &&
+               field->version_id <= version_id))) {
+            continue;
+        }
+
+        n_elems = vmstate_n_elems(opaque, field);
+        size = vmstate_size(opaque, field);
+        if (field->flags & VMS_POINTER) {
+            first_elem = *(void **)first_elem;
+            if (!first_elem) {
+                continue;
+            }
+        }
+        if (!(field->flags & (VMS_STRUCT | VMS_VSTRUCT))) {
+            total += (uint64_t)size * n_elems;
+            continue;
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *curr_elem = first_elem + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                curr_elem = *(void **)curr_elem;
+                if (!curr_elem) {
+                    continue;
+                }
+            }
+            total += vmstate_size_estimate_v(field->vmsd, curr_elem,
+                                             field->flags & VMS_VSTRUCT ?
+                                             field->struct_version_id :
+                                             field->vmsd->version_id);
+        }
+    }
+
+    for (; sub && *sub; sub++) {
+        if (vmstate_save_needed(*sub, opaque)) {
+            /* QEMU_VM_SUBSECTION, name length, name and version */
+            total += 1 + 1 + strlen((*sub)->name) + 4;
+            total += vmstate_size_estimate_v(*sub, opaque, (*sub)->version_id);
+        }
+    }
+
+    return total;
+}
+
+/*
+ * Rough size of what vmstate_save_state() would write for @opaque,
+ * without running any pre_save hook.  Fields with their own VMStateInfo
+ * are counted with their declared size, so variable sized ones such as
+ * queues are underestimated.  Must be called with the iothread lock.
+ */
+uint64_t vmstate_size_estimate(const VMStateDescription *vmsd, void *opaque)
+{
+    return vmstate_size_estimate_v(vmsd, opaque, vmsd->version_id);
+}
+
 static const VMStateDescription *
 vmstate_get_subsection(const VMStateDescription **sub, char *idstr)
 {
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,46 +25,103 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/*
+ * The encoders below only differ in how they find the end of a run,
+ * so that all of them produce exactly the same stream.  Both helpers
+ * return the length of the run that starts at the beginning of the
+ * buffers, at most @len bytes.
+ */
+
+/* Length of the run of bytes that are the same in both buffers */
+static inline int xbzrle_zrun_int(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int len)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
+    int i = 0;
     long res;
-    uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
+    /* not aligned to sizeof(long) */
+    res = len % sizeof(long);
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
 
-    while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
+    /* word at a time for speed */
+    if (!res) {
+        while (i < len &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
+        /* go over the rest */
+        while (i < len && old_buf[i] == new_buf[i]) {
             i++;
-            res--;
         }
+    }
 
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+    return i;
+}
+
+/* Length of the run of bytes that differ between both buffers */
+static inline int xbzrle_nzrun_int(const uint8_t *old_buf,
+                                   const uint8_t *new_buf, int len)
+{
+    int i = 0;
+    long res;
+
+    /* not aligned to sizeof(long) */
+    res = len % sizeof(long);
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < len) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
                 i += sizeof(long);
-                zrun_len += sizeof(long);
             }
+        }
+    }
 
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
+    return i;
+}
+
+static inline int QEMU_ALWAYS_INLINE
+xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+              uint8_t *dst, int dlen,
+              int (*zrun)(const uint8_t *, const uint8_t *, int),
+              int (*nzrun)(const uint8_t *, const uint8_t *, int))
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0;
+    uint8_t *nzrun_start;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
         }
 
+        zrun_len = zrun(old_buf + i, new_buf + i, slen - i);
+        i += zrun_len;
+
         /* buffer unchanged */
         if (zrun_len == slen) {
             return 0;
@@ -76,42 +134,15 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = nzrun(old_buf + i, new_buf + i, slen - i);
+        i += nzrun_len;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -120,12 +151,215 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
 }
 
+static int xbzrle_encode_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_int, xbzrle_nzrun_int);
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline int xbzrle_zrun_avx2(const uint8_t *old_buf,
+                                   const uint8_t *new_buf, int len)
+{
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq != UINT32_MAX) {
+            return i + ctz32(~eq);
+        }
+    }
+
+    return i + xbzrle_zrun_int(old_buf + i, new_buf + i, len - i);
+}
+
+static inline int xbzrle_nzrun_avx2(const uint8_t *old_buf,
+                                    const uint8_t *new_buf, int len)
+{
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+
+    return i + xbzrle_nzrun_int(old_buf + i, new_buf + i, len - i);
+}
+
+static int xbzrle_encode_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_avx2, xbzrle_nzrun_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static inline int xbzrle_zrun_avx512(const uint8_t *old_buf,
+                                     const uint8_t *new_buf, int len)
+{
+    int i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+
+        if (eq != UINT64_MAX) {
+            return i + ctz64(~eq);
+        }
+    }
+
+    return i + xbzrle_zrun_int(old_buf + i, new_buf + i, len - i);
+}
+
+static inline int xbzrle_nzrun_avx512(const uint8_t *old_buf,
+                                      const uint8_t *new_buf, int len)
+{
+    int i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+
+        if (eq) {
+            return i + ctz64(eq);
+        }
+    }
+
+    return i + xbzrle_nzrun_int(old_buf + i, new_buf + i, len - i);
+}
+
+static int xbzrle_encode_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_avx512, xbzrle_nzrun_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/*
+ * Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+typedef int (*XBZRLEEncodeFn)(uint8_t *, uint8_t *, int, uint8_t *, int);
+
+static unsigned cpuid_cache, cpuid_cache_init;
+static XBZRLEEncodeFn encode_accel = xbzrle_encode_int;
+static const char *encode_accel_name = "int";
+
+static void init_accel(unsigned cache)
+{
+    XBZRLEEncodeFn fn = xbzrle_encode_int;
+    const char *name = "int";
+
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_avx2;
+        name = "avx2";
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_avx512;
+        name = "avx512bw";
+    }
+#endif
+    encode_accel = fn;
+    encode_accel_name = name;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* AVX-512 also needs the opmask and upper ZMM state.  */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cpuid_cache_init = cache;
+    init_accel(cache);
+}
+#endif
+
+void test_xbzrle_encode_reset_accel(void)
+{
+    cpuid_cache = cpuid_cache_init;
+    init_accel(cpuid_cache);
+}
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /*
+     * If no bits set, we just tested xbzrle_encode_int, and there
+     * are no more acceleration options to test.
+     */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+const char *test_xbzrle_encode_accel_name(void)
+{
+    return encode_accel_name;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -2545,6 +2545,16 @@ static int img_convert(int argc, char **argv)
         s.unallocated_blocks_are_zero = bdi.unallocated_blocks_are_zero;
     }
 
+    if (s.compressed) {
+        /*
+         * Compression happens in the write request, so writing in order
+         * would compress one cluster at a time.  Let every coroutine have a
+         * compressed write in flight if the format allows it, and stay
+         * sequential otherwise, even with -W.
+         */
+        s.wr_in_order = !bdi.unordered_compressed_writes;
+    }
+
     ret = convert_do_copy(&s);
 out:
     if (!ret) {
@@ -568,6 +568,7 @@ int main(int argc, char *argv[])
     int fd = -1;
 
     module_call_init(MODULE_INIT_QOM);
+    module_call_init(MODULE_INIT_MIGRATION);
 
     monitor_init_globals();
 
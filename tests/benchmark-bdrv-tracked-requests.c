@@ -0,0 +1,153 @@
+/*
+ * Tracked request overhead benchmark
+ *
+ * Measures the cost of serialising requests while a growing number of other
+ * requests is in flight on the same node.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+
+#define REQ_SIZE    4096
+#define NB_OPS      (64 * 1024)
+
+typedef struct BDRVParkState {
+    CoQueue parked;
+    bool park;
+} BDRVParkState;
+
+/* Reads stay in flight until the benchmark releases them */
+static int coroutine_fn bdrv_park_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVParkState *s = bs->opaque;
+
+    if (s->park) {
+        qemu_co_queue_wait(&s->parked, NULL);
+    }
+    return 0;
+}
+
+static int coroutine_fn bdrv_park_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    return 0;
+}
+
+static BlockDriver bdrv_park = {
+    .format_name            = "park",
+    .instance_size          = sizeof(BDRVParkState),
+
+    .bdrv_co_preadv         = bdrv_park_co_preadv,
+    .bdrv_co_pwritev        = bdrv_park_co_pwritev,
+};
+
+typedef struct BenchRequest {
+    BlockBackend *blk;
+    int64_t offset;
+} BenchRequest;
+
+static uint8_t buf[REQ_SIZE];
+
+static void coroutine_fn parked_read_entry(void *opaque)
+{
+    BenchRequest *req = opaque;
+
+    blk_co_pread(req->blk, req->offset, REQ_SIZE, buf, 0);
+}
+
+static void coroutine_fn serialising_write_entry(void *opaque)
+{
+    BenchRequest *req = opaque;
+    int i, ret;
+
+    for (i = 0; i < NB_OPS; i++) {
+        ret = blk_co_pwrite(req->blk, req->offset, REQ_SIZE, buf,
+                            BDRV_REQ_SERIALISING);
+        g_assert_cmpint(ret, ==, 0);
+    }
+}
+
+static void test_tracked_requests_speed(const void *opaque)
+{
+    int depth = GPOINTER_TO_INT(opaque);
+    BenchRequest *reqs = g_new(BenchRequest, depth);
+    BenchRequest write_req;
+    BlockBackend *blk;
+    BlockDriverState *bs;
+    BDRVParkState *s;
+    Coroutine *co;
+    int i;
+
+    blk = blk_new(qemu_get_aio_context(), BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_park, "park", BDRV_O_RDWR, &error_abort);
+    bs->total_sectors = (depth + 1) * REQ_SIZE / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+
+    s = bs->opaque;
+    qemu_co_queue_init(&s->parked);
+    s->park = true;
+
+    /* Fill the queue with requests that do not overlap the writes */
+    for (i = 0; i < depth; i++) {
+        reqs[i] = (BenchRequest) {
+            .blk    = blk,
+            .offset = (int64_t)i * REQ_SIZE,
+        };
+        co = qemu_coroutine_create(parked_read_entry, &reqs[i]);
+        qemu_coroutine_enter(co);
+    }
+    g_assert(!QLIST_EMPTY(&bs->tracked_requests));
+
+    write_req = (BenchRequest) {
+        .blk    = blk,
+        .offset = (int64_t)depth * REQ_SIZE,
+    };
+    co = qemu_coroutine_create(serialising_write_entry, &write_req);
+
+    g_test_timer_start();
+    qemu_coroutine_enter(co);
+    g_test_timer_elapsed();
+
+    g_print("depth %d: %.1f ns per serialising request ", depth,
+            g_test_timer_last() * 1e9 / NB_OPS);
+
+    s->park = false;
+    while (qemu_co_enter_next(&s->parked, NULL)) {
+        /* Complete all parked reads */
+    }
+    g_assert(QLIST_EMPTY(&bs->tracked_requests));
+
+    bdrv_unref(bs);
+    blk_unref(blk);
+    g_free(reqs);
+}
+
+int main(int argc, char **argv)
+{
+    char name[64];
+    int depth;
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (depth = 1; depth <= 4096; depth *= 4) {
+        snprintf(name, sizeof(name), "/bdrv/tracked-requests/speed-%d",
+                 depth);
+        g_test_add_data_func(name, GINT_TO_POINTER(depth),
+                             test_tracked_requests_speed);
+    }
+
+    return g_test_run();
+}
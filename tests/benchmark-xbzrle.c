@@ -0,0 +1,67 @@
+/*
+ * XBZRLE encoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+
+static void encode_speed(int stride)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    const size_t total = 4 * GiB;
+    size_t remain;
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, PAGE_SIZE);
+    /* one changed byte every @stride bytes */
+    for (i = 0; i < PAGE_SIZE; i += stride) {
+        new[i] ^= 1;
+    }
+
+    g_test_timer_start();
+    remain = total;
+    while (remain) {
+        xbzrle_encode_buffer(old, new, PAGE_SIZE, compressed, PAGE_SIZE);
+        remain -= PAGE_SIZE;
+    }
+    g_test_timer_elapsed();
+
+    g_print("xbzrle %s: ", test_xbzrle_encode_accel_name());
+    g_print("encode %zu GB, 1 byte changed every %d bytes ", total / GiB,
+            stride);
+    g_print("%.2f MB/sec\n", (double)total / MiB / g_test_timer_last());
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
+static void test_encode_speed(void)
+{
+    int stride;
+
+    /* From the most to the least preferred encoder */
+    do {
+        for (stride = 64; stride <= PAGE_SIZE; stride *= 4) {
+            encode_speed(stride);
+        }
+    } while (test_xbzrle_encode_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/encode/speed", test_encode_speed);
+
+    return g_test_run();
+}
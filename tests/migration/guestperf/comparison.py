@@ -121,4 +121,18 @@ COMPARISONS = [
         Scenario("compr-xbzrle-cache-50",
                  compression_xbzrle=True, compression_xbzrle_cache=50),
     ]),
+
+
+    # Looking at effect of spreading the dirty bitmap sync
+    # over varying numbers of threads; needs a large guest
+    Comparison("bitmap-sync", scenarios = [
+        Scenario("bitmap-sync-threads-1",
+                 bitmap_sync_threads=1),
+        Scenario("bitmap-sync-threads-2",
+                 bitmap_sync_threads=2),
+        Scenario("bitmap-sync-threads-4",
+                 bitmap_sync_threads=4),
+        Scenario("bitmap-sync-threads-8",
+                 bitmap_sync_threads=8),
+    ]),
 ]
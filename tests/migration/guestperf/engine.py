@@ -310,8 +310,10 @@ class Engine(object):
 
         return argv
 
-    def _get_src_args(self, hardware):
-        return self._get_common_args(hardware)
+    def _get_src_args(self, hardware, scenario):
+        argv = self._get_common_args(hardware)
+        return argv + ["-global", "migration.x-bitmap-sync-threads=%d" %
+                       scenario._bitmap_sync_threads]
 
     def _get_dst_args(self, hardware, uri):
         tunnelled = False
@@ -386,7 +388,7 @@ class Engine(object):
         srcmonaddr = "/var/tmp/qemu-src-%d-monitor.sock" % os.getpid()
 
         src = QEMUMachine(self._binary,
-                          args=self._get_src_args(hardware),
+                          args=self._get_src_args(hardware, scenario),
                           wrapper=self._get_src_wrapper(hardware),
                           name="qemu-src-%d" % os.getpid(),
                           monitor_address=srcmonaddr)
@@ -14,6 +14,7 @@
 
 #include "libqtest.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -200,9 +201,81 @@ static void read_blocktime(QTestState *who)
 
     rsp_return = migrate_query(who);
     g_assert(qdict_haskey(rsp_return, "postcopy-blocktime"));
+    g_assert(qdict_haskey(rsp_return, "postcopy-latency-histogram"));
     qobject_unref(rsp_return);
 }
 
+/*
+ * Check the device statistics of the side that saved (@saved) or loaded
+ * the state in the last migration, and return them.
+ */
+static QList *read_device_stats(QTestState *who, bool saved)
+{
+    QDict *rsp_return;
+    QList *stats;
+    const QListEntry *entry;
+    int64_t total_time = 0;
+
+    rsp_return = migrate_query(who);
+    g_assert(qdict_haskey(rsp_return, "device-stats"));
+    stats = qdict_get_qlist(rsp_return, "device-stats");
+    g_assert(!qlist_empty(stats));
+    qobject_ref(stats);
+    qobject_unref(rsp_return);
+
+    QLIST_FOREACH_ENTRY(stats, entry) {
+        QDict *dev = qobject_to(QDict, qlist_entry_obj(entry));
+
+        g_assert(qdict_haskey(dev, "name"));
+        g_assert(qdict_haskey(dev, "instance-id"));
+        g_assert(qdict_haskey(dev, "save-time"));
+        g_assert(qdict_haskey(dev, "save-bytes"));
+        g_assert(qdict_haskey(dev, "load-time"));
+        g_assert(qdict_haskey(dev, "load-bytes"));
+
+        g_assert_cmpint(qdict_get_int(dev, saved ? "save-bytes"
+                                                 : "load-bytes"), >, 0);
+        total_time += qdict_get_int(dev, saved ? "save-time" : "load-time");
+    }
+    /* Small devices can take less than the microsecond that is reported */
+    g_assert_cmpint(total_time, >, 0);
+
+    return stats;
+}
+
+/*
+ * @first and @second are the statistics of a VM after it loaded its
+ * state and after it saved it again.  Saving must have been measured
+ * for every device, without losing what was measured when loading.
+ */
+static void check_device_stats_fresh(QList *first, QList *second)
+{
+    const QListEntry *entry, *entry2;
+
+    QLIST_FOREACH_ENTRY(first, entry) {
+        QDict *dev = qobject_to(QDict, qlist_entry_obj(entry));
+
+        g_assert_cmpint(qdict_get_int(dev, "save-bytes"), ==, 0);
+        g_assert_cmpint(qdict_get_int(dev, "save-time"), ==, 0);
+    }
+
+    QLIST_FOREACH_ENTRY(second, entry) {
+        QDict *dev = qobject_to(QDict, qlist_entry_obj(entry));
+
+        QLIST_FOREACH_ENTRY(first, entry2) {
+            QDict *dev2 = qobject_to(QDict, qlist_entry_obj(entry2));
+
+            if (g_str_equal(qdict_get_str(dev, "name"),
+                            qdict_get_str(dev2, "name")) &&
+                qdict_get_int(dev, "instance-id") ==
+                qdict_get_int(dev2, "instance-id")) {
+                g_assert_cmpint(qdict_get_int(dev, "load-bytes"), ==,
+                                qdict_get_int(dev2, "load-bytes"));
+            }
+        }
+    }
+}
+
 static void wait_for_migration_pass(QTestState *who)
 {
     uint64_t initial_pass = get_migration_pass(who);
@@ -466,6 +539,8 @@ typedef struct {
     bool use_shmem;
     /* only launch the target process */
     bool only_target;
+    /* send requested pages on a separate channel during postcopy */
+    bool postcopy_preempt;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -648,6 +723,7 @@ static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
 
     cleanup("bootsect");
     cleanup("migsocket");
+    cleanup("migfile");
     cleanup("src_serial");
     cleanup("dest_serial");
 }
@@ -704,6 +780,7 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
@@ -714,6 +791,11 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -761,6 +843,20 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -842,8 +938,10 @@ static void test_baddest(void)
 static void test_precopy_unix(void)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    char *uri2;
     MigrateStart *args = migrate_start_new();
-    QTestState *from, *to;
+    QTestState *from, *to, *to2;
+    QList *stats, *stats2;
 
     if (test_migrate_start(&from, &to, uri, args)) {
         return;
@@ -877,7 +975,37 @@ static void test_precopy_unix(void)
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
 
-    test_migrate_end(from, to, true);
+    qobject_unref(read_device_stats(from, true));
+    stats = read_device_stats(to, false);
+
+    /*
+     * Migrate the destination on to a third VM.  Its statistics must now
+     * report what it saved, while the new destination only loaded state.
+     */
+    args = migrate_start_new();
+    args->only_target = true;
+    uri2 = g_strdup_printf("unix:%s/migsocket2", tmpfs);
+    if (test_migrate_start(&from, &to2, uri2, args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(to, "downtime-limit", 300);
+    migrate_set_parameter_int(to, "max-bandwidth", 1000000000);
+    migrate_qmp(to, uri2, "{}");
+    qtest_qmp_eventwait(to2, "RESUME");
+    wait_for_migration_complete(to);
+
+    stats2 = read_device_stats(to, true);
+    check_device_stats_fresh(stats, stats2);
+    qobject_unref(read_device_stats(to2, false));
+    qobject_unref(stats);
+    qobject_unref(stats2);
+
+    qtest_quit(to);
+    cleanup("migsocket2");
+    g_free(uri2);
+
+    test_migrate_end(from, to2, true);
     g_free(uri);
 }
 
@@ -919,6 +1047,46 @@ static void test_ignore_shared(void)
 }
 #endif
 
+static void test_local_update(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->use_shmem = true;
+    if (test_migrate_start(&from, &to, uri, args)) {
+        g_free(uri);
+        return;
+    }
+
+    migrate_set_capability(from, "local-update", "true");
+    migrate_set_capability(to, "local-update", "true");
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /*
+     * Guest RAM went over as a file descriptor, only ROMs, video memory
+     * and device state were copied.
+     */
+    g_assert_cmpint(read_ram_property_int(from, "transferred"), <,
+                    32 * 1024 * 1024);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 static void test_xbzrle(const char *uri)
 {
     MigrateStart *args = migrate_start_new();
@@ -1261,7 +1429,99 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(void)
+static void do_test_mapped_ram_file(MigrateStart *args, bool lazy)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /*
+     * Let the guest dirty pages again while RAM is being saved, so that
+     * pages are written more than once at their place in the file.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+    if (lazy) {
+        /* The guest runs before its RAM is read, check it below */
+        migrate_set_capability(to, "mapped-ram-lazy", true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    /* The file is complete, restore it on the destination */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_mapped_ram_file(void)
+{
+    do_test_mapped_ram_file(migrate_start_new(), false);
+}
+
+static void test_mapped_ram_file_lazy(void)
+{
+    do_test_mapped_ram_file(migrate_start_new(), true);
+}
+
+static void test_mapped_ram_file_direct_io(void)
+{
+    MigrateStart *args;
+    int fd = -1;
+#ifdef O_DIRECT
+    char *path = g_strdup_printf("%s/migfile", tmpfs);
+
+    fd = open(path, O_CREAT | O_WRONLY | O_DIRECT, 0600);
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(path);
+    g_free(path);
+#endif
+    if (fd < 0) {
+        g_test_skip("Direct I/O is not supported on the test directory");
+        return;
+    }
+
+    args = migrate_start_new();
+    g_free(args->opts_source);
+    g_free(args->opts_target);
+    args->opts_source = g_strdup("-global migration.x-mapped-ram-direct-io=on");
+    args->opts_target = g_strdup("-global migration.x-mapped-ram-direct-io=on");
+    do_test_mapped_ram_file(args, false);
+}
+
+static void test_multifd_tcp(const char *method, const char *zero_page,
+                             bool zero_copy)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1285,9 +1545,18 @@ static void test_multifd_tcp(void)
     migrate_set_parameter_int(from, "multifd-channels", 16);
     migrate_set_parameter_int(to, "multifd-channels", 16);
 
+    migrate_set_parameter_str(from, "multifd-compression", method);
+    migrate_set_parameter_str(to, "multifd-compression", method);
+
+    migrate_set_parameter_str(from, "zero-page-detection", zero_page);
+
     migrate_set_capability(from, "multifd", "true");
     migrate_set_capability(to, "multifd", "true");
 
+    if (zero_copy) {
+        migrate_set_capability(from, "zero-copy-send", "true");
+    }
+
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
                            "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
@@ -1316,6 +1585,35 @@ static void test_multifd_tcp(void)
     g_free(uri);
 }
 
+static void test_multifd_tcp_none(void)
+{
+    test_multifd_tcp("none", "multifd", false);
+}
+
+static void test_multifd_tcp_zero_page_legacy(void)
+{
+    test_multifd_tcp("none", "legacy", false);
+}
+
+static void test_multifd_tcp_zlib(void)
+{
+    test_multifd_tcp("zlib", "multifd", false);
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_tcp_zstd(void)
+{
+    test_multifd_tcp("zstd", "multifd", false);
+}
+#endif
+
+#ifdef CONFIG_LINUX
+static void test_multifd_tcp_zero_copy(void)
+{
+    test_multifd_tcp("none", "multifd", true);
+}
+#endif
+
 /*
  * This test does:
  *  source               target
@@ -1462,12 +1760,14 @@ int main(int argc, char **argv)
     module_call_init(MODULE_INIT_QOM);
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
+    qtest_add_func("/migration/local-update/unix", test_local_update);
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
@@ -1478,8 +1778,23 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
-    qtest_add_func("/migration/multifd/tcp", test_multifd_tcp);
+    qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zero-page/legacy",
+                   test_multifd_tcp_zero_page_legacy);
+    qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
+#endif
+#ifdef CONFIG_LINUX
+    qtest_add_func("/migration/multifd/tcp/zero-copy",
+                   test_multifd_tcp_zero_copy);
+#endif
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
+    qtest_add_func("/migration/mapped-ram/file", test_mapped_ram_file);
+    qtest_add_func("/migration/mapped-ram/file/lazy",
+                   test_mapped_ram_file_lazy);
+    qtest_add_func("/migration/mapped-ram/file/direct-io",
+                   test_mapped_ram_file_direct_io);
 
     ret = g_test_run();
 
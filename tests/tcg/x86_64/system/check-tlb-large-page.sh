@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Run the tlb-large-page test and compare the large page flush counters
+# reported by the HMP "info jit" command with the ones that the guest
+# expects.
+#
+# usage: check-tlb-large-page.sh TEST QEMU [QEMU_OPTS...]
+#
+# QEMU_OPTS must end with -kernel, the test binary is appended to it.
+#
+# SPDX-License-Identifier: GPL-2.0-or-later
+
+test="$1"
+qemu="$2"
+shift 2
+
+rm -f "$test.out"
+
+# Only query the counters once the guest is done with its invlpg.  If
+# the guest fails, isa-debug-exit makes QEMU exit with a non-zero status.
+monitor=$({
+    until grep -q -e "^Test complete" -e "FAIL" "$test.out" 2>/dev/null; do
+        sleep 0.1
+    done
+    echo "info jit"
+    echo "quit"
+} | "$qemu" -display none -no-shutdown -monitor stdio \
+    -chardev file,path="$test.out",id=output "$@" "$test") || exit 1
+
+grep -q "^Test complete: PASSED" "$test.out" || exit 1
+
+monitor=$(echo "$monitor" | tr -d '\r')
+full=$(echo "$monitor" | sed -n 's/.*TLB large page full flushes *//p')
+part=$(echo "$monitor" | sed -n 's/.*TLB large page partial flushes *//p')
+expected=$(sed -n 's/^Expected large page flushes: //p' "$test.out")
+
+if [ "full $full partial $part" != "$expected" ]; then
+    echo "large page flushes: got full $full partial $part," \
+         "expected $expected" >&2
+    exit 1
+fi
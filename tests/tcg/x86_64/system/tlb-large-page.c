@@ -0,0 +1,129 @@
+/*
+ * Large page TLB flush test
+ *
+ * The boot code identity maps the first 4G with 2M pages.  Touch a
+ * few of them, then repeatedly invalidate single 4k pages within the
+ * first one with invlpg and check that memory (both in the flushed
+ * large page and in its neighbours) still reads back correctly.
+ *
+ * Softmmu tracks the most recent large pages individually, so each of
+ * these invlpg should only evict the entries of the large page it hits.
+ * Then touch more large pages than softmmu can track, so that the first
+ * one is folded into the untracked region, where invlpg has to flush
+ * the whole TLB.
+ *
+ * The guest runs with a single mmu_idx, so every invlpg of a large page
+ * counts as exactly one full or partial flush.  At the end the expected
+ * counts are printed, and the run rule compares them with the "TLB large
+ * page" counters of the HMP "info jit" command.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <minilib.h>
+
+#define PAGE_SIZE       4096
+#define LARGE_PAGE_SIZE (2 * 1024 * 1024)
+#define NR_LARGE_PAGES  4
+#define ITERATIONS      4096
+
+/* More than CPU_TLB_LARGE_PAGES, the number of tracked large pages */
+#define NR_UNTRACKED_PAGES  16
+#define UNTRACKED_ROUNDS    64
+
+__attribute__((aligned(LARGE_PAGE_SIZE)))
+static uint8_t test_data[NR_LARGE_PAGES * LARGE_PAGE_SIZE];
+
+__attribute__((aligned(LARGE_PAGE_SIZE)))
+static uint8_t untracked_data[NR_UNTRACKED_PAGES * LARGE_PAGE_SIZE];
+
+static int expected_full, expected_part;
+
+static inline void invlpg(void *addr)
+{
+    asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
+static void init_pages(void)
+{
+    int i;
+
+    for (i = 0; i < NR_LARGE_PAGES * LARGE_PAGE_SIZE; i += PAGE_SIZE) {
+        test_data[i] = (uint8_t) (i / PAGE_SIZE);
+    }
+}
+
+static bool check_pages(void)
+{
+    int i;
+
+    for (i = 0; i < NR_LARGE_PAGES * LARGE_PAGE_SIZE; i += PAGE_SIZE) {
+        if (test_data[i] != (uint8_t) (i / PAGE_SIZE)) {
+            ml_printf("FAIL: page at offset %d contains %d\n",
+                      i, test_data[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* invlpg within a tracked large page only evicts that large page */
+static bool test_tracked(void)
+{
+    int i;
+
+    ml_printf("Testing invlpg on tracked large pages\n");
+
+    init_pages();
+    for (i = 0; i < ITERATIONS; i++) {
+        int offset = (i * PAGE_SIZE) % LARGE_PAGE_SIZE;
+
+        invlpg(&test_data[offset]);
+        expected_part++;
+        test_data[offset] = (uint8_t) (offset / PAGE_SIZE);
+        if (!check_pages()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* invlpg within a large page that is no longer tracked flushes everything */
+static bool test_untracked(void)
+{
+    int i, j;
+
+    ml_printf("Testing invlpg on untracked large pages\n");
+
+    for (i = 0; i < UNTRACKED_ROUNDS; i++) {
+        for (j = 0; j < NR_UNTRACKED_PAGES; j++) {
+            untracked_data[j * LARGE_PAGE_SIZE] = (uint8_t) (i + j);
+        }
+
+        invlpg(&untracked_data[0]);
+        expected_full++;
+
+        for (j = 0; j < NR_UNTRACKED_PAGES; j++) {
+            if (untracked_data[j * LARGE_PAGE_SIZE] != (uint8_t) (i + j)) {
+                ml_printf("FAIL: large page %d contains %d\n",
+                          j, untracked_data[j * LARGE_PAGE_SIZE]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    if (!test_tracked() || !test_untracked()) {
+        return 1;
+    }
+
+    ml_printf("Expected large page flushes: full %d partial %d\n",
+              expected_full, expected_part);
+    ml_printf("Test complete: PASSED\n");
+    return 0;
+}
@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "block/block.h"
 #include "block/blockjob_int.h"
+#include "block/raw-aio.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
@@ -738,6 +739,80 @@ static void test_attach_preserve_blk_ctx(void)
     blk_unref(blk);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static bool test_buf_registered(AioContext *ctx, void *buf)
+{
+    return luring_buf_registered(aio_get_linux_io_uring(ctx, false), buf);
+}
+
+/*
+ * Buffers registered with io_uring belong to the ring of the node's
+ * AioContext, so they have to move to the new ring with the node.
+ */
+static void test_attach_io_uring_buf(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *ctx = iothread_get_aio_context(iothread);
+    AioContext *main_ctx = qemu_get_aio_context();
+    Error *local_err = NULL;
+    BlockBackend *blk;
+    QDict *options;
+    char *path;
+    uint8_t *buf;
+    int fd, ret;
+
+    fd = g_file_open_tmp("qemu-test-block-iothread-XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, 65536);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    options = qdict_new();
+    qdict_put_str(options, "driver", "file");
+    qdict_put_str(options, "filename", path);
+    qdict_put_str(options, "aio", "io_uring");
+    blk = blk_new_open(NULL, NULL, options, BDRV_O_RDWR, &local_err);
+    if (!blk) {
+        /* The kernel may not support io_uring */
+        error_free(local_err);
+        g_test_skip("io_uring is not available");
+        goto out;
+    }
+
+    buf = qemu_memalign(4096, 65536);
+    memset(buf, 0xa5, 4096);
+    blk_register_buf(blk, buf, 65536);
+    g_assert(test_buf_registered(main_ctx, buf));
+
+    blk_set_aio_context(blk, ctx, &error_abort);
+    g_assert(!test_buf_registered(main_ctx, buf));
+    g_assert(test_buf_registered(ctx, buf));
+
+    /* Both requests lie within the registered buffer */
+    aio_context_acquire(ctx);
+    ret = blk_pwrite(blk, 0, buf, 4096, 0);
+    g_assert_cmpint(ret, ==, 4096);
+    memset(buf + 4096, 0, 4096);
+    ret = blk_pread(blk, 0, buf + 4096, 4096);
+    g_assert_cmpint(ret, ==, 4096);
+    g_assert(!memcmp(buf, buf + 4096, 4096));
+
+    blk_set_aio_context(blk, main_ctx, &error_abort);
+    aio_context_release(ctx);
+    g_assert(!test_buf_registered(ctx, buf));
+    g_assert(test_buf_registered(main_ctx, buf));
+
+    blk_unregister_buf(blk, buf);
+    g_assert(!test_buf_registered(main_ctx, buf));
+
+    blk_unref(blk);
+    qemu_vfree(buf);
+out:
+    unlink(path);
+    g_free(path);
+}
+#endif
+
 int main(int argc, char **argv)
 {
     int i;
@@ -755,6 +830,9 @@ int main(int argc, char **argv)
     g_test_add_func("/attach/blockjob", test_attach_blockjob);
     g_test_add_func("/attach/second_node", test_attach_second_node);
     g_test_add_func("/attach/preserve_blk_ctx", test_attach_preserve_blk_ctx);
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_func("/attach/io_uring_buf", test_attach_io_uring_buf);
+#endif
     g_test_add_func("/propagate/basic", test_propagate_basic);
     g_test_add_func("/propagate/diamond", test_propagate_diamond);
     g_test_add_func("/propagate/mirror", test_propagate_mirror);
@@ -0,0 +1,144 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Interval tree unit-tests.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+#define NB_NODES    1024
+#define RANGE       (64 * 1024)
+
+typedef struct FindData {
+    uint64_t start;
+    uint64_t end;
+    IntervalTreeNode *prev;
+    int count;
+    int stop_at;
+} FindData;
+
+static bool check_overlap(IntervalTreeNode *node, void *opaque)
+{
+    FindData *d = opaque;
+
+    g_assert_cmpuint(node->start, <, d->end);
+    g_assert_cmpuint(d->start, <, node->end);
+    if (d->prev) {
+        g_assert_cmpuint(d->prev->start, <=, node->start);
+    }
+    d->prev = node;
+
+    return ++d->count == d->stop_at;
+}
+
+static void check_find(IntervalTreeRoot *root, IntervalTreeNode *nodes,
+                       bool *inserted, uint64_t start, uint64_t end)
+{
+    FindData d = { .start = start, .end = end };
+    IntervalTreeNode *found;
+    int expected = 0;
+    int i;
+
+    for (i = 0; i < NB_NODES; i++) {
+        if (inserted[i] && nodes[i].start < end && start < nodes[i].end) {
+            expected++;
+        }
+    }
+
+    found = interval_tree_find(root, start, end, check_overlap, &d);
+    g_assert(found == NULL);
+    g_assert_cmpint(d.count, ==, expected);
+
+    if (expected) {
+        d = (FindData) {
+            .start = start,
+            .end = end,
+            .stop_at = 1,
+        };
+        found = interval_tree_find(root, start, end, check_overlap, &d);
+        g_assert(found == d.prev);
+    }
+}
+
+static void test_interval_tree_basic(void)
+{
+    IntervalTreeRoot root = {};
+    IntervalTreeNode a, b, c;
+
+    g_assert(interval_tree_is_empty(&root));
+
+    interval_tree_insert(&root, &a, 0, 4096);
+    interval_tree_insert(&root, &b, 4096, 8192);
+    interval_tree_insert(&root, &c, 6000, 6000);
+    g_assert(!interval_tree_is_empty(&root));
+
+    /* Half-open intervals: [0, 4096) and [4096, 8192) do not overlap */
+    g_assert(interval_tree_find(&root, 0, 4096, check_overlap,
+                                &(FindData) { .start = 0, .end = 4096 })
+             == NULL);
+    g_assert(interval_tree_find(&root, 4095, 4096, check_overlap,
+                                &(FindData) { .start = 4095, .end = 4096,
+                                              .stop_at = 1 })
+             == &a);
+
+    /* An empty interval overlaps the ranges that strictly contain it */
+    g_assert(interval_tree_find(&root, 5000, 7000, check_overlap,
+                                &(FindData) { .start = 5000, .end = 7000,
+                                              .stop_at = 2 })
+             == &c);
+
+    interval_tree_remove(&root, &b);
+    interval_tree_remove(&root, &a);
+    interval_tree_remove(&root, &c);
+    g_assert(interval_tree_is_empty(&root));
+}
+
+static void test_interval_tree_random(void)
+{
+    IntervalTreeRoot root = {};
+    IntervalTreeNode *nodes = g_new0(IntervalTreeNode, NB_NODES);
+    bool *inserted = g_new0(bool, NB_NODES);
+    int i, n;
+
+    for (i = 0; i < 100 * NB_NODES; i++) {
+        uint64_t start, len;
+
+        n = g_test_rand_int_range(0, NB_NODES);
+        if (inserted[n]) {
+            interval_tree_remove(&root, &nodes[n]);
+            inserted[n] = false;
+        } else {
+            start = g_test_rand_int_range(0, RANGE);
+            len = g_test_rand_int_range(0, 1024);
+            interval_tree_insert(&root, &nodes[n], start, start + len);
+            inserted[n] = true;
+        }
+
+        if (i % 64 == 0) {
+            start = g_test_rand_int_range(0, RANGE);
+            len = g_test_rand_int_range(0, 4096);
+            check_find(&root, nodes, inserted, start, start + len);
+        }
+    }
+
+    for (n = 0; n < NB_NODES; n++) {
+        if (inserted[n]) {
+            interval_tree_remove(&root, &nodes[n]);
+        }
+    }
+    g_assert(interval_tree_is_empty(&root));
+
+    g_free(inserted);
+    g_free(nodes);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/interval-tree/basic", test_interval_tree_basic);
+    g_test_add_func("/interval-tree/random", test_interval_tree_random);
+
+    return g_test_run();
+}
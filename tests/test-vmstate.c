@@ -333,6 +333,74 @@ static void test_simple_array(void)
                          sizeof(wire_simple_arr)));
 }
 
+/* Large enough to straddle the QEMUFile buffer in both directions */
+#define BULK_ARRAY_LEN 10000
+
+typedef struct TestBulkArray {
+    uint8_t u8;
+    int16_t i16[3];
+    uint64_t u64[2];
+    uint32_t u32[BULK_ARRAY_LEN];
+} TestBulkArray;
+
+static const VMStateDescription vmstate_bulk_arr = {
+    .name = "bulk/array",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(u8, TestBulkArray),
+        VMSTATE_INT16_ARRAY(i16, TestBulkArray, 3),
+        VMSTATE_UINT64_ARRAY(u64, TestBulkArray, 2),
+        VMSTATE_UINT32_ARRAY(u32, TestBulkArray, BULK_ARRAY_LEN),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* Integer arrays take the bulk path; the wire format must not change */
+static void test_bulk_array(void)
+{
+    TestBulkArray *obj = g_new0(TestBulkArray, 1);
+    TestBulkArray *obj_load = g_new0(TestBulkArray, 1);
+    size_t wire_size = 1 + sizeof(obj->i16) + sizeof(obj->u64) +
+                       sizeof(obj->u32) + 1;
+    uint8_t *wire = g_malloc(wire_size);
+    uint8_t *p = wire;
+    int i;
+
+    obj->u8 = 0x5a;
+    obj->i16[0] = -2;
+    obj->i16[1] = 0x1234;
+    obj->i16[2] = 7;
+    obj->u64[0] = 0x0102030405060708ULL;
+    obj->u64[1] = -1ULL;
+    for (i = 0; i < BULK_ARRAY_LEN; i++) {
+        obj->u32[i] = i * 0x01010101u;
+    }
+
+    *p++ = obj->u8;
+    for (i = 0; i < 3; i++, p += 2) {
+        stw_be_p(p, obj->i16[i]);
+    }
+    for (i = 0; i < 2; i++, p += 8) {
+        stq_be_p(p, obj->u64[i]);
+    }
+    for (i = 0; i < BULK_ARRAY_LEN; i++, p += 4) {
+        stl_be_p(p, obj->u32[i]);
+    }
+    *p = QEMU_VM_EOF;
+
+    save_vmstate(&vmstate_bulk_arr, obj);
+    compare_vmstate(wire, wire_size);
+
+    SUCCESS(load_vmstate_one(&vmstate_bulk_arr, obj_load, 1, wire,
+                             wire_size));
+    SUCCESS(memcmp(obj, obj_load, sizeof(*obj)));
+
+    g_free(wire);
+    g_free(obj_load);
+    g_free(obj);
+}
+
 typedef struct TestStruct {
     uint32_t a, b, c, e;
     uint64_t d, f;
@@ -1498,6 +1566,7 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
     g_test_add_func("/vmstate/simple/array", test_simple_array);
+    g_test_add_func("/vmstate/simple/bulk_array", test_bulk_array);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);
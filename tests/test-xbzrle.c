@@ -13,7 +13,9 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qapi/error.h"
 #include "../migration/xbzrle.h"
+#include "../migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +176,103 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, j, dlen, expected_len, rc;
+
+    test_xbzrle_encode_reset_accel();
+    if (!test_xbzrle_encode_next_accel()) {
+        g_test_skip("no accelerated XBZRLE encoder available");
+        goto out;
+    }
+
+    for (i = 0; i < 1000; i++) {
+        int runs = g_test_rand_int_range(0, 64);
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            old[j] = g_test_rand_int_range(0, 4);
+        }
+        memcpy(new, old, PAGE_SIZE);
+        for (j = 0; j < runs; j++) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, 128);
+
+            for (; len && start < PAGE_SIZE; len--, start++) {
+                new[start] = g_test_rand_int();
+            }
+        }
+        dlen = g_test_rand_int_range(2, PAGE_SIZE + 1);
+
+        /*
+         * Every implementation must produce the same stream as the most
+         * preferred one, which is the one selected after a reset.
+         */
+        test_xbzrle_encode_reset_accel();
+        expected_len = xbzrle_encode_buffer(old, new, PAGE_SIZE, expected,
+                                            dlen);
+        if (expected_len > 0) {
+            memcpy(compressed, old, PAGE_SIZE);
+            rc = xbzrle_decode_buffer(expected, expected_len, compressed,
+                                      PAGE_SIZE);
+            g_assert(rc >= 0);
+            g_assert(memcmp(compressed, new, PAGE_SIZE) == 0);
+        }
+
+        while (test_xbzrle_encode_next_accel()) {
+            rc = xbzrle_encode_buffer(old, new, PAGE_SIZE, compressed, dlen);
+            g_assert_cmpint(rc, ==, expected_len);
+            if (rc > 0) {
+                g_assert(memcmp(compressed, expected, rc) == 0);
+            }
+        }
+    }
+
+out:
+    test_xbzrle_encode_reset_accel();
+    g_free(old);
+    g_free(new);
+    g_free(expected);
+    g_free(compressed);
+}
+
+static void test_page_cache(void)
+{
+    PageCache *cache = cache_init(16 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    /* Pages that hash to the same bucket */
+    uint64_t stride = 4 * PAGE_SIZE;
+    uint64_t i;
+
+    for (i = 0; i < 4; i++) {
+        memset(page, i, PAGE_SIZE);
+        g_assert(cache_insert(cache, i * stride, page, 1) == 0);
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * stride, 1));
+        g_assert(get_cached_data(cache, i * stride)[0] == i);
+    }
+
+    /* The bucket is full of fresh pages */
+    g_assert(cache_insert(cache, 4 * stride, page, 2) == -1);
+    g_assert(!cache_is_cached(cache, 4 * stride, 2));
+    g_assert(get_cached_data(cache, 4 * stride) == NULL);
+
+    /* Once they get old, the least recently used one is replaced */
+    g_assert(cache_is_cached(cache, 0, 3));
+    memset(page, 4, PAGE_SIZE);
+    g_assert(cache_insert(cache, 4 * stride, page, 3) == 0);
+    g_assert(cache_is_cached(cache, 0, 3));
+    g_assert(!cache_is_cached(cache, stride, 3));
+    g_assert(get_cached_data(cache, 4 * stride)[0] == 4);
+
+    g_free(page);
+    cache_fini(cache);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +285,9 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/page_cache", test_page_cache);
+    /* Must come last, it switches to the least preferred encoder */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
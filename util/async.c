@@ -322,6 +322,11 @@ aio_ctx_finalize(GSource     *source)
         luring_cleanup(ctx->linux_io_uring);
         ctx->linux_io_uring = NULL;
     }
+    if (ctx->linux_io_uring_sqpoll) {
+        luring_detach_aio_context(ctx->linux_io_uring_sqpoll, ctx);
+        luring_cleanup(ctx->linux_io_uring_sqpoll);
+        ctx->linux_io_uring_sqpoll = NULL;
+    }
 #endif
 
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
@@ -386,25 +391,32 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
+LuringState *aio_setup_linux_io_uring(AioContext *ctx, bool sqpoll,
+                                      Error **errp)
 {
-    if (ctx->linux_io_uring) {
-        return ctx->linux_io_uring;
+    LuringState **s = sqpoll ? &ctx->linux_io_uring_sqpoll
+                             : &ctx->linux_io_uring;
+
+    if (*s) {
+        return *s;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
-    if (!ctx->linux_io_uring) {
+    *s = luring_init(sqpoll, errp);
+    if (!*s) {
         return NULL;
     }
 
-    luring_attach_aio_context(ctx->linux_io_uring, ctx);
-    return ctx->linux_io_uring;
+    luring_attach_aio_context(*s, ctx);
+    return *s;
 }
 
-LuringState *aio_get_linux_io_uring(AioContext *ctx)
+LuringState *aio_get_linux_io_uring(AioContext *ctx, bool sqpoll)
 {
-    assert(ctx->linux_io_uring);
-    return ctx->linux_io_uring;
+    LuringState *s = sqpoll ? ctx->linux_io_uring_sqpoll
+                            : ctx->linux_io_uring;
+
+    assert(s);
+    return s;
 }
 #endif
 
@@ -0,0 +1,164 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+/* Nodes are ordered by start offset, ties are broken by address */
+static bool node_less(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    if (a->start != b->start) {
+        return a->start < b->start;
+    }
+    return (uintptr_t)a < (uintptr_t)b;
+}
+
+static void node_update(IntervalTreeNode *n)
+{
+    n->subtree_end = n->end;
+    if (n->left && n->left->subtree_end > n->subtree_end) {
+        n->subtree_end = n->left->subtree_end;
+    }
+    if (n->right && n->right->subtree_end > n->subtree_end) {
+        n->subtree_end = n->right->subtree_end;
+    }
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *n)
+{
+    IntervalTreeNode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *n)
+{
+    IntervalTreeNode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+static IntervalTreeNode *do_insert(IntervalTreeNode *t, IntervalTreeNode *node)
+{
+    if (!t) {
+        return node;
+    }
+
+    if (node_less(node, t)) {
+        t->left = do_insert(t->left, node);
+        if (t->left->priority > t->priority) {
+            return rotate_right(t);
+        }
+    } else {
+        t->right = do_insert(t->right, node);
+        if (t->right->priority > t->priority) {
+            return rotate_left(t);
+        }
+    }
+
+    node_update(t);
+    return t;
+}
+
+/* Joins two treaps; all nodes in @a must be less than those in @b */
+static IntervalTreeNode *merge(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+
+    if (a->priority > b->priority) {
+        a->right = merge(a->right, b);
+        node_update(a);
+        return a;
+    } else {
+        b->left = merge(a, b->left);
+        node_update(b);
+        return b;
+    }
+}
+
+static IntervalTreeNode *do_remove(IntervalTreeNode *t, IntervalTreeNode *node)
+{
+    if (t == node) {
+        return merge(t->left, t->right);
+    }
+
+    assert(t);
+    if (node_less(node, t)) {
+        t->left = do_remove(t->left, node);
+    } else {
+        t->right = do_remove(t->right, node);
+    }
+
+    node_update(t);
+    return t;
+}
+
+static IntervalTreeNode *do_find(IntervalTreeNode *t,
+                                 uint64_t start, uint64_t end,
+                                 IntervalTreeFunc func, void *opaque)
+{
+    IntervalTreeNode *found;
+
+    while (t && t->subtree_end > start) {
+        found = do_find(t->left, start, end, func, opaque);
+        if (found) {
+            return found;
+        }
+
+        /* Everything from here on starts too late */
+        if (t->start >= end) {
+            return NULL;
+        }
+        if (t->end > start && func(t, opaque)) {
+            return t;
+        }
+        t = t->right;
+    }
+
+    return NULL;
+}
+
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node,
+                          uint64_t start, uint64_t end)
+{
+    /* A linear congruential generator is random enough to balance a treap */
+    root->seed = root->seed * 1103515245 + 12345;
+
+    *node = (IntervalTreeNode) {
+        .start          = start,
+        .end            = end,
+        .subtree_end    = end,
+        .priority       = root->seed,
+    };
+    root->root = do_insert(root->root, node);
+}
+
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    root->root = do_remove(root->root, node);
+    node->left = node->right = NULL;
+}
+
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t end,
+                                     IntervalTreeFunc func, void *opaque)
+{
+    return do_find(root->root, start, end, func, opaque);
+}